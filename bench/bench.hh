@@ -0,0 +1,62 @@
+// Benchmark support.
+
+#ifndef __BENCH_HH__
+#define __BENCH_HH__
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "oid.hh"
+
+namespace bench {
+
+using args_type = std::vector<std::string>;
+
+// Each benchmark is a function taking the remaining command line
+// arguments.
+void search(const args_type& args);
+void map(const args_type& args);
+void lookup(const args_type& args);
+void insert(const args_type& args);
+void ingest(const args_type& args);
+void durability(const args_type& args);
+void open(const args_type& args);
+void read(const args_type& args);
+void recover(const args_type& args);
+void codec(const args_type& args);
+void dictionary(const args_type& args);
+
+// Simple wall-clock timer.
+class Timer {
+  using clock = std::chrono::steady_clock;
+  clock::time_point start;
+ public:
+  Timer() :start(clock::now()) {}
+
+  // Seconds elapsed since construction.
+  double elapsed() const {
+    return std::chrono::duration<double>(clock::now() - start).count();
+  }
+};
+
+// Generate a distinct OID for each integer.
+inline cdump::OID int_oid(uint64_t index) {
+  return cdump::OID("blob", &index, sizeof(index));
+}
+
+// Parse the arguments as a list of sizes, using the defaults if there
+// are none.
+std::vector<uint64_t> parse_sizes(const args_type& args,
+				  const std::vector<uint64_t>& defaults);
+
+// Keep the compiler from discarding a computed result.
+void consume(uint64_t value);
+
+// The resident memory of the process, in bytes.
+uint64_t resident_bytes();
+
+} // namespace bench
+
+#endif // __BENCH_HH__
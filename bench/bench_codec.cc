@@ -0,0 +1,107 @@
+// Benchmark the compression codecs.
+//
+// Compresses text-like data in blocks of each size with each codec,
+// and reports the ratio, and the compression and decompression
+// speeds in MB/s of uncompressed data.
+//
+// Usage: cdbench codec [sizes...]
+
+#include "bench.hh"
+#include "codec.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+namespace bench {
+
+namespace {
+
+const uint64_t total_bytes = 64 << 20;
+
+// Words with a skewed distribution, and some numbers, which is
+// roughly how log files and source code compress.
+std::vector<char> make_text(uint64_t size) {
+  static const char* const words[] = {
+    "the", "of", "and", "chunk", "pool", "index", "return", "const",
+    "unsigned", "data", "size", "file", "error", "offset", "kind",
+    "for", "if", "while", "std::vector", "<char>", "{", "}", ";",
+    "(", ")", "=", "\n", "\n  ", "\n    ",
+  };
+  const unsigned word_count = sizeof(words) / sizeof(words[0]);
+
+  std::mt19937_64 gen(size);
+  std::geometric_distribution<unsigned> pick(0.15);
+  std::vector<char> result;
+  while (result.size() < size) {
+    if (gen() % 8 == 0) {
+      const auto number = std::to_string(gen() % 100000);
+      result.insert(result.end(), number.begin(), number.end());
+    } else {
+      const char* word = words[pick(gen) % word_count];
+      result.insert(result.end(), word, word + strlen(word));
+    }
+    result.push_back(' ');
+  }
+  result.resize(size);
+  return result;
+}
+
+void run(const cdump::Codec& codec, uint64_t size) {
+  const uint64_t count = std::max<uint64_t>(total_bytes / size, 1);
+  const auto text = make_text(size * std::min<uint64_t>(count, 16));
+  const uint64_t blocks = text.size() / size;
+
+  std::vector<std::vector<char>> zdata(blocks);
+  std::vector<int> zlens(blocks);
+  uint64_t zbytes = 0;
+
+  Timer ctimer;
+  for (uint64_t i = 0; i < count; ++i) {
+    const auto block = i % blocks;
+    zdata[block].resize(size);
+    zlens[block] = codec.compress(text.data() + block * size, size,
+				  zdata[block].data());
+    zbytes += zlens[block] < 0 ? size : zlens[block];
+  }
+  const double csecs = ctimer.elapsed();
+
+  std::vector<char> out(size);
+  uint64_t sum = 0;
+  Timer dtimer;
+  for (uint64_t i = 0; i < count; ++i) {
+    const auto block = i % blocks;
+    if (zlens[block] < 0)
+      continue;
+    codec.decompress(zdata[block].data(), zlens[block], out.data(), size);
+    sum += out[size / 2];
+  }
+  const double dsecs = dtimer.elapsed();
+  consume(sum);
+
+  std::cout << std::setw(6) << codec.name()
+	    << std::setw(10) << size
+	    << std::setw(8) << std::fixed << std::setprecision(2)
+	    << double(count * size) / zbytes
+	    << std::setw(10) << std::setprecision(0)
+	    << count * size / 1e6 / csecs
+	    << std::setw(10) << count * size / 1e6 / dsecs
+	    << std::endl;
+}
+
+} // namespace
+
+void codec(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 1024, 4096, 16384, 65536, 1 << 20 });
+
+  std::cout << " codec      size   ratio      comp    decomp" << std::endl;
+  for (const auto codec : cdump::Codec::all()) {
+    for (auto size : sizes)
+      run(*codec, size);
+  }
+}
+
+} // namespace bench
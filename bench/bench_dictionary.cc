@@ -0,0 +1,101 @@
+// Benchmark compressing small chunks with trained dictionaries.
+//
+// Makes chunks that look like directories, a few hundred bytes each,
+// trains dictionaries of each size on some of them, and compresses
+// the rest, without a dictionary, and then with each.  Reports the
+// ratio, and the speeds in MB/s of uncompressed data.
+//
+// Usage: cdbench dictionary [dictionary sizes...]
+
+#include "bench.hh"
+#include "codec.hh"
+#include "dictionary.hh"
+#include "sampledir.hh"
+
+#include <iomanip>
+#include <iostream>
+
+namespace bench {
+
+namespace {
+
+const unsigned train_count = 2000;
+const unsigned test_count = 20000;
+
+void run(const std::string& label, const cdump::Codec& codec,
+	 const cdump::Dictionary::Ptr& dict,
+	 const std::vector<std::string>& dirs)
+{
+  const cdump::DictionarySet dicts(
+    dict ? std::vector<cdump::Dictionary::Ptr> { dict } :
+    std::vector<cdump::Dictionary::Ptr>());
+
+  std::vector<std::vector<char>> zdata(dirs.size());
+  std::vector<int> zlens(dirs.size());
+  uint64_t bytes = 0, zbytes = 0;
+
+  Timer ctimer;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    zdata[i].resize(dirs[i].size());
+    zlens[i] = dict ?
+      codec.compress_with(dirs[i].data(), dirs[i].size(), zdata[i].data(),
+			  *dict) :
+      codec.compress(dirs[i].data(), dirs[i].size(), zdata[i].data());
+    bytes += dirs[i].size();
+    zbytes += zlens[i] < 0 ? dirs[i].size() : zlens[i];
+  }
+  const double csecs = ctimer.elapsed();
+
+  std::vector<char> out;
+  uint64_t sum = 0;
+  Timer dtimer;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    if (zlens[i] < 0)
+      continue;
+    out.resize(dirs[i].size());
+    codec.decompress_with(zdata[i].data(), zlens[i], out.data(), out.size(),
+			  &dicts);
+    sum += out[0];
+  }
+  const double dsecs = dtimer.elapsed();
+  consume(sum);
+
+  std::cout << std::setw(12) << label
+	    << std::setw(8) << std::fixed << std::setprecision(2)
+	    << double(bytes) / zbytes
+	    << std::setw(10) << std::setprecision(0) << bytes / 1e6 / csecs
+	    << std::setw(10) << bytes / 1e6 / dsecs
+	    << std::endl;
+}
+
+} // namespace
+
+void dictionary(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 4096, 8192, 16384, 32768 });
+
+  std::vector<std::string> sample, dirs;
+  for (unsigned i = 0; i < train_count; ++i)
+    sample.push_back(cdump::sample_dir(i));
+  uint64_t bytes = 0;
+  for (unsigned i = 0; i < test_count; ++i) {
+    dirs.push_back(cdump::sample_dir(train_count + i));
+    bytes += dirs.back().size();
+  }
+  std::cout << "average chunk " << bytes / test_count << " bytes\n"
+	    << "  dictionary   ratio      comp    decomp" << std::endl;
+
+  run("lz", cdump::Codec::by_name("lz"), nullptr, dirs);
+  run("zlib", cdump::Codec::by_name("zlib"), nullptr, dirs);
+  for (auto size : sizes) {
+    Timer timer;
+    const auto dict = std::make_shared<cdump::Dictionary>(
+      "dir ", cdump::Dictionary::train(sample, size));
+    const double secs = timer.elapsed();
+    run("zlib+" + std::to_string(size), cdump::Codec::by_name("zlib"),
+	dict, dirs);
+    std::cout << "    (trained in " << std::setprecision(3) << secs
+	      << " s)" << std::endl;
+  }
+}
+
+} // namespace bench
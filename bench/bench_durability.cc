@@ -0,0 +1,81 @@
+// Benchmark the durability policies.
+//
+// Inserts small chunks, flushing every few inserts, the way a backup
+// flushes after each file, under each policy.  The scratch pool goes
+// in the temporary directory, so set TMPDIR to somewhere on a real
+// disk, since syncs on tmpfs cost nothing.
+//
+// Usage: cdbench durability [chunks [flush-every]]
+
+#include "bench.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+namespace {
+
+const unsigned chunk_size = 4096;
+
+void run(const std::string& name, const cdump::Pool::Durability& durability,
+	 uint64_t chunks, uint64_t flush_every)
+{
+  const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+  bf::create_directory(dir);
+  cdump::Pool::create_pool(dir.string());
+
+  std::vector<char> data(chunk_size);
+  Timer timer;
+  {
+    cdump::Pool pool(dir.string(), true);
+    pool.set_durability(durability);
+    for (uint64_t i = 0; i < chunks; ++i) {
+      memcpy(data.data(), &i, sizeof(i));
+      cdump::PlainChunk chunk("blob", data.data(), data.size());
+      pool.insert(chunk);
+      if ((i + 1) % flush_every == 0)
+	pool.flush();
+    }
+  }
+  const double secs = timer.elapsed();
+
+  std::cout << std::setw(14) << name
+	    << std::setw(12) << std::fixed << std::setprecision(0)
+	    << chunks / secs << " inserts/s"
+	    << std::endl;
+
+  bf::remove_all(dir);
+}
+
+} // namespace
+
+void durability(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 20000, 10 });
+  const uint64_t chunks = sizes[0];
+  const uint64_t flush_every = sizes.size() > 1 ? sizes[1] : 10;
+
+  std::cout << chunks << " chunks of " << chunk_size
+	    << " bytes, flushing every " << flush_every
+	    << ", in " << bf::temp_directory_path().string() << std::endl;
+
+  using Durability = cdump::Pool::Durability;
+  Durability policy;
+  run("none", policy, chunks, flush_every);
+
+  policy.mode = Durability::Flush;
+  run("flush", policy, chunks, flush_every);
+
+  policy.mode = Durability::Group;
+  policy.interval = std::chrono::milliseconds(10);
+  run("group 10ms", policy, chunks, flush_every);
+  policy.interval = std::chrono::milliseconds(100);
+  run("group 100ms", policy, chunks, flush_every);
+}
+
+} // namespace bench
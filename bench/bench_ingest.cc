@@ -0,0 +1,100 @@
+// Benchmark the ingest pipeline.
+//
+// Stores the same data by building and inserting each chunk on the
+// calling thread, and then through an Ingest pipeline with varying
+// numbers of workers.
+//
+// Usage: cdbench ingest [workers...]
+
+#include "bench.hh"
+#include "ingest.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+namespace {
+
+const unsigned chunk_size = 64 << 10;
+const unsigned chunk_count = 2000;
+
+// Data that compresses about in half, so zlib does real work.
+std::vector<cdump::Chunk::data_type> make_data() {
+  std::mt19937 gen(1);
+  std::vector<cdump::Chunk::data_type> result;
+  for (unsigned i = 0; i < chunk_count; ++i) {
+    cdump::Chunk::data_type data(chunk_size);
+    for (unsigned j = 0; j < chunk_size; ++j)
+      data[j] = gen() % 16;
+    result.push_back(std::move(data));
+  }
+  return result;
+}
+
+// Run `store` on a copy of the data against a scratch pool, and
+// report the rate.  The copy is made outside of the timing.
+template<class F>
+void run(const std::string& name, std::vector<cdump::Chunk::data_type> data,
+	 F store)
+{
+  const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+  bf::create_directory(dir);
+  cdump::Pool::create_pool(dir.string());
+
+  Timer timer;
+  {
+    cdump::Pool pool(dir.string(), true);
+    store(pool, data);
+    pool.flush();
+  }
+  const double secs = timer.elapsed();
+
+  std::cout << std::setw(12) << name
+	    << std::setw(12) << std::fixed << std::setprecision(1)
+	    << double(chunk_count) * chunk_size / secs / (1 << 20) << " MB/s"
+	    << std::endl;
+
+  bf::remove_all(dir);
+}
+
+} // namespace
+
+void ingest(const args_type& args) {
+  const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<uint64_t> defaults { 1 };
+  for (unsigned count = 2; count <= cores; count *= 2)
+    defaults.push_back(count);
+  const auto worker_counts = parse_sizes(args, defaults);
+
+  std::cout << chunk_count << " chunks of " << chunk_size << " bytes, "
+	    << cores << " hardware threads" << std::endl;
+
+  const auto data = make_data();
+  run("serial", data, [](cdump::Pool& pool,
+			 std::vector<cdump::Chunk::data_type>& data) {
+	for (auto& elt : data) {
+	  cdump::PlainChunk chunk("blob", std::move(elt));
+	  pool.insert(chunk);
+	}
+      });
+
+  for (const auto workers : worker_counts) {
+    run("workers=" + std::to_string(workers), data,
+	[workers](cdump::Pool& pool,
+		  std::vector<cdump::Chunk::data_type>& data) {
+	  cdump::Ingest ingest(pool, workers);
+	  for (auto& elt : data)
+	    ingest.submit("blob", std::move(elt));
+	});
+  }
+}
+
+} // namespace bench
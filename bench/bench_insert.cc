@@ -0,0 +1,83 @@
+// Benchmark pool inserts.
+//
+// Inserts chunks of a range of sizes into a scratch pool, and reports
+// the rate.  The chunks are built, hashed and compressed beforehand,
+// so only the writing is timed.
+//
+// Usage: cdbench insert [sizes...]
+
+#include "bench.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+namespace {
+
+// Write this much data for each size, or at least min_count chunks.
+const uint64_t total_bytes = 256 << 20;
+const uint64_t min_count = 64;
+const uint64_t max_count = 200000;
+
+// Chunks whose data is half random, so they compress some.
+std::vector<cdump::Chunk::ChunkPtr> make_chunks(uint64_t size, uint64_t count) {
+  std::mt19937 gen(size);
+  std::vector<cdump::Chunk::ChunkPtr> chunks;
+  std::vector<char> data(size);
+  for (uint64_t i = 0; i < count; ++i) {
+    for (uint64_t j = 0; j < size; ++j)
+      data[j] = j % 2 == 0 ? char(gen()) : char(j);
+    memcpy(data.data(), &i, std::min(size, uint64_t(sizeof(i))));
+    chunks.emplace_back(new cdump::PlainChunk("blob", data.data(), size));
+    chunks.back()->write_size();
+  }
+  return chunks;
+}
+
+} // namespace
+
+void insert(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 64, 256, 1024, 4096, 16384,
+					 65536, 262144, 1048576 });
+
+  std::cout << std::setw(10) << "size"
+	    << std::setw(14) << "inserts/s"
+	    << std::setw(10) << "MB/s"
+	    << std::endl;
+  for (const auto size : sizes) {
+    const auto count = std::min(max_count,
+				std::max(min_count, total_bytes / size));
+    const auto chunks = make_chunks(size, count);
+
+    const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+    bf::create_directory(dir);
+    cdump::Pool::create_pool(dir.string());
+
+    Timer timer;
+    {
+      cdump::Pool pool(dir.string(), true);
+      for (const auto& chunk : chunks)
+	pool.insert(*chunk);
+      pool.flush();
+    }
+    const double secs = timer.elapsed();
+
+    std::cout << std::setw(10) << size
+	      << std::setw(14) << std::fixed << std::setprecision(0)
+	      << count / secs
+	      << std::setw(10) << std::setprecision(1)
+	      << count * size / secs / (1 << 20)
+	      << std::endl;
+
+    bf::remove_all(dir);
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,85 @@
+// Benchmark batched pool lookups.
+//
+// Builds a pool of small chunks in a scratch directory, and then
+// checks for a set of keys, half of which are present, first one
+// `find` at a time, and then with a single `locate_many` and
+// `find_many`.
+//
+// Usage: cdbench lookup [chunks [keys]]
+
+#include "bench.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+namespace {
+
+void report(const char* name, size_t count, double secs) {
+  std::cout << std::setw(14) << name
+	    << std::setw(14) << std::fixed << std::setprecision(0)
+	    << count / secs << " keys/s"
+	    << std::endl;
+}
+
+} // namespace
+
+void lookup(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 1000000, 100000 });
+  const size_t chunks = sizes[0];
+  const size_t lookups = sizes.size() > 1 ? sizes[1] : 100000;
+
+  const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+  bf::create_directory(dir);
+  cdump::Pool::create_pool(dir.string());
+
+  {
+    cdump::Pool pool(dir.string(), true);
+    for (size_t i = 0; i < chunks; ++i) {
+      const uint64_t data[8] = { i };
+      cdump::PlainChunk chunk("blob", reinterpret_cast<const char*>(data),
+			      sizeof(data));
+      pool.insert(chunk);
+    }
+  }
+
+  std::vector<cdump::OID> keys;
+  for (size_t i = 0; i < lookups; ++i) {
+    const uint64_t data[8] = { i % 2 == 0 ? i * 7 % chunks : chunks + i };
+    keys.emplace_back("blob", data, sizeof(data));
+  }
+
+  std::cout << chunks << " chunks, " << lookups << " keys" << std::endl;
+  {
+    cdump::Pool pool(dir.string());
+    // Build the pool index outside of the timing.
+    consume(bool(pool.find(keys[0])));
+
+    Timer single_timer;
+    uint64_t found = 0;
+    for (const auto& key : keys)
+      found += bool(pool.find(key));
+    report("find", lookups, single_timer.elapsed());
+
+    Timer locate_timer;
+    for (const auto& res : pool.locate_many(keys.data(), keys.size()))
+      found += res.found;
+    report("locate_many", lookups, locate_timer.elapsed());
+
+    Timer many_timer;
+    for (const auto& ch : pool.find_many(keys.data(), keys.size()))
+      found += bool(ch);
+    report("find_many", lookups, many_timer.elapsed());
+    consume(found);
+  }
+
+  bf::remove_all(dir);
+}
+
+} // namespace bench
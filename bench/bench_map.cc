@@ -0,0 +1,92 @@
+// Benchmark the in-memory index map.
+//
+// Compares std::unordered_map, which FileIndex used to keep unsaved
+// entries in, with the flat OIDMap, for insert and find throughput,
+// and the memory each needs.
+//
+// Usage: cdbench map [entries...]
+
+#include "bench.hh"
+#include "index.hh"
+#include "oidmap.hh"
+
+#include <iomanip>
+#include <iostream>
+#include <unordered_map>
+
+namespace bench {
+
+namespace {
+
+using Node = cdump::FileIndex::Node;
+
+// The two maps report a miss differently.
+template<class K, class V>
+typename std::unordered_map<K, V>::const_iterator
+lookup_end(const std::unordered_map<K, V>& map) {
+  return map.end();
+}
+
+template<class V>
+const typename cdump::OIDMap<V>::value_type*
+lookup_end(const cdump::OIDMap<V>&) {
+  return nullptr;
+}
+
+template<class M>
+void run(const char* name, const std::vector<cdump::OID>& keys,
+	 const std::vector<cdump::OID>& absent)
+{
+  const auto base = resident_bytes();
+  {
+    M map;
+
+    Timer insert_timer;
+    for (size_t i = 0; i < keys.size(); ++i)
+      map.insert(std::make_pair(keys[i], Node(i, "blob")));
+    const double insert_secs = insert_timer.elapsed();
+    const auto used = resident_bytes() - base;
+
+    Timer find_timer;
+    uint64_t found = 0;
+    for (const auto& key : keys)
+      found += bool(map.find(key) != lookup_end(map));
+    const double find_secs = find_timer.elapsed();
+
+    Timer miss_timer;
+    for (const auto& key : absent)
+      found += bool(map.find(key) != lookup_end(map));
+    const double miss_secs = miss_timer.elapsed();
+    consume(found);
+
+    std::cout << "  " << std::left << std::setw(14) << name << std::right
+	      << std::fixed << std::setprecision(1)
+	      << std::setw(8) << keys.size() / insert_secs / 1e6 << " M ins/s"
+	      << std::setw(8) << keys.size() / find_secs / 1e6 << " M find/s"
+	      << std::setw(8) << absent.size() / miss_secs / 1e6 << " M miss/s"
+	      << std::setw(8) << double(used) / keys.size() << " bytes/entry"
+	      << std::endl;
+  }
+}
+
+} // namespace
+
+void map(const args_type& args) {
+  for (auto count : parse_sizes(args, { 10000000 })) {
+    std::cout << count << " entries" << std::endl;
+
+    std::vector<cdump::OID> keys;
+    std::vector<cdump::OID> absent;
+    keys.reserve(count);
+    absent.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      keys.push_back(int_oid(i));
+      absent.push_back(int_oid(count + i));
+    }
+
+    run<std::unordered_map<cdump::OID, Node>>("unordered_map", keys, absent);
+    run<cdump::OIDMap<Node>>("OIDMap", keys, absent);
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,82 @@
+// Benchmark opening a pool.
+//
+// Builds a pool with many files, then repeatedly opens it and lists
+// its backups, which is all that some commands need, and separately
+// opens it and looks up one chunk, which needs every index.
+//
+// Usage: cdbench open [files [opens]]
+
+#include "bench.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+namespace {
+
+const unsigned chunks_per_file = 20;
+
+void report(const std::string& name, uint64_t opens, double secs) {
+  std::cout << std::setw(14) << name
+	    << std::setw(12) << std::fixed << std::setprecision(3)
+	    << secs * 1000.0 / opens << " ms/open"
+	    << std::endl;
+}
+
+} // namespace
+
+void open(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 1000, 20 });
+  const uint64_t files = sizes[0];
+  const uint64_t opens = sizes.size() > 1 ? sizes[1] : 20;
+
+  const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+  bf::create_directory(dir);
+  cdump::Pool::create_pool(dir.string(), cdump::Pool::default_limit, true);
+
+  // Each session with `newfile` set starts a new file.
+  std::vector<char> data(256);
+  uint64_t index = 0;
+  for (uint64_t f = 0; f < files; ++f) {
+    cdump::Pool pool(dir.string(), true);
+    for (unsigned i = 0; i < chunks_per_file; ++i, ++index) {
+      memcpy(data.data(), &index, sizeof(index));
+      cdump::PlainChunk chunk("blob", data.data(), data.size());
+      pool.insert(chunk);
+    }
+  }
+
+  std::cout << files << " files, " << index << " chunks, in "
+	    << bf::temp_directory_path().string() << std::endl;
+
+  {
+    Timer timer;
+    for (uint64_t i = 0; i < opens; ++i) {
+      cdump::Pool pool(dir.string());
+      consume(pool.get_backups().size());
+    }
+    report("backups", opens, timer.elapsed());
+  }
+
+  {
+    const uint64_t key = index / 2;
+    memcpy(data.data(), &key, sizeof(key));
+    cdump::PlainChunk chunk("blob", data.data(), data.size());
+    Timer timer;
+    for (uint64_t i = 0; i < opens; ++i) {
+      cdump::Pool pool(dir.string());
+      consume(bool(pool.find(chunk.oid())));
+    }
+    report("first lookup", opens, timer.elapsed());
+  }
+
+  bf::remove_all(dir);
+}
+
+} // namespace bench
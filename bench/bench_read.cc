@@ -0,0 +1,88 @@
+// Benchmark reading large chunks back from a pool.
+//
+// Stores incompressible blobs of each size, the way file data of a
+// restore is stored, then reads them all back, with and without
+// mapped reads.  The pool is in the page cache by then, so this
+// measures the copying, not the disk.
+//
+// Usage: cdbench read [sizes...]
+
+#include "bench.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+namespace {
+
+const uint64_t total_bytes = 256 << 20;
+
+void run(uint64_t size) {
+  const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+  bf::create_directory(dir);
+  cdump::Pool::create_pool(dir.string());
+
+  const uint64_t count = std::max<uint64_t>(total_bytes / size, 1);
+  std::vector<cdump::OID> oids;
+  {
+    std::mt19937_64 gen(size);
+    std::vector<char> data(size);
+    cdump::Pool pool(dir.string(), true);
+    for (uint64_t i = 0; i < count; ++i) {
+      for (uint64_t pos = 0; pos + 8 <= size; pos += 8) {
+	const uint64_t word = gen();
+	memcpy(data.data() + pos, &word, 8);
+      }
+      cdump::PlainChunk chunk("blob", data.data(), data.size());
+      pool.insert(chunk);
+      oids.push_back(chunk.oid());
+    }
+  }
+
+  std::cout << std::setw(10) << size;
+  for (const bool mapped : { false, true }) {
+    cdump::Pool pool(dir.string());
+    pool.set_mapped_reads(mapped);
+    // Once to bring everything into the page cache.
+    for (int pass = 0; pass < 2; ++pass) {
+      uint64_t sum = 0;
+      Timer timer;
+      for (const auto& oid : oids) {
+	// Touch every cache line, as writing the data out would.
+	const auto chunk = pool.find(oid);
+	const char* data = chunk->data();
+	for (unsigned pos = 0; pos < chunk->size(); pos += 64)
+	  sum += data[pos];
+      }
+      const double secs = timer.elapsed();
+      consume(sum);
+      if (pass == 1)
+	std::cout << std::setw(12) << std::fixed << std::setprecision(0)
+		  << count * size / 1e6 / secs;
+    }
+  }
+  std::cout << std::endl;
+
+  bf::remove_all(dir);
+}
+
+} // namespace
+
+void read(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 4096, 65536, 1 << 20, 8 << 20 });
+
+  std::cout << std::setw(10) << "size"
+	    << std::setw(12) << "read MB/s"
+	    << std::setw(12) << "mapped MB/s" << std::endl;
+  for (const auto size : sizes)
+    run(size);
+}
+
+} // namespace bench
@@ -0,0 +1,68 @@
+// Benchmark index recovery.
+//
+// Builds a pool of several files of small chunks, removes the
+// indexes, and times rebuilding them.  The data files will usually
+// still be in the page cache, so this mostly measures the cost per
+// chunk, rather than the disk.
+//
+// Usage: cdbench recover [files [chunks-per-file]]
+
+#include "bench.hh"
+#include "pool.hh"
+
+#include <iomanip>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace bench {
+
+void recover(const args_type& args) {
+  const auto sizes = parse_sizes(args, { 4, 200000 });
+  const uint64_t files = sizes[0];
+  const uint64_t per_file = sizes.size() > 1 ? sizes[1] : 200000;
+
+  const auto dir = bf::temp_directory_path() / bf::unique_path("cdbench-%%%%%%%%");
+  bf::create_directory(dir);
+  cdump::Pool::create_pool(dir.string(), cdump::Pool::default_limit, true);
+
+  std::vector<char> data(256);
+  uint64_t index = 0;
+  for (uint64_t f = 0; f < files; ++f) {
+    cdump::Pool pool(dir.string(), true);
+    for (uint64_t i = 0; i < per_file; ++i, ++index) {
+      memcpy(data.data(), &index, sizeof(index));
+      cdump::PlainChunk chunk("blob", data.data(), data.size());
+      pool.insert(chunk);
+    }
+  }
+
+  uint64_t bytes = 0;
+  for (auto elt = bf::directory_iterator(dir);
+       elt != bf::directory_iterator();
+       ++elt) {
+    const auto ext = elt->path().extension().string();
+    if (ext == ".idx" || ext == ".jnl")
+      bf::remove(elt->path());
+    else if (ext == ".data")
+      bytes += bf::file_size(elt->path());
+  }
+
+  Timer timer;
+  cdump::Pool::recover_index(dir.string());
+  const double secs = timer.elapsed();
+
+  std::cout << files << " files, " << index << " chunks, "
+	    << std::fixed << std::setprecision(1)
+	    << bytes / 1e6 << " MB: "
+	    << std::setprecision(3) << secs << " s, "
+	    << std::setprecision(0) << index / secs << " chunks/s, "
+	    << std::setprecision(1) << bytes / 1e6 / secs << " MB/s"
+	    << std::endl;
+
+  bf::remove_all(dir);
+}
+
+} // namespace bench
@@ -0,0 +1,132 @@
+// Benchmark lookups within a sorted index.
+//
+// Compares the plain binary search, the interpolation search used for
+// version 4 indexes, and the Eytzinger search used for version 5, over
+// a table laid out like a saved index: hashes with a 256-entry fanout
+// on the first byte.
+//
+// Usage: cdbench search [entries...]
+
+#include "bench.hh"
+#include "search.hh"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+namespace bench {
+
+namespace {
+
+struct Table {
+  std::vector<cdump::OID> hashes;
+  std::vector<uint32_t> tops;
+
+  // The same hashes, with each bucket in Eytzinger order.
+  std::vector<cdump::OID> tree;
+
+  Table(uint64_t count);
+};
+
+Table::Table(uint64_t count) {
+  hashes.reserve(count);
+  for (uint64_t i = 0; i < count; ++i)
+    hashes.push_back(int_oid(i));
+  std::sort(hashes.begin(), hashes.end());
+
+  tops.assign(256, 0);
+  for (const auto& hash : hashes)
+    ++tops[hash.peek_first()];
+  uint32_t total = 0;
+  for (auto& top : tops) {
+    total += top;
+    top = total;
+  }
+
+  tree.resize(count);
+  std::vector<uint32_t> order;
+  uint32_t low = 0;
+  for (const auto high : tops) {
+    cdump::eytzinger_order(high - low, order);
+    for (uint32_t rank = 0; rank < order.size(); ++rank)
+      tree[low + order[rank]] = hashes[low + rank];
+    low = high;
+  }
+}
+
+// The two strategies being compared, both restricted to the fanout
+// bucket, the way FileData::find does it.
+bool find_binary(const Table& table, const cdump::OID& key) {
+  const auto first = key.peek_first();
+  const size_t low = first > 0 ? table.tops[first - 1] : 0;
+  size_t pos;
+  return cdump::binary_search_oid(table.hashes.data(), low,
+				  table.tops[first], key, pos);
+}
+
+bool find_interpolation(const Table& table, const cdump::OID& key) {
+  const auto first = key.peek_first();
+  const size_t low = first > 0 ? table.tops[first - 1] : 0;
+  const uint64_t low_word = uint64_t(first) << 56;
+  const uint64_t high_word = low_word | ((uint64_t(1) << 56) - 1);
+  size_t pos;
+  return cdump::interpolation_search_oid(table.hashes.data(), low,
+					 table.tops[first], low_word,
+					 high_word, key, pos);
+}
+
+bool find_eytzinger(const Table& table, const cdump::OID& key) {
+  const auto first = key.peek_first();
+  const size_t low = first > 0 ? table.tops[first - 1] : 0;
+  size_t pos;
+  return cdump::eytzinger_search_oid(table.tree.data() + low,
+				     table.tops[first] - low, key, pos);
+}
+
+template<class F>
+void run(const char* name, const std::vector<cdump::OID>& keys,
+	 const Table& table, F find)
+{
+  Timer timer;
+  uint64_t found = 0;
+  for (const auto& key : keys)
+    found += find(table, key);
+  const double secs = timer.elapsed();
+  consume(found);
+  std::cout << "  " << std::left << std::setw(14) << name
+	    << std::right << std::setw(10) << std::fixed
+	    << std::setprecision(1) << secs * 1e9 / keys.size()
+	    << " ns/lookup  (" << found << " found)\n";
+}
+
+} // namespace
+
+void search(const args_type& args) {
+  const uint64_t lookups = 2000000;
+
+  for (auto count : parse_sizes(args, { 1000000, 10000000, 100000000 })) {
+    std::cout << count << " entries" << std::endl;
+    Table table(count);
+
+    // Present keys in random order, and absent keys.
+    std::mt19937_64 gen(count);
+    std::vector<cdump::OID> present;
+    std::vector<cdump::OID> absent;
+    present.reserve(lookups);
+    absent.reserve(lookups);
+    for (uint64_t i = 0; i < lookups; ++i) {
+      present.push_back(int_oid(gen() % count));
+      absent.push_back(int_oid(count + i));
+    }
+
+    run("binary", present, table, find_binary);
+    run("interpolation", present, table, find_interpolation);
+    run("eytzinger", present, table, find_eytzinger);
+    run("binary-miss", absent, table, find_binary);
+    run("interp-miss", absent, table, find_interpolation);
+    run("eytz-miss", absent, table, find_eytzinger);
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,82 @@
+// Benchmark driver.
+//
+// Usage: cdbench <benchmark> [args...]
+
+#include "bench.hh"
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unistd.h>
+
+namespace bench {
+
+std::vector<uint64_t> parse_sizes(const args_type& args,
+				  const std::vector<uint64_t>& defaults)
+{
+  if (args.empty())
+    return defaults;
+
+  std::vector<uint64_t> result;
+  for (const auto& arg : args)
+    result.push_back(std::stoull(arg));
+  return result;
+}
+
+namespace {
+volatile uint64_t sink;
+}
+
+void consume(uint64_t value) {
+  sink = sink + value;
+}
+
+uint64_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t total = 0, resident = 0;
+  statm >> total >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+} // namespace bench
+
+namespace {
+const std::map<std::string, void (*)(const bench::args_type&)> benchmarks {
+  { "codec", bench::codec },
+  { "dictionary", bench::dictionary },
+  { "durability", bench::durability },
+  { "ingest", bench::ingest },
+  { "insert", bench::insert },
+  { "lookup", bench::lookup },
+  { "map", bench::map },
+  { "open", bench::open },
+  { "read", bench::read },
+  { "recover", bench::recover },
+  { "search", bench::search },
+};
+
+void usage() {
+  std::cerr << "Usage: cdbench <benchmark> [args...]\n"
+	    << "Benchmarks:";
+  for (const auto& elt : benchmarks)
+    std::cerr << ' ' << elt.first;
+  std::cerr << std::endl;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  const auto it = benchmarks.find(argv[1]);
+  if (it == benchmarks.end()) {
+    usage();
+    return 1;
+  }
+
+  it->second(bench::args_type(argv + 2, argv + argc));
+  return 0;
+}
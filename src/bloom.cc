@@ -0,0 +1,54 @@
+// Approximate membership filters.
+
+#include "bloom.hh"
+#include "except.hh"
+
+namespace cdump {
+
+void BloomFilter::reset(size_t count) {
+  size_t want = (count * bits_per_key + block_bytes * 8 - 1) / (block_bytes * 8);
+  if (want == 0)
+    want = 1;
+  if (want > UINT32_MAX)
+    throw index_error("Bloom filter too large");
+  blocks = want;
+  storage.assign(size_t(blocks) * block_words, 0);
+  words = storage.data();
+}
+
+void BloomFilter::add(const OID& key) {
+  uint64_t* block = storage.data() + block_words * block_of(key);
+  uint64_t probe = key.peek_word(12);
+  for (unsigned i = 0; i < probes; ++i, probe >>= 9) {
+    const unsigned bit = probe & 511;
+    block[bit >> 6] |= htole64(uint64_t(1) << (bit & 63));
+  }
+}
+
+void BloomFilter::assign(std::vector<uint64_t>&& data) {
+  if (data.size() % block_words != 0)
+    throw index_error("Bloom filter has partial block");
+  storage = std::move(data);
+  words = storage.data();
+  blocks = storage.size() / block_words;
+}
+
+void BloomFilter::attach(const uint64_t* data, uint32_t block_count) {
+  storage.clear();
+  storage.shrink_to_fit();
+  words = data;
+  blocks = block_count;
+}
+
+BloomFilter& BloomFilter::operator=(BloomFilter&& other) {
+  // Moving the vector keeps its buffer, so `words` remains valid
+  // whether or not it points into the storage.
+  storage = std::move(other.storage);
+  words = other.words;
+  blocks = other.blocks;
+  other.words = nullptr;
+  other.blocks = 0;
+  return *this;
+}
+
+} // namespace cdump
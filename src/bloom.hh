@@ -0,0 +1,99 @@
+// Approximate membership filters.
+
+#ifndef __BLOOM_HH__
+#define __BLOOM_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "oid.hh"
+
+namespace cdump {
+
+/**
+ * A blocked Bloom filter over OIDs.
+ *
+ * The filter is divided into 512-bit blocks, one cache line each.
+ * Every key sets all of its bits within a single block, so a query
+ * touches exactly one cache line.  Since OIDs are already SHA-1
+ * output, the bits are taken directly from the hash rather than
+ * hashing again.  The first byte is avoided, because the index
+ * already uses it as its fanout.
+ *
+ * A filter with no blocks is treated as absent, and `may_contain`
+ * answers true for everything.
+ */
+class BloomFilter {
+ public:
+  static const unsigned block_words = 8;
+  static const unsigned block_bytes = block_words * sizeof(uint64_t);
+  static const unsigned bits_per_key = 10;
+
+  BloomFilter() {}
+
+  // The filter may point into storage it doesn't own, so it can only
+  // be moved.
+  BloomFilter(const BloomFilter&) = delete;
+  BloomFilter& operator=(const BloomFilter&) = delete;
+  BloomFilter(BloomFilter&& other) { *this = std::move(other); }
+  BloomFilter& operator=(BloomFilter&& other);
+
+  /// Reset the filter to be empty, sized for `count` keys.
+  void reset(size_t count);
+
+  /// Add a key to the filter.
+  void add(const OID& key);
+
+  /**
+   * Test if the key might be present.  A false result means the key
+   * was certainly never added.
+   */
+  bool may_contain(const OID& key) const {
+    if (blocks == 0)
+      return true;
+    const uint64_t* block = words + block_words * block_of(key);
+    uint64_t probe = key.peek_word(12);
+    for (unsigned i = 0; i < probes; ++i, probe >>= 9) {
+      const unsigned bit = probe & 511;
+      if ((le64toh(block[bit >> 6]) & (uint64_t(1) << (bit & 63))) == 0)
+	return false;
+    }
+    return true;
+  }
+
+  /// Is there a filter present.
+  bool empty() const { return blocks == 0; }
+
+  /// The number of 512-bit blocks in the filter.
+  uint32_t block_count() const { return blocks; }
+
+  /// The raw filter data, stored as little-endian words.
+  const uint64_t* data() const { return words; }
+
+  /// Take over already built filter data.
+  void assign(std::vector<uint64_t>&& data);
+
+  /**
+   * Use filter data stored elsewhere, such as a mapped index file.
+   * The data must outlive the filter, and be aligned for 64-bit
+   * access.
+   */
+  void attach(const uint64_t* data, uint32_t block_count);
+
+ private:
+  static const unsigned probes = 6;
+
+  std::vector<uint64_t> storage;
+  const uint64_t* words = nullptr;
+  uint32_t blocks = 0;
+
+  // Map the key to a block, using a multiply instead of a modulus.
+  uint32_t block_of(const OID& key) const {
+    return (key.peek_word(4) >> 32) * blocks >> 32;
+  }
+};
+
+} // namespace cdump
+
+#endif // __BLOOM_HH__
@@ -1,72 +1,46 @@
 // Chunks.
 
 #include "chunk.hh"
+#include "codec.hh"
+#include "dictionary.hh"
+#include "entropy.hh"
+#include "mapping.hh"
 #include "utility.hh"
 
+#include <cerrno>
 #include <stdexcept>
-#include <zlib.h>
+#include <utility>
+#include <unistd.h>
+#include <sys/stat.h>
 
 namespace cdump {
 
-/**
- * Attempt to compress a block of data.
- *
- * Attempts to compress the buffer pointed to at `src`, containing
- * `src_len` bytes of data, into the buffer at `dest`.  `dest` is
- * assumed to contains at least as many bytes of space as `src_len`.
- *
- * @param src the source buffer
- * @param src_len the number of bytes of the source data
- * @param dest the destination buffer
- * @return the count of the number of bytes written to dest, or -1 if
- * the compressed data would be larger than the source.
- */
+// Compress with zlib.  `dest` must have room for `src_len` bytes.
+// Returns the compressed size, or -1 if it didn't get smaller.
 int Chunk::try_compress(const char* src, unsigned src_len,
 			 char* dest)
 {
-  // Don't bother trying if less than 16 bytes.  zlib fails with weird
-  // errors, and it wouldn't help to compress it, anyway, since the
-  // blocks are padded to 16 bytes.
-  if (src_len < 16)
-    return -1;
-
-  uLongf dest_len = src_len;
-  int res = ::compress2(reinterpret_cast<Bytef*>(dest), &dest_len,
-			reinterpret_cast<const Bytef*>(src), src_len,
-			3);
-  if (res == Z_OK)
-    return dest_len;
-  else if (res == Z_BUF_ERROR)
-    return -1;
-  else
-    throw std::runtime_error("Error compressing with zlib");
-}
-
-/**
- * Decompress a block of data.
- *
- * Reverses the Chunk::try_compress above.  The dest_len must exactly
- * match the expected size of the decompression, or this will result
- * in an error.
- *
- * @param src the source buffer (compressed data)
- * @param src_len the source data length
- * @param dest the destination buffer
- * @param dest_len the size available for decompression
- */
+  return Codec::by_id(Codec::zlib_id).compress(src, src_len, dest);
+}
+
+// Reverses try_compress.  `dest_len` must be exactly the size of the
+// uncompressed data.
 void Chunk::decompress(const char* src, unsigned src_len,
 		       char* dest, unsigned dest_len)
 {
-  uLongf pdest_len = dest_len;
-  int res = ::uncompress(reinterpret_cast<Bytef*>(dest), &pdest_len,
-			 reinterpret_cast<const Bytef*>(src), src_len);
-  if (res != Z_OK || pdest_len != dest_len)
-    throw std::runtime_error("Error decompressing with zlib");
+  Codec::by_id(Codec::zlib_id).decompress(src, src_len, dest, dest_len);
 }
 
 namespace {
 const int magic_size = 16;
-const char* magic = "adump-pool-v1.1\n";
+
+// Chunks are written with a v1.2 magic, whose last byte is the id of
+// the codec that compressed the payload, or zero if it isn't
+// compressed.  Older pools have v1.1 chunks, which could only have
+// been compressed with zlib.
+const char* magic = "adump-pool-v1.2";
+const int codec_byte = magic_size - 1;
+const char* old_magic = "adump-pool-v1.1\n";
 
 struct Header {
   char magic[magic_size];
@@ -76,18 +50,62 @@ struct Header {
   OID oid;
 };
 
-const char padding[] = {0};
+// Check the magic of a chunk header, and find its codec id.
+bool check_magic(const Header& head, uint8_t& codec) {
+  if (memcmp(head.magic, magic, codec_byte) == 0) {
+    codec = head.magic[codec_byte];
+    return true;
+  }
+  if (memcmp(head.magic, old_magic, magic_size) == 0) {
+    codec = Codec::zlib_id;
+    return true;
+  }
+  return false;
+}
 
 // Round a size up to the next size increment.
 unsigned padded(unsigned size) {
   return (size + 15) & ~15;
 }
+
+// Read exactly `len` bytes at `offset`, continuing after short reads.
+void pread_fully(int fd, void* buf, size_t len, off_t offset) {
+  char* pos = static_cast<char*>(buf);
+  while (len > 0) {
+    const ssize_t got = ::pread(fd, pos, len, offset);
+    if (got < 0) {
+      if (errno == EINTR)
+	continue;
+      throw std::runtime_error("Unable to read chunk");
+    }
+    if (got == 0)
+      throw std::runtime_error("Chunk extends past end of file");
+    pos += got;
+    len -= got;
+    offset += got;
+  }
+}
 } // namespace
 
 void Chunk::write(std::ostream& out) const {
+  data_type buf;
+  append_to(buf);
+  out.write(buf.data(), buf.size());
+}
+
+void Chunk::append_to(data_type& out) const {
+  const auto payload = append_header(out);
+
+  // The padding is zeroed by the resize.
+  const size_t base = out.size();
+  out.resize(base + padded(sizeof(Header) + payload.second) - sizeof(Header));
+  memcpy(out.data() + base, payload.first, payload.second);
+}
+
+std::pair<const char*, unsigned> Chunk::append_header(data_type& out) const {
   Header head;
-  memcpy(head.magic, magic, magic_size);
-  head.uclen = htole32(size());
+  memcpy(head.magic, magic, codec_byte);
+  head.magic[codec_byte] = has_zdata() ? zcodec() : 0;
   head.kind = kind_;
   head.oid = oid_;
   const char* payload;
@@ -102,15 +120,12 @@ void Chunk::write(std::ostream& out) const {
     head.uclen = htole32(-1);
   }
   head.clen = htole32(payload_len);
-  out.write(reinterpret_cast<const char*>(&head), sizeof(head));
-  out.write(payload, payload_len);
 
-  const unsigned pad_len = 15 & -payload_len;
-  if (pad_len > 0)
-    out.write(padding, pad_len);
+  const char* bytes = reinterpret_cast<const char*>(&head);
+  out.insert(out.end(), bytes, bytes + sizeof(head));
+  return std::make_pair(payload, payload_len);
 }
 
-// TODO: Test this function.
 unsigned Chunk::write_size() const {
   if (has_zdata()) {
     return padded(sizeof(Header) + zsize());
@@ -119,10 +134,28 @@ unsigned Chunk::write_size() const {
   }
 }
 
+unsigned Chunk::write_size_bound() const {
+  return padded(sizeof(Header) + size());
+}
+
+const unsigned Chunk::header_size = sizeof(Header);
+
+bool Chunk::zdictionary(uint32_t& id) const {
+  return has_zdata() &&
+    Codec::by_id(zcodec()).dictionary_of(zdata(), zsize(), id);
+}
+
 bool Chunk::read_header(std::istream& in, HeaderInfo& info) {
+  char buf[sizeof(Header)];
+  in.read(buf, sizeof(buf));
+  return parse_header(buf, info);
+}
+
+bool Chunk::parse_header(const char* buf, HeaderInfo& info) {
   Header head;
-  in.read(reinterpret_cast<char*>(&head), sizeof(head));
-  if (memcmp(head.magic, magic, magic_size) != 0)
+  memcpy(&head, buf, sizeof(head));
+  uint8_t codec;
+  if (!check_magic(head, codec))
     return false;
   info.kind = head.kind;
   info.oid = head.oid;
@@ -137,10 +170,13 @@ bool Chunk::read_header(std::istream& in, HeaderInfo& info) {
   return true;
 }
 
-Chunk::ChunkPtr Chunk::read(std::istream& in) {
+Chunk::ChunkPtr Chunk::read(std::istream& in,
+			    std::shared_ptr<const DictionarySet> dicts)
+{
   Header head;
   in.read(reinterpret_cast<char*>(&head), sizeof(head));
-  if (memcmp(head.magic, magic, magic_size) != 0)
+  uint8_t codec;
+  if (!check_magic(head, codec))
     throw new std::runtime_error("Incorrect chunk header");
   int clen = le32toh(head.clen);
   int uclen = le32toh(head.uclen);
@@ -149,26 +185,113 @@ Chunk::ChunkPtr Chunk::read(std::istream& in) {
     return ChunkPtr(new PlainChunk(head.kind, head.oid, in, clen));
   } else
     return ChunkPtr(new CompressedChunk(head.kind, head.oid, in,
-					uclen, clen));
+					uclen, clen, Codec::by_id(codec),
+					std::move(dicts)));
+}
+
+Chunk::ChunkPtr Chunk::read_at(int fd, off_t offset,
+			       std::shared_ptr<const DictionarySet> dicts)
+{
+  Header head;
+  pread_fully(fd, &head, sizeof(head), offset);
+  uint8_t codec;
+  if (!check_magic(head, codec))
+    throw std::runtime_error("Incorrect chunk header");
+  const int clen = le32toh(head.clen);
+  const int uclen = le32toh(head.uclen);
+  if (clen < 0 || uclen < -1)
+    throw std::runtime_error("Invalid chunk length");
+
+  // Check against the file before allocating, so a damaged length
+  // can't ask for gigabytes.
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    throw std::runtime_error("Unable to stat chunk file");
+  if (st.st_size - offset - off_t(sizeof(head)) < clen)
+    throw std::runtime_error("Chunk extends past end of file");
+
+  data_type payload(clen);
+  pread_fully(fd, payload.data(), clen, offset + sizeof(head));
+
+  if (uclen == -1)
+    return ChunkPtr(new PlainChunk(head.kind, head.oid, std::move(payload)));
+  else
+    return ChunkPtr(new CompressedChunk(head.kind, head.oid,
+					std::move(payload), uclen,
+					Codec::by_id(codec), std::move(dicts)));
+}
+
+Chunk::ChunkPtr Chunk::read_mapped(const std::shared_ptr<const MappedFile>& map,
+				   uint64_t offset,
+				   std::shared_ptr<const DictionarySet> dicts)
+{
+  if (offset > map->size() || map->size() - offset < sizeof(Header))
+    throw std::runtime_error("Chunk extends past end of file");
+  const char* base = map->data() + offset;
+
+  Header head;
+  memcpy(&head, base, sizeof(head));
+  uint8_t codec;
+  if (!check_magic(head, codec))
+    throw std::runtime_error("Incorrect chunk header");
+  const int clen = le32toh(head.clen);
+  const int uclen = le32toh(head.uclen);
+  if (clen < 0 || uclen < -1)
+    throw std::runtime_error("Invalid chunk length");
+  if (map->size() - offset - sizeof(head) < unsigned(clen))
+    throw std::runtime_error("Chunk extends past end of file");
+
+  const char* payload = base + sizeof(head);
+  if (uclen == -1)
+    return ChunkPtr(new MappedChunk(head.kind, head.oid, map, payload, clen));
+  else
+    return ChunkPtr(new CompressedChunk(head.kind, head.oid,
+					data_type(payload, payload + clen),
+					uclen, Codec::by_id(codec),
+					std::move(dicts)));
 }
 
 // Construct from given data.
 PlainChunk::PlainChunk(const Kind kind, const char* data, unsigned data_len)
   :Chunk(kind, data, data_len),
-    zdata_info(Untried)
+    zdata_info(Untried),
+    codec(&Codec::default_codec()),
+    chosen(false)
 {
   plain_data.resize(data_len);
   memcpy(plain_data.data(), data, data_len);
 }
 
 // Construct by reading data from a file.
+// Chunks are only stored plain when compression didn't help.
 PlainChunk::PlainChunk(const Kind kind, const OID& oid, std::istream& in, unsigned data_len)
-  :Chunk(kind, oid)
+  :Chunk(kind, oid),
+    zdata_info(None),
+    codec(&Codec::default_codec()),
+    chosen(false)
 {
   plain_data.resize(data_len);
   vector_read(in, plain_data);
 }
 
+PlainChunk::PlainChunk(const Kind kind, data_type&& data)
+  :Chunk(kind, OID(kind, data.data(), data.size())),
+    plain_data(std::move(data)),
+    zdata_info(Untried),
+    codec(&Codec::default_codec()),
+    chosen(false)
+{
+}
+
+PlainChunk::PlainChunk(const Kind kind, const OID& oid, data_type&& data)
+  :Chunk(kind, oid),
+    plain_data(std::move(data)),
+    zdata_info(None),
+    codec(&Codec::default_codec()),
+    chosen(false)
+{
+}
+
 const char*
 PlainChunk::data() const {
   return plain_data.data();
@@ -191,9 +314,20 @@ PlainChunk::has_zdata() const {
       // compressed value to avoid additional computation.
       PlainChunk* wthis = const_cast<PlainChunk*>(this);
 
-      wthis->compressed_data.resize(plain_data.size());
-      int res = try_compress(plain_data.data(), plain_data.size(),
-			     wthis->compressed_data.data());
+      int res = -1;
+      if (plain_data.size() >= 16 &&
+	  Compressibility::check(plain_data.data(), plain_data.size()) ==
+	  Compressibility::Try) {
+	wthis->compressed_data.resize(plain_data.size());
+	if (dict && codec->takes_dictionary()) {
+	  res = codec->compress_with(plain_data.data(), plain_data.size(),
+				     wthis->compressed_data.data(), *dict);
+	} else {
+	  res = codec->compress(plain_data.data(), plain_data.size(),
+				wthis->compressed_data.data());
+	}
+	Compressibility::record(res >= 0, plain_data.size());
+      }
       if (res < 0) {
 	wthis->zdata_info = None;
 	wthis->compressed_data.clear();
@@ -225,17 +359,54 @@ PlainChunk::zsize() const {
   return compressed_data.size();
 }
 
+uint8_t
+PlainChunk::zcodec() const {
+  return codec->id();
+}
+
+void
+PlainChunk::set_codec(const Codec& codec) {
+  this->codec = &codec;
+  chosen = true;
+  zdata_info = Untried;
+  compressed_data.clear();
+}
+
+void
+PlainChunk::set_dictionary(std::shared_ptr<const Dictionary> dict) {
+  this->dict = std::move(dict);
+  zdata_info = Untried;
+  compressed_data.clear();
+}
+
 // Compressed chunks.
 CompressedChunk::CompressedChunk(const Kind kind, const OID& oid, std::istream& in,
-				 unsigned data_len, unsigned zdata_len)
+				 unsigned data_len, unsigned zdata_len,
+				 const Codec& codec,
+				 std::shared_ptr<const DictionarySet> dicts)
   :Chunk(kind, oid),
     data_len(data_len),
-    is_decompressed(false)
+    is_decompressed(false),
+    codec(&codec),
+    dicts(std::move(dicts))
 {
   compressed_data.resize(zdata_len);
   vector_read(in, compressed_data);
 }
 
+CompressedChunk::CompressedChunk(const Kind kind, const OID& oid,
+				 data_type&& zdata, unsigned data_len,
+				 const Codec& codec,
+				 std::shared_ptr<const DictionarySet> dicts)
+  :Chunk(kind, oid),
+    data_len(data_len),
+    compressed_data(std::move(zdata)),
+    is_decompressed(false),
+    codec(&codec),
+    dicts(std::move(dicts))
+{
+}
+
 const char*
 CompressedChunk::data() const {
   if (!is_decompressed) {
@@ -243,8 +414,9 @@ CompressedChunk::data() const {
     // uncompressed value to avoid additional computation.
     CompressedChunk* wthis = const_cast<CompressedChunk*>(this);
     wthis->plain_data.resize(data_len);
-    decompress(compressed_data.data(), compressed_data.size(),
-	       wthis->plain_data.data(), wthis->plain_data.size());
+    codec->decompress_with(compressed_data.data(), compressed_data.size(),
+			   wthis->plain_data.data(), wthis->plain_data.size(),
+			   dicts.get());
     wthis->is_decompressed = true;
   }
   return plain_data.data();
@@ -270,4 +442,50 @@ CompressedChunk::zsize() const {
   return compressed_data.size();
 }
 
+uint8_t
+CompressedChunk::zcodec() const {
+  return codec->id();
+}
+
+// Mapped chunks.
+MappedChunk::MappedChunk(const Kind kind, const OID& oid,
+			 std::shared_ptr<const MappedFile> map,
+			 const char* payload, unsigned data_len)
+  :Chunk(kind, oid),
+    map(std::move(map)),
+    payload(payload),
+    data_len(data_len)
+{
+}
+
+const char*
+MappedChunk::data() const {
+  return payload;
+}
+
+unsigned
+MappedChunk::size() const {
+  return data_len;
+}
+
+bool
+MappedChunk::has_zdata() const {
+  return false;
+}
+
+const char*
+MappedChunk::zdata() const {
+  throw std::runtime_error("Attempt to get zdata from incompressible chunk");
+}
+
+unsigned
+MappedChunk::zsize() const {
+  throw std::runtime_error("Attempt to get zsize from incompressible chunk");
+}
+
+uint8_t
+MappedChunk::zcodec() const {
+  return 0;
+}
+
 } // namespace cdump
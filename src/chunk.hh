@@ -4,14 +4,21 @@
 #define __CHUNK_H__
 
 #include "oid.hh"
+#include <sys/types.h>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 #include <iostream>
 
 namespace cdump {
 
 class Chunk;
+class Codec;
+class Dictionary;
+class DictionarySet;
+class MappedFile;
 
 /**
  * Backup chunk
@@ -27,7 +34,8 @@ class Chunk;
  * handled in both compressed and uncompressed form.  Generally, the
  * uncompressed format will represent the real backup data, and the
  * compressed version will be used for network transfer or the storage
- * pool.
+ * pool.  The header of a compressed chunk records the codec that
+ * compressed it.
  */
 class Chunk {
  protected:
@@ -62,6 +70,9 @@ class Chunk {
   // Used for polymorphic return.
   typedef std::unique_ptr<Chunk> ChunkPtr;
 
+  // For chunks that may be shared, such as from a cache.
+  typedef std::shared_ptr<const Chunk> SharedPtr;
+
   using data_type = std::vector<char>;
 
   // TODO: don't use get_xxx() names for getters, just use the name.
@@ -100,6 +111,17 @@ class Chunk {
   /// Get the size of the compressed data.
   virtual unsigned zsize() const = 0;
 
+  /// The id of the codec that produced `zdata`.  Only meaningful if
+  /// `has_zdata` is true.
+  virtual uint8_t zcodec() const = 0;
+
+  /**
+   * If `zdata` can only be decompressed with a dictionary, set `id`
+   * to the id of the dictionary and return true.  This compresses the
+   * chunk, if that hasn't been tried yet.
+   */
+  bool zdictionary(uint32_t& id) const;
+
   /**
    * Write this chunk out to the given ostream.
    *
@@ -107,11 +129,31 @@ class Chunk {
    */
   void write(std::ostream& out) const;
 
+  /**
+   * Append the same bytes `write` would write to the end of `out`.
+   */
+  void append_to(data_type& out) const;
+
+  /**
+   * Append just the header to `out`, returning the payload and its
+   * length, which are to follow it.  The payload is then padded with
+   * zeros up to `write_size`.  This allows the data to be written
+   * without copying it.
+   */
+  std::pair<const char*, unsigned> append_header(data_type& out) const;
+
   /**
    * Determine how many bytes it will take to write this chunk out.
+   * This compresses the chunk, if that hasn't been tried yet.
    */
   unsigned write_size() const;
 
+  /**
+   * An upper bound on `write_size`, which doesn't need the chunk
+   * compressed: it is the size written if compression doesn't help.
+   */
+  unsigned write_size_bound() const;
+
   struct HeaderInfo {
     Kind kind;
     OID  oid;
@@ -126,17 +168,49 @@ class Chunk {
    */
   static bool read_header(std::istream& in, HeaderInfo& info);
 
+  /// The size of the header of a chunk as stored in a pool file.
+  static const unsigned header_size;
+
+  /**
+   * Decode a chunk header from memory, which must hold at least
+   * `header_size` bytes.  Returns false if it isn't a chunk header.
+   */
+  static bool parse_header(const char* buf, HeaderInfo& info);
+
   /**
    * Attempt to read a chunk from the stream.
    *
-   * Reads the chunk
+   * Reads the chunk.  A compressed chunk is decompressed with the
+   * dictionaries in `dicts`, if it needs one.  This also applies to
+   * `read_at` and `read_mapped`.
+   */
+  static ChunkPtr read(std::istream& in,
+		       std::shared_ptr<const DictionarySet> dicts = nullptr);
+
+  /**
+   * Read the chunk stored at `offset` within the file open on `fd`.
+   *
+   * This only uses positional reads, and doesn't touch the file
+   * position, so any number of threads can read through the same
+   * descriptor at once.
+   */
+  static ChunkPtr read_at(int fd, off_t offset,
+			  std::shared_ptr<const DictionarySet> dicts = nullptr);
+
+  /**
+   * Read the chunk stored at `offset` within a mapped pool file.  A
+   * chunk stored uncompressed is a MappedChunk, which uses its data
+   * in place.
    */
-  static ChunkPtr read(std::istream& in);
+  static ChunkPtr read_mapped(
+    const std::shared_ptr<const MappedFile>& map, uint64_t offset,
+    std::shared_ptr<const DictionarySet> dicts = nullptr);
 
   // static ChunkPtr read(std::istream& in, 
 
   // These are not intended to be used externally, but are exported for
-  // testing.
+  // testing.  They use zlib, as every chunk did before there were
+  // other codecs.
   static int try_compress(const char* src, unsigned src_len,
 			  char* dest);
   static void decompress(const char* src, unsigned src_len,
@@ -156,15 +230,44 @@ class PlainChunk : public Chunk {
     Some
   };
   ZDataInfo zdata_info;
+  const Codec* codec;
+  bool chosen;
+  std::shared_ptr<const Dictionary> dict;
  public:
+  // These compress with whatever the default codec is when they are
+  // constructed.
   PlainChunk(const Kind kind, const char* data, unsigned data_len);
   PlainChunk(const Kind kind, const OID& oid, std::istream& in, unsigned data_len);
+  PlainChunk(const Kind kind, const OID& oid, data_type&& data);
+
+  // Take over the given data.
+  PlainChunk(const Kind kind, data_type&& data);
 
   virtual const char* data() const override;
   virtual unsigned size() const override;
   virtual bool has_zdata() const override;
   virtual const char* zdata() const override;
   virtual unsigned zsize() const override;
+  virtual uint8_t zcodec() const override;
+
+  /**
+   * Compress with `codec` instead, discarding any data already
+   * compressed.  The codec is only ever changed by this: a dictionary
+   * given to `set_dictionary` is ignored by codecs that don't take
+   * one, including the default, lz.
+   */
+  void set_codec(const Codec& codec);
+
+  /// Has `set_codec` been called?  If not, `Pool::insert` may choose.
+  bool codec_chosen() const { return chosen; }
+
+  /**
+   * Compress starting from `dict`, when the codec takes a dictionary,
+   * discarding any data already compressed.  A null pointer
+   * compresses without one.  The chunk can then only be read back
+   * from a pool that stores `dict`; see `Pool::use_dictionary`.
+   */
+  void set_dictionary(std::shared_ptr<const Dictionary> dict);
 };
 
 /**
@@ -175,15 +278,51 @@ class CompressedChunk : public Chunk {
   std::vector<char> plain_data;
   std::vector<char> compressed_data;
   bool is_decompressed;
+  const Codec* codec;
+
+  // Where to find the dictionary the data needs, if any.
+  std::shared_ptr<const DictionarySet> dicts;
+
+ public:
+  CompressedChunk(const Kind kind, const OID& oid, std::istream& in, unsigned data_len, unsigned zdata_len,
+		  const Codec& codec,
+		  std::shared_ptr<const DictionarySet> dicts = nullptr);
+  CompressedChunk(const Kind kind, const OID& oid, data_type&& zdata, unsigned data_len,
+		  const Codec& codec,
+		  std::shared_ptr<const DictionarySet> dicts = nullptr);
+
+  virtual const char* data() const override;
+  virtual unsigned size() const override;
+  virtual bool has_zdata() const override;
+  virtual const char* zdata() const override;
+  virtual unsigned zsize() const override;
+  virtual uint8_t zcodec() const override;
+};
+
+/**
+ * Chunk stored uncompressed in a mapped pool file.
+ *
+ * The data is used directly from the mapping, without being copied
+ * out of it.  The chunk holds a reference to the mapping, which stays
+ * valid for as long as the chunk does.  As with chunks read from a
+ * file, data stored uncompressed didn't compress.
+ */
+class MappedChunk : public Chunk {
+  std::shared_ptr<const MappedFile> map;
+  const char* payload;
+  unsigned data_len;
 
  public:
-  CompressedChunk(const Kind kind, const OID& oid, std::istream& in, unsigned data_len, unsigned zdata_len);
+  MappedChunk(const Kind kind, const OID& oid,
+	      std::shared_ptr<const MappedFile> map,
+	      const char* payload, unsigned data_len);
 
   virtual const char* data() const override;
   virtual unsigned size() const override;
   virtual bool has_zdata() const override;
   virtual const char* zdata() const override;
   virtual unsigned zsize() const override;
+  virtual uint8_t zcodec() const override;
 };
 
 } // namespace cdump
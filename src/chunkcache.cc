@@ -0,0 +1,102 @@
+// Cache of decoded chunks.
+
+#include "chunkcache.hh"
+
+#include <stdexcept>
+
+namespace cdump {
+
+const unsigned ChunkCache::default_shards;
+const unsigned ChunkCache::default_blob_limit;
+const size_t ChunkCache::entry_overhead;
+
+ChunkCache::ChunkCache(size_t budget, unsigned shard_count)
+  : default_limit(~0u)
+{
+  if (shard_count == 0 || (shard_count & (shard_count - 1)) != 0)
+    throw std::invalid_argument("Cache shard count must be a power of two");
+
+  for (unsigned i = 0; i < shard_count; ++i)
+    shards.emplace_back(new Shard);
+  shard_budget = budget / shard_count;
+
+  limits[Kind("blob")] = default_blob_limit;
+}
+
+void ChunkCache::set_limit(Kind kind, unsigned limit) {
+  limits[kind] = limit;
+}
+
+bool ChunkCache::admit(const Chunk& chunk) const {
+  const auto it = limits.find(chunk.kind());
+  const unsigned limit = it == limits.end() ? default_limit : it->second;
+
+  // A chunk that would take up more than a quarter of its shard would
+  // push out too much else.
+  return chunk.size() <= limit && charge(chunk) <= shard_budget / 4;
+}
+
+ChunkCache::SharedPtr ChunkCache::find(const OID& key) {
+  auto& shard = shard_of(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+
+  const auto it = shard.map.find(key);
+  if (it == shard.map.end()) {
+    ++shard.misses;
+    return SharedPtr();
+  }
+
+  ++shard.hits;
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return *it->second;
+}
+
+void ChunkCache::insert(const SharedPtr& chunk) {
+  if (!admit(*chunk))
+    return;
+
+  // Decode before sharing, so nothing modifies the chunk afterward.
+  chunk->data();
+
+  auto& shard = shard_of(chunk->oid());
+  std::lock_guard<std::mutex> guard(shard.lock);
+
+  if (shard.map.count(chunk->oid()) > 0)
+    return;
+
+  shard.lru.push_front(chunk);
+  shard.map.emplace(chunk->oid(), shard.lru.begin());
+  shard.bytes += charge(*chunk);
+
+  while (shard.bytes > shard_budget) {
+    const auto& victim = shard.lru.back();
+    shard.bytes -= charge(*victim);
+    shard.map.erase(victim->oid());
+    shard.lru.pop_back();
+    ++shard.evictions;
+  }
+}
+
+void ChunkCache::clear() {
+  for (auto& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard->lock);
+    shard->map.clear();
+    shard->lru.clear();
+    shard->bytes = 0;
+  }
+}
+
+ChunkCache::Stats ChunkCache::stats() const {
+  Stats result { 0, 0, 0, 0, 0 };
+  for (const auto& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard->lock);
+    result.hits += shard->hits;
+    result.misses += shard->misses;
+    result.evictions += shard->evictions;
+    result.entries += shard->map.size();
+    result.bytes += shard->bytes;
+  }
+  return result;
+}
+
+} // namespace cdump
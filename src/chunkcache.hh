@@ -0,0 +1,130 @@
+// Cache of decoded chunks.
+
+#ifndef __CHUNKCACHE_HH__
+#define __CHUNKCACHE_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.hh"
+#include "oid.hh"
+
+namespace cdump {
+
+/**
+ * A cache of decoded chunks, keyed by OID, holding at most a given
+ * number of bytes of chunk data.
+ *
+ * The cache is split into shards, each with its own lock and its own
+ * share of the budget, and a key always goes to the same shard, so
+ * threads looking up different chunks rarely contend.  Within a
+ * shard, the least recently used chunks are evicted first.
+ *
+ * Whether a chunk is worth caching depends on its kind: the chunks
+ * describing the tree (backups, directories, indirect blocks) are
+ * read again and again, but file data rarely is.  Each kind has a
+ * size limit, above which its chunks aren't admitted.
+ *
+ * Cached chunks are shared with every reader, so they are fully
+ * decoded before going in, after which they are never modified.
+ */
+class ChunkCache {
+ public:
+  using SharedPtr = Chunk::SharedPtr;
+
+  /// The default number of shards.
+  static const unsigned default_shards = 16;
+
+  /// By default, only `blob` chunks up to this size are cached.
+  static const unsigned default_blob_limit = 4096;
+
+  /**
+   * Construct a cache holding up to `budget` bytes of chunk data,
+   * spread over `shards` shards, which must be a power of two.
+   */
+  ChunkCache(size_t budget, unsigned shards = default_shards);
+
+  ChunkCache(const ChunkCache&) = delete;
+  ChunkCache& operator=(const ChunkCache&) = delete;
+
+  /**
+   * Set the largest chunk of the given kind that will be cached.  A
+   * limit of zero keeps the kind out of the cache.  This should be
+   * done before the cache is shared between threads.
+   */
+  void set_limit(Kind kind, unsigned limit);
+
+  /// Set the limit for kinds without one of their own.
+  void set_default_limit(unsigned limit) { default_limit = limit; }
+
+  /// Look up a chunk, returning null if it isn't cached.
+  SharedPtr find(const OID& key);
+
+  /**
+   * Offer a chunk to the cache, which keeps it if its kind and size
+   * are admitted.  The chunk is decoded first if necessary.
+   */
+  void insert(const SharedPtr& chunk);
+
+  /// Drop everything from the cache.  The counters are kept.
+  void clear();
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+  };
+
+  /// Totals across all of the shards.
+  Stats stats() const;
+
+  size_t budget() const { return shard_budget * shards.size(); }
+
+ private:
+  // Charged against the budget for every entry, in addition to the
+  // chunk data, to account for the bookkeeping.
+  static const size_t entry_overhead = 128;
+
+  struct Shard {
+    // Most recently used at the front.
+    using lru_type = std::list<SharedPtr>;
+
+    mutable std::mutex lock;
+    lru_type lru;
+    std::unordered_map<OID, lru_type::iterator> map;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  size_t shard_budget;
+
+  std::map<Kind, unsigned> limits;
+  unsigned default_limit;
+
+  static size_t charge(const Chunk& chunk) {
+    return chunk.size() + entry_overhead;
+  }
+
+  // The low bits of std::hash<OID> pick the bucket within a shard's
+  // map, so the shard comes from elsewhere in the key.
+  Shard& shard_of(const OID& key) {
+    return *shards[(key.peek_word(8) >> 32) & (shards.size() - 1)];
+  }
+
+  bool admit(const Chunk& chunk) const;
+};
+
+} // namespace cdump
+
+#endif // __CHUNKCACHE_HH__
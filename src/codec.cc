@@ -0,0 +1,312 @@
+// Compression codecs.
+
+#include "codec.hh"
+#include "dictionary.hh"
+#include "lz.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <lzma.h>
+#include <zlib.h>
+
+namespace cdump {
+
+const uint8_t Codec::zlib_id;
+const uint8_t Codec::lz_id;
+const uint8_t Codec::lzma_id;
+
+namespace {
+
+// zlib streams, kept for reuse by each thread.  Setting one up
+// allocates and clears its window and hash tables, which costs more
+// than compressing a small chunk.  Resetting one only clears its
+// state.
+class Deflater {
+  z_stream stream;
+  bool ready = false;
+
+ public:
+  static const int level = 3;
+
+  ~Deflater() {
+    if (ready)
+      deflateEnd(&stream);
+  }
+
+  z_stream& get() {
+    if (ready) {
+      deflateReset(&stream);
+    } else {
+      memset(&stream, 0, sizeof(stream));
+      if (deflateInit(&stream, level) != Z_OK)
+	throw std::runtime_error("Unable to set up zlib");
+      ready = true;
+    }
+    return stream;
+  }
+};
+
+class Inflater {
+  z_stream stream;
+  bool ready = false;
+
+ public:
+  ~Inflater() {
+    if (ready)
+      inflateEnd(&stream);
+  }
+
+  z_stream& get() {
+    if (ready) {
+      inflateReset(&stream);
+    } else {
+      memset(&stream, 0, sizeof(stream));
+      if (inflateInit(&stream) != Z_OK)
+	throw std::runtime_error("Unable to set up zlib");
+      ready = true;
+    }
+    return stream;
+  }
+};
+
+thread_local Deflater deflater;
+thread_local Inflater inflater;
+
+// The format chunks have always been written in.  Without a
+// dictionary, this produces the same data compress2 and uncompress
+// would.
+class ZlibCodec : public Codec {
+ public:
+  uint8_t id() const override { return zlib_id; }
+  const char* name() const override { return "zlib"; }
+
+  int compress(const char* src, unsigned src_len,
+	       char* dest) const override
+  {
+    return deflate_with(src, src_len, dest, nullptr);
+  }
+
+  bool takes_dictionary() const override { return true; }
+
+  int compress_with(const char* src, unsigned src_len,
+		    char* dest, const Dictionary& dict) const override
+  {
+    return deflate_with(src, src_len, dest, &dict);
+  }
+
+  void decompress(const char* src, unsigned src_len,
+		  char* dest, unsigned dest_len) const override
+  {
+    decompress_with(src, src_len, dest, dest_len, nullptr);
+  }
+
+  void decompress_with(const char* src, unsigned src_len,
+		       char* dest, unsigned dest_len,
+		       const DictionarySet* dicts) const override
+  {
+    z_stream& stream = inflater.get();
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src));
+    stream.avail_in = src_len;
+    stream.next_out = reinterpret_cast<Bytef*>(dest);
+    stream.avail_out = dest_len;
+
+    int res = inflate(&stream, Z_FINISH);
+    if (res == Z_NEED_DICT) {
+      // The stream gives the id of the dictionary it needs.
+      const auto dict = dicts != nullptr ? dicts->by_id(stream.adler) :
+	Dictionary::Ptr();
+      if (!dict)
+	throw std::runtime_error("Chunk needs a compression dictionary the "
+				 "pool doesn't have");
+      if (inflateSetDictionary(
+	    &stream, reinterpret_cast<const Bytef*>(dict->data().data()),
+	    dict->data().size()) != Z_OK)
+	throw std::runtime_error("Error decompressing with zlib");
+      res = inflate(&stream, Z_FINISH);
+    }
+    if (res != Z_STREAM_END || stream.total_out != dest_len)
+      throw std::runtime_error("Error decompressing with zlib");
+  }
+
+  // The two byte zlib header has a flag for a preset dictionary,
+  // whose id follows it, most significant byte first.
+  bool dictionary_of(const char* src, unsigned src_len,
+		     uint32_t& id) const override
+  {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(src);
+    if (src_len < 6 || (bytes[1] & 0x20) == 0)
+      return false;
+    id = uint32_t(bytes[2]) << 24 | uint32_t(bytes[3]) << 16 |
+      uint32_t(bytes[4]) << 8 | bytes[5];
+    return true;
+  }
+
+ private:
+  int deflate_with(const char* src, unsigned src_len, char* dest,
+		   const Dictionary* dict) const
+  {
+    // Don't bother trying if less than 16 bytes.  zlib fails with
+    // weird errors, and it wouldn't help to compress it, anyway, since
+    // the blocks are padded to 16 bytes.
+    if (src_len < 16)
+      return -1;
+
+    z_stream& stream = deflater.get();
+    if (dict != nullptr &&
+	deflateSetDictionary(
+	  &stream, reinterpret_cast<const Bytef*>(dict->data().data()),
+	  dict->data().size()) != Z_OK)
+      throw std::runtime_error("Error compressing with zlib");
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src));
+    stream.avail_in = src_len;
+    stream.next_out = reinterpret_cast<Bytef*>(dest);
+    stream.avail_out = src_len;
+
+    const int res = deflate(&stream, Z_FINISH);
+    if (res == Z_STREAM_END)
+      return stream.total_out;
+    else if (res == Z_OK || res == Z_BUF_ERROR)
+      return -1;
+    else
+      throw std::runtime_error("Error compressing with zlib");
+  }
+};
+
+// Fast, mainly for quick restores.
+class LzCodec : public Codec {
+ public:
+  uint8_t id() const override { return lz_id; }
+  const char* name() const override { return "lz"; }
+
+  int compress(const char* src, unsigned src_len,
+	       char* dest) const override
+  {
+    const int res = lz::compress(src, src_len, dest, src_len);
+    return res >= 0 && unsigned(res) < src_len ? res : -1;
+  }
+
+  void decompress(const char* src, unsigned src_len,
+		  char* dest, unsigned dest_len) const override
+  {
+    lz::decompress(src, src_len, dest, dest_len);
+  }
+};
+
+// Raw LZMA2, for the best ratio, when writing time doesn't matter.
+// The stream has no container, and the dictionary is sized to the
+// data, which keeps the memory needed down for small chunks.  The
+// decoder needs the same dictionary size, and gets it from the
+// uncompressed size.
+class LzmaCodec : public Codec {
+ public:
+  static const uint32_t preset = 6;
+
+  uint8_t id() const override { return lzma_id; }
+  const char* name() const override { return "lzma"; }
+
+  int compress(const char* src, unsigned src_len,
+	       char* dest) const override
+  {
+    // The stream alone is larger than anything this small.
+    if (src_len < 16)
+      return -1;
+
+    lzma_options_lzma options;
+    if (lzma_lzma_preset(&options, preset))
+      throw std::runtime_error("Unable to set up lzma");
+    options.dict_size = dict_size(src_len);
+    lzma_filter filters[2];
+    set_filters(filters, &options);
+
+    size_t dest_len = 0;
+    const lzma_ret res = lzma_raw_buffer_encode(
+      filters, nullptr, reinterpret_cast<const uint8_t*>(src), src_len,
+      reinterpret_cast<uint8_t*>(dest), &dest_len, src_len);
+    if (res == LZMA_OK)
+      return dest_len < src_len ? int(dest_len) : -1;
+    else if (res == LZMA_BUF_ERROR)
+      return -1;
+    else
+      throw std::runtime_error("Error compressing with lzma");
+  }
+
+  void decompress(const char* src, unsigned src_len,
+		  char* dest, unsigned dest_len) const override
+  {
+    lzma_options_lzma options;
+    if (lzma_lzma_preset(&options, preset))
+      throw std::runtime_error("Unable to set up lzma");
+    options.dict_size = dict_size(dest_len);
+    lzma_filter filters[2];
+    set_filters(filters, &options);
+
+    size_t src_pos = 0, dest_pos = 0;
+    const lzma_ret res = lzma_raw_buffer_decode(
+      filters, nullptr, reinterpret_cast<const uint8_t*>(src), &src_pos,
+      src_len, reinterpret_cast<uint8_t*>(dest), &dest_pos, dest_len);
+    if (res != LZMA_OK || src_pos != src_len || dest_pos != dest_len)
+      throw std::runtime_error("Error decompressing with lzma");
+  }
+
+ private:
+  static uint32_t dict_size(unsigned len) {
+    return std::max<uint32_t>(LZMA_DICT_SIZE_MIN, len);
+  }
+
+  static void set_filters(lzma_filter* filters, lzma_options_lzma* options) {
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = options;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    filters[1].options = nullptr;
+  }
+};
+
+const ZlibCodec zlib_codec {};
+const LzCodec lz_codec {};
+const LzmaCodec lzma_codec {};
+
+// Indexed by id.
+const Codec* const registry[] = {
+  nullptr, &zlib_codec, &lz_codec, &lzma_codec,
+};
+const unsigned registry_size = sizeof(registry) / sizeof(registry[0]);
+
+std::atomic<const Codec*> current_default(&lz_codec);
+
+} // namespace
+
+const Codec& Codec::by_id(unsigned id) {
+  if (id >= registry_size || registry[id] == nullptr)
+    throw std::runtime_error("Chunk uses an unknown compression codec");
+  return *registry[id];
+}
+
+const Codec& Codec::by_name(const std::string& name) {
+  for (const auto codec : registry) {
+    if (codec != nullptr && name == codec->name())
+      return *codec;
+  }
+  throw std::invalid_argument("Unknown compression codec: " + name);
+}
+
+std::vector<const Codec*> Codec::all() {
+  std::vector<const Codec*> result;
+  for (const auto codec : registry) {
+    if (codec != nullptr)
+      result.push_back(codec);
+  }
+  return result;
+}
+
+const Codec& Codec::default_codec() {
+  return *current_default.load();
+}
+
+void Codec::set_default(const Codec& codec) {
+  current_default.store(&codec);
+}
+
+} // namespace cdump
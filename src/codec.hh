@@ -0,0 +1,118 @@
+// Compression codecs.
+
+#ifndef __CODEC_HH__
+#define __CODEC_HH__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cdump {
+
+class Dictionary;
+class DictionarySet;
+
+/**
+ * A way of compressing chunk payloads.
+ *
+ * Each codec has a small numeric id, which is recorded in the header
+ * of every compressed chunk, so that a pool can hold chunks written
+ * with any mix of codecs, and each is decompressed with the codec
+ * that wrote it.  Ids are part of the pool format, and must never be
+ * reused.
+ *
+ * A single instance of each codec is shared, and can be used from any
+ * number of threads at once.  Any state a call needs is either made
+ * for that call, or kept per thread, as zlib keeps a stream for
+ * compressing and one for decompressing in each thread, to reuse.
+ */
+class Codec {
+ public:
+  /// Ids of the built in codecs.  Zero means not compressed.
+  static const uint8_t zlib_id = 1;
+  static const uint8_t lz_id = 2;
+  static const uint8_t lzma_id = 3;
+
+  virtual ~Codec() {}
+
+  virtual uint8_t id() const = 0;
+  virtual const char* name() const = 0;
+
+  /**
+   * Compress `src_len` bytes from `src` into `dest`, which has room
+   * for `src_len` bytes.  Returns the compressed size, or -1 if the
+   * data doesn't get any smaller.
+   */
+  virtual int compress(const char* src, unsigned src_len,
+		       char* dest) const = 0;
+
+  /**
+   * Decompress data, which must expand to exactly `dest_len` bytes.
+   * Throws std::runtime_error if it doesn't.
+   */
+  virtual void decompress(const char* src, unsigned src_len,
+			  char* dest, unsigned dest_len) const = 0;
+
+  /// Whether `compress_with` makes use of a dictionary.
+  virtual bool takes_dictionary() const { return false; }
+
+  /**
+   * Compress as with `compress`, starting from a preset dictionary.
+   * The compressed data identifies the dictionary, which
+   * `decompress_with` has to be given.  Codecs that can't use a
+   * dictionary compress without it.
+   */
+  virtual int compress_with(const char* src, unsigned src_len,
+			    char* dest, const Dictionary& dict) const {
+    (void) dict;
+    return compress(src, src_len, dest);
+  }
+
+  /**
+   * Decompress as with `decompress`, finding the dictionary the data
+   * was compressed with, if any, in `dicts`, which may be null.
+   * Throws std::runtime_error if it isn't there.
+   */
+  virtual void decompress_with(const char* src, unsigned src_len,
+			       char* dest, unsigned dest_len,
+			       const DictionarySet* dicts) const {
+    (void) dicts;
+    decompress(src, src_len, dest, dest_len);
+  }
+
+  /**
+   * If compressed data can only be decompressed with a dictionary,
+   * set `id` to the id of the dictionary and return true.  This only
+   * looks at the start of the data.
+   */
+  virtual bool dictionary_of(const char* src, unsigned src_len,
+			     uint32_t& id) const {
+    (void) src;
+    (void) src_len;
+    (void) id;
+    return false;
+  }
+
+  /// Look up a codec by the id recorded in a chunk.  Throws
+  /// std::runtime_error for an unknown id.
+  static const Codec& by_id(unsigned id);
+
+  /// Look up a codec by name.  Throws std::invalid_argument for an
+  /// unknown name.
+  static const Codec& by_name(const std::string& name);
+
+  /// Every registered codec, in id order.
+  static std::vector<const Codec*> all();
+
+  /**
+   * The codec newly created chunks are compressed with.  This is
+   * "lz", which decompresses several times faster than zlib, at some
+   * cost in ratio.
+   */
+  static const Codec& default_codec();
+  static void set_default(const Codec& codec);
+};
+
+} // namespace cdump
+
+#endif // __CODEC_HH__
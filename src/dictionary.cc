@@ -0,0 +1,186 @@
+// Compression dictionaries.
+
+#include "dictionary.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <endian.h>
+#include <zlib.h>
+
+namespace cdump {
+
+const size_t Dictionary::max_size;
+
+namespace {
+
+// Training scores pieces of the samples by the 8-byte sequences in
+// them, and picks pieces of `segment_size` bytes.
+const size_t gram_size = 8;
+const size_t segment_size = 32;
+
+const char file_magic[] = "ldumpdic";
+const size_t file_magic_size = 8;
+
+uint64_t gram_at(const std::string& sample, size_t pos) {
+  uint64_t gram;
+  memcpy(&gram, sample.data() + pos, gram_size);
+  return gram;
+}
+
+struct Segment {
+  const std::string* sample;
+  size_t pos;
+  size_t len;
+  uint64_t score;
+
+  bool operator<(const Segment& other) const {
+    return score < other.score;
+  }
+};
+
+} // namespace
+
+Dictionary::Dictionary(Kind kind, std::string data)
+  :kind_(kind), data_(std::move(data))
+{
+  if (data_.size() > max_size)
+    throw std::invalid_argument("Compression dictionary is too large");
+  id_ = adler32(adler32(0, nullptr, 0),
+		reinterpret_cast<const Bytef*>(data_.data()), data_.size());
+}
+
+std::string Dictionary::train(const std::vector<std::string>& samples,
+			      size_t size)
+{
+  size = std::min(size, max_size);
+
+  // How many of the samples each sequence appears in.  Only what is
+  // in more than one is worth having in the dictionary.
+  std::unordered_map<uint64_t, unsigned> freq;
+  for (const auto& sample : samples) {
+    std::unordered_set<uint64_t> seen;
+    for (size_t pos = 0; pos + gram_size <= sample.size(); ++pos) {
+      const auto gram = gram_at(sample, pos);
+      if (seen.insert(gram).second)
+	++freq[gram];
+    }
+  }
+
+  auto score = [&](const Segment& seg) {
+    uint64_t total = 0;
+    for (size_t pos = seg.pos; pos + gram_size <= seg.pos + seg.len; ++pos) {
+      const auto it = freq.find(gram_at(*seg.sample, pos));
+      if (it != freq.end() && it->second > 1)
+	total += it->second;
+    }
+    return total;
+  };
+
+  // Overlapping segments, so that a common piece is whole in at least
+  // one of them.
+  std::priority_queue<Segment> queue;
+  for (const auto& sample : samples) {
+    for (size_t pos = 0; pos + gram_size <= sample.size();
+	 pos += segment_size / 2) {
+      Segment seg { &sample, pos,
+		    std::min(segment_size, sample.size() - pos), 0 };
+      seg.score = score(seg);
+      if (seg.score > 0)
+	queue.push(seg);
+    }
+  }
+
+  // Take the best segment each time.  Once a segment is taken, what
+  // is in it no longer counts for the others, so their scores only
+  // go down, and are brought up to date as they come to the top.
+  std::vector<Segment> taken;
+  size_t total = 0;
+  while (total < size && !queue.empty()) {
+    auto seg = queue.top();
+    queue.pop();
+    const auto current = score(seg);
+    if (current == 0)
+      continue;
+    if (current < seg.score && !queue.empty() &&
+	current < queue.top().score) {
+      seg.score = current;
+      queue.push(seg);
+      continue;
+    }
+
+    for (size_t pos = seg.pos; pos + gram_size <= seg.pos + seg.len; ++pos)
+      freq.erase(gram_at(*seg.sample, pos));
+    taken.push_back(seg);
+    total += seg.len;
+  }
+
+  // The best go last, closest to the data.
+  std::string result;
+  for (auto it = taken.rbegin(); it != taken.rend(); ++it)
+    result.append(*it->sample, it->pos, it->len);
+  if (result.size() > size)
+    result.erase(0, result.size() - size);
+  return result;
+}
+
+void Dictionary::write(std::ostream& out, const std::vector<Ptr>& dicts) {
+  out.write(file_magic, file_magic_size);
+  const uint32_t count = htole32(dicts.size());
+  out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  for (const auto& dict : dicts) {
+    const std::string kind = dict->kind();
+    out.write(kind.data(), kind.size());
+    const uint32_t len = htole32(dict->data().size());
+    out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+    out.write(dict->data().data(), dict->data().size());
+  }
+}
+
+std::vector<Dictionary::Ptr> Dictionary::read(std::istream& in) {
+  char magic[file_magic_size];
+  uint32_t count;
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&count), sizeof(count));
+  if (!in || memcmp(magic, file_magic, file_magic_size) != 0)
+    throw std::runtime_error("Invalid compression dictionary file");
+
+  std::vector<Ptr> result;
+  for (uint32_t i = 0; i < le32toh(count); ++i) {
+    std::string kind(4, 0);
+    uint32_t len;
+    in.read(&kind[0], kind.size());
+    in.read(reinterpret_cast<char*>(&len), sizeof(len));
+    len = le32toh(len);
+    if (!in || len > max_size)
+      throw std::runtime_error("Invalid compression dictionary file");
+    std::string data(len, 0);
+    in.read(&data[0], len);
+    if (!in)
+      throw std::runtime_error("Compression dictionary file is truncated");
+    result.push_back(std::make_shared<Dictionary>(Kind(kind), std::move(data)));
+  }
+  return result;
+}
+
+DictionarySet::DictionarySet(const std::vector<Dictionary::Ptr>& dicts) {
+  for (const auto& dict : dicts) {
+    ids[dict->id()] = dict;
+    kinds[dict->kind()] = dict;
+  }
+}
+
+Dictionary::Ptr DictionarySet::for_kind(Kind kind) const {
+  const auto it = kinds.find(kind);
+  return it == kinds.end() ? Dictionary::Ptr() : it->second;
+}
+
+Dictionary::Ptr DictionarySet::by_id(uint32_t id) const {
+  const auto it = ids.find(id);
+  return it == ids.end() ? Dictionary::Ptr() : it->second;
+}
+
+} // namespace cdump
@@ -0,0 +1,104 @@
+// Compression dictionaries.
+
+#ifndef __DICTIONARY_HH__
+#define __DICTIONARY_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "kind.hh"
+
+namespace cdump {
+
+/**
+ * A preset dictionary for compressing chunks of one kind.
+ *
+ * Small chunks, such as directories and backup records, are a few
+ * hundred bytes each, too little for the compressor to find much to
+ * refer back to.  What they share (property names, type strings,
+ * path fragments) is in every one of them.  Compressing them as if
+ * they followed a dictionary of that shared text lets each chunk
+ * refer back into it.
+ *
+ * A chunk is only compressed with a dictionary when asked to, with
+ * `PlainChunk::set_dictionary`, and only by a codec that takes one
+ * (zlib).  The zlib stream records the id of the dictionary it used,
+ * which is its Adler-32 checksum.  Decompression finds the dictionary
+ * by that id, among those of the pool the chunk was read from.  A
+ * dictionary can't be changed or dropped once chunks use it.  A
+ * newer one for the same kind takes over for compressing, while the
+ * older one is still there for reading.
+ *
+ * Dictionaries belong to a pool, which stores them in its metadata.
+ * Nothing about them is shared across the process, so a chunk
+ * compressed with one pool's dictionary is only readable from a pool
+ * that stores the same dictionary, and `Pool::insert` refuses it
+ * anywhere else.
+ */
+class Dictionary {
+  Kind kind_;
+  std::string data_;
+  uint32_t id_;
+
+ public:
+  using Ptr = std::shared_ptr<const Dictionary>;
+
+  Dictionary(Kind kind, std::string data);
+
+  Kind kind() const { return kind_; }
+  const std::string& data() const { return data_; }
+  uint32_t id() const { return id_; }
+
+  /// zlib only looks back 32 KiB, so a larger dictionary is no use.
+  static const size_t max_size = 32 << 10;
+
+  /**
+   * Build a dictionary of at most `size` bytes from samples of a
+   * kind's chunks.  It is made from the pieces of the samples that
+   * are common to the most of them, with the most common last, where
+   * they are cheapest to refer to.
+   */
+  static std::string train(const std::vector<std::string>& samples,
+			   size_t size);
+
+  /**
+   * Write a set of dictionaries out, and read them back.  Reading
+   * throws std::runtime_error if the data is damaged.
+   */
+  static void write(std::ostream& out, const std::vector<Ptr>& dicts);
+  static std::vector<Ptr> read(std::istream& in);
+};
+
+/**
+ * The dictionaries of a pool: the newest of each kind, for
+ * compressing, and every one by id, for decompressing.  A set isn't
+ * changed once it is in use, so it can be shared by any number of
+ * readers; a pool that trains more makes a new set.
+ */
+class DictionarySet {
+  std::map<Kind, Dictionary::Ptr> kinds;
+  std::unordered_map<uint32_t, Dictionary::Ptr> ids;
+
+ public:
+  using Ptr = std::shared_ptr<const DictionarySet>;
+
+  /// Later dictionaries take over their kind from earlier ones.
+  explicit DictionarySet(const std::vector<Dictionary::Ptr>& dicts);
+
+  /// The dictionary to compress a kind with, or null if there isn't
+  /// one.
+  Dictionary::Ptr for_kind(Kind kind) const;
+
+  /// Find a dictionary by its id, or null.
+  Dictionary::Ptr by_id(uint32_t id) const;
+};
+
+} // namespace cdump
+
+#endif // __DICTIONARY_HH__
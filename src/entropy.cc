@@ -0,0 +1,155 @@
+// Guessing whether data will compress.
+
+#include "entropy.hh"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+
+namespace cdump {
+
+const unsigned Compressibility::min_size;
+const double Compressibility::entropy_limit = 7.8;
+
+namespace {
+
+// The sample is this many evenly spaced slices.
+const unsigned sample_slices = 16;
+const unsigned slice_size = 256;
+
+struct Signature {
+  unsigned offset;
+  unsigned len;
+  const char* bytes;
+};
+
+// Formats that are compressed, so won't compress again.
+const Signature signatures[] = {
+  { 0, 2, "\x1f\x8b" },  // gzip
+  { 0, 4, "PK\x03\x04" },  // zip, and jar, docx, odt...
+  { 0, 3, "BZh" },  // bzip2
+  { 0, 6, "\xfd" "7zXZ\x00" },  // xz
+  { 0, 6, "7z\xbc\xaf\x27\x1c" },  // 7z
+  { 0, 4, "\x28\xb5\x2f\xfd" },  // zstd
+  { 0, 4, "\x04\x22\x4d\x18" },  // lz4
+  { 0, 4, "Rar!" },
+  { 0, 3, "\xff\xd8\xff" },  // jpeg
+  { 0, 8, "\x89PNG\r\n\x1a\n" },
+  { 0, 4, "GIF8" },
+  { 4, 4, "ftyp" },  // mp4, mov, heic
+  { 0, 4, "OggS" },
+  { 0, 4, "fLaC" },
+  { 0, 3, "ID3" },  // mp3
+  { 0, 4, "\x1a\x45\xdf\xa3" },  // mkv, webm
+};
+
+std::atomic<bool> enabled(true);
+
+std::atomic<uint64_t> checked(0);
+std::atomic<uint64_t> skipped_format(0);
+std::atomic<uint64_t> skipped_entropy(0);
+std::atomic<uint64_t> skipped_bytes(0);
+std::atomic<uint64_t> tried(0);
+std::atomic<uint64_t> tried_failed(0);
+std::atomic<uint64_t> failed_bytes(0);
+
+void count(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+uint64_t get(const std::atomic<uint64_t>& counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+} // namespace
+
+Compressibility::Verdict Compressibility::check(const char* data, unsigned len) {
+  if (len < min_size || !enabled.load(std::memory_order_relaxed))
+    return Try;
+
+  count(checked);
+  if (known_format(data, len)) {
+    count(skipped_format);
+    count(skipped_bytes, len);
+    return KnownFormat;
+  }
+  if (sampled_entropy(data, len) >= entropy_limit) {
+    count(skipped_entropy);
+    count(skipped_bytes, len);
+    return HighEntropy;
+  }
+  return Try;
+}
+
+void Compressibility::record(bool compressed, unsigned len) {
+  count(tried);
+  if (!compressed) {
+    count(tried_failed);
+    count(failed_bytes, len);
+  }
+}
+
+double Compressibility::sampled_entropy(const char* data, unsigned len) {
+  if (len == 0)
+    return 0;
+
+  unsigned counts[256] = { 0 };
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+  unsigned total = 0;
+  if (len <= sample_slices * slice_size) {
+    for (unsigned i = 0; i < len; ++i)
+      ++counts[bytes[i]];
+    total = len;
+  } else {
+    const unsigned stride = (len - slice_size) / (sample_slices - 1);
+    for (unsigned slice = 0; slice < sample_slices; ++slice) {
+      const unsigned char* pos = bytes + slice * stride;
+      for (unsigned i = 0; i < slice_size; ++i)
+	++counts[pos[i]];
+    }
+    total = sample_slices * slice_size;
+  }
+
+  double entropy = 0;
+  unsigned seen = 0;
+  for (auto n : counts) {
+    if (n == 0)
+      continue;
+    ++seen;
+    const double p = double(n) / total;
+    entropy -= p * std::log2(p);
+  }
+
+  // A small sample underestimates the entropy.  This is the
+  // Miller-Madow correction for it, without which a sample of random
+  // bytes comes out well under 8 bits.
+  entropy += (seen - 1) / (2.0 * total * std::log(2.0));
+  return entropy;
+}
+
+bool Compressibility::known_format(const char* data, unsigned len) {
+  for (const auto& sig : signatures) {
+    if (sig.offset + sig.len <= len &&
+	memcmp(data + sig.offset, sig.bytes, sig.len) == 0)
+      return true;
+  }
+  return false;
+}
+
+Compressibility::Stats Compressibility::stats() {
+  return Stats { get(checked), get(skipped_format), get(skipped_entropy),
+      get(skipped_bytes), get(tried), get(tried_failed), get(failed_bytes) };
+}
+
+void Compressibility::reset_stats() {
+  for (auto counter : { &checked, &skipped_format, &skipped_entropy,
+	&skipped_bytes, &tried, &tried_failed, &failed_bytes })
+    counter->store(0, std::memory_order_relaxed);
+}
+
+void Compressibility::set_enabled(bool value) {
+  enabled.store(value, std::memory_order_relaxed);
+}
+
+} // namespace cdump
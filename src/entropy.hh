@@ -0,0 +1,69 @@
+// Guessing whether data will compress.
+
+#ifndef __ENTROPY_HH__
+#define __ENTROPY_HH__
+
+#include <cstdint>
+
+namespace cdump {
+
+/**
+ * A quick check for data that won't compress, so that chunks of
+ * media and already compressed files can be stored without trying.
+ * A failed compression costs as much as a successful one, and is
+ * thrown away.
+ *
+ * Data is skipped if it starts with the signature of a compressed
+ * format, or if the byte entropy of a sample of it is close to 8
+ * bits.  The sample is at most 4 KiB, spread across the data, so the
+ * check costs little next to compressing.  Data shorter than
+ * `min_size` is always tried, as it is cheap to compress anyway.
+ *
+ * Counts of what was skipped, and of what was tried but didn't
+ * compress, are kept for the whole process, for tuning the check.
+ */
+class Compressibility {
+ public:
+  enum Verdict {
+    Try,
+    KnownFormat,
+    HighEntropy,
+  };
+
+  struct Stats {
+    uint64_t checked;  //< Chunks large enough to check.
+    uint64_t skipped_format;
+    uint64_t skipped_entropy;
+    uint64_t skipped_bytes;
+    uint64_t tried;  //< Chunks compression was tried on.
+    uint64_t tried_failed;  //< Of those, ones that didn't get smaller.
+    uint64_t failed_bytes;
+  };
+
+  static const unsigned min_size = 1024;
+
+  /// Data with at least this many bits of entropy per byte is skipped.
+  static const double entropy_limit;
+
+  /// Decide whether to try compressing `data`, and count the result.
+  static Verdict check(const char* data, unsigned len);
+
+  /// Count the result of trying compression on `len` bytes.
+  static void record(bool compressed, unsigned len);
+
+  /// The order-0 entropy of a sample of `data`, in bits per byte.
+  static double sampled_entropy(const char* data, unsigned len);
+
+  /// Whether `data` starts with the signature of a compressed format.
+  static bool known_format(const char* data, unsigned len);
+
+  static Stats stats();
+  static void reset_stats();
+
+  /// Turn the check off, so everything is tried.  It is on by default.
+  static void set_enabled(bool enabled);
+};
+
+} // namespace cdump
+
+#endif // __ENTROPY_HH__
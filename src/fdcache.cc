@@ -0,0 +1,75 @@
+// Bounded set of open file descriptors.
+
+#include "fdcache.hh"
+#include "except.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cdump {
+
+const size_t FdCache::default_limit;
+const unsigned FdCache::default_shards;
+
+FdCache::Descriptor::~Descriptor() {
+  ::close(fd_);
+}
+
+FdCache::FdCache(size_t limit, unsigned shard_count) {
+  if (shard_count == 0 || (shard_count & (shard_count - 1)) != 0)
+    throw std::invalid_argument("Descriptor cache shard count must be a "
+				"power of two");
+
+  for (unsigned i = 0; i < shard_count; ++i)
+    shards.emplace_back(new Shard);
+  shard_limit = std::max<size_t>(1, limit / shard_count);
+}
+
+FdCache::Handle FdCache::Shard::find(unsigned key) {
+  std::lock_guard<std::mutex> guard(lock);
+  const auto it = map.find(key);
+  if (it == map.end())
+    return Handle();
+  lru.splice(lru.begin(), lru, it->second);
+  return it->second->second;
+}
+
+FdCache::Handle FdCache::open(Shard& shard, unsigned key,
+			      const std::string& path)
+{
+  // Open without holding the lock.  If another thread opened the same
+  // file meanwhile, its descriptor is used, and this one is closed.
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw pool_open_error("Unable to open pool file");
+  Handle handle(new Descriptor(fd));
+
+  std::lock_guard<std::mutex> guard(shard.lock);
+  const auto it = shard.map.find(key);
+  if (it != shard.map.end()) {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+  }
+
+  shard.lru.emplace_front(key, handle);
+  shard.map.emplace(key, shard.lru.begin());
+  while (shard.lru.size() > shard_limit) {
+    shard.map.erase(shard.lru.back().first);
+    shard.lru.pop_back();
+  }
+  return handle;
+}
+
+size_t FdCache::size() const {
+  size_t total = 0;
+  for (const auto& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard->lock);
+    total += shard->lru.size();
+  }
+  return total;
+}
+
+} // namespace cdump
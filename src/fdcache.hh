@@ -0,0 +1,92 @@
+// Bounded set of open file descriptors.
+
+#ifndef __FDCACHE_HH__
+#define __FDCACHE_HH__
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cdump {
+
+/**
+ * Keeps read-only descriptors open for up to `limit` files at a time,
+ * closing the least recently used ones beyond that.
+ *
+ * Descriptors are handed out as shared handles, so one that is
+ * evicted while a reader is still using it stays open until the
+ * reader is done with it.  The cache can be used from several threads
+ * at once.  Like ChunkCache, it is split into shards, each with its
+ * own lock and share of the limit, so readers of different files
+ * rarely contend.
+ */
+class FdCache {
+ public:
+  // Closes the descriptor when the last handle goes away.
+  class Descriptor {
+    int fd_;
+   public:
+    explicit Descriptor(int fd) :fd_(fd) {}
+    ~Descriptor();
+    Descriptor(const Descriptor&) = delete;
+    Descriptor& operator=(const Descriptor&) = delete;
+
+    int fd() const { return fd_; }
+  };
+  using Handle = std::shared_ptr<const Descriptor>;
+
+  static const size_t default_limit = 64;
+  static const unsigned default_shards = 8;
+
+  /// `shards` must be a power of two.
+  explicit FdCache(size_t limit = default_limit,
+		   unsigned shards = default_shards);
+
+  /**
+   * Get a descriptor for file number `key`.  If it isn't already
+   * open, `make_path()` is called for the name of the file to open,
+   * so a hit doesn't pay for building it.  Throws pool_open_error if
+   * it can't be opened.
+   */
+  template <typename MakePath>
+  Handle get(unsigned key, MakePath make_path) {
+    auto& shard = shard_of(key);
+    auto handle = shard.find(key);
+    return handle ? handle : open(shard, key, make_path());
+  }
+
+  /// The number of descriptors held by the cache.
+  size_t size() const;
+
+ private:
+  struct Shard {
+    // Most recently used at the front.
+    using lru_type = std::list<std::pair<unsigned, Handle>>;
+
+    mutable std::mutex lock;
+    lru_type lru;
+    std::unordered_map<unsigned, lru_type::iterator> map;
+
+    Handle find(unsigned key);
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  size_t shard_limit;
+
+  // Pool files are numbered in sequence, so the low bits spread them
+  // evenly.
+  Shard& shard_of(unsigned key) {
+    return *shards[key & (shards.size() - 1)];
+  }
+
+  Handle open(Shard& shard, unsigned key, const std::string& path);
+};
+
+} // namespace cdump
+
+#endif // __FDCACHE_HH__
@@ -11,30 +11,98 @@
 #include <set>
 
 #include "kind.hh"
+#include "search.hh"
+#include "sync.hh"
 #include "utility.hh"
 
+#include <zlib.h>
+
 namespace cdump {
 
-FileIndex::SortedIterator::SortedIterator(FileIndex* parent) :parent(parent) {
-  keys.reserve(parent->ram.size() + parent->fdata.size());
+namespace {
+// The SortedIterator partitions on the first 16 bits of the hash.
+const unsigned partition_bits = 16;
+const unsigned partitions = 1 << partition_bits;
 
-  // Build the keys out of the ram index.
-  for (auto& it : parent->ram) {
-    keys.emplace_back(it.first);
-  }
+unsigned partition_of(const OID& key) {
+  return key.peek_word(0) >> (64 - partition_bits);
+}
+} // namespace
+
+const uint64_t FileIndex::max_entries;
+
+void FileIndex::check_entry_count(uint64_t count) {
+  if (count > max_entries)
+    throw index_error("Too many entries for an index file");
+}
+
+FileIndex::SortedIterator::SortedIterator(const FileIndex* parent) {
+  std::vector<value_type> work;
+  work.reserve(parent->ram.size() + parent->fdata.size());
 
-  // Add add the keys from the non-ram index.
-  parent->fdata.append_keys(keys);
+  // Gather the entries from the ram index, and the non-ram index.
+  for (const auto& it : parent->ram)
+    work.emplace_back(it);
+  parent->fdata.append_entries(work);
 
-  // Sort all of the keys.
-  std::sort(keys.begin(), keys.end());
+  build(work);
+}
+
+FileIndex::SortedIterator::SortedIterator(std::vector<value_type>&& work) {
+  build(work);
+  work.clear();
+  work.shrink_to_fit();
+}
+
+void FileIndex::SortedIterator::build(std::vector<value_type>& work) {
+  check_entry_count(work.size());
+
+  // Count the size of each partition, and turn that into the starting
+  // position of each.
+  std::vector<uint32_t> starts(partitions + 1, 0);
+  for (const auto& elt : work)
+    ++starts[partition_of(elt.first) + 1];
+  for (unsigned part = 0; part < partitions; ++part)
+    starts[part + 1] += starts[part];
+
+  // Scatter the entries to their partitions.
+  entries.resize(work.size());
+  auto next = starts;
+  for (const auto& elt : work)
+    entries[next[partition_of(elt.first)]++] = elt;
+  work.clear();
+  work.shrink_to_fit();
+
+  // Sort each partition, and drop any repeated keys, keeping the
+  // entry with the lowest offset.  This moves the partitions down,
+  // so `next` is reused for where each one now ends.
+  uint32_t out = 0;
+  for (unsigned part = 0; part < partitions; ++part) {
+    std::sort(entries.begin() + starts[part],
+	      entries.begin() + starts[part + 1],
+	      [](const value_type& a, const value_type& b) {
+		if (!(a.first == b.first))
+		  return a.first < b.first;
+		return a.second.offset < b.second.offset;
+	      });
+    for (uint32_t pos = starts[part]; pos < starts[part + 1]; ++pos) {
+      if (out > 0 && pos > starts[part] && entries[out - 1].first == entries[pos].first)
+	continue;
+      entries[out++] = entries[pos];
+    }
+    next[part] = out;
+  }
+  entries.resize(out);
+
+  tops.resize(256);
+  for (unsigned top = 0; top < 256; ++top)
+    tops[top] = next[((top + 1) << (partition_bits - 8)) - 1];
 }
 
 namespace {
 
 const int magic_size = 8;
 const char magic[] = "ldumpidx";
-const int magic_version = 4;
 
 struct Header {
   char magic[magic_size];
@@ -42,81 +110,242 @@ struct Header {
   uint32_t file_size;
 };
 
-// After loading a vector, fix the endianness.
-void fix_vector_endian(std::vector<uint32_t> elts) {
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-  (void) elts;  // Nothing
-#else
-  for (auto& elt : elts) {
-    elt = le32toh(elt);
+// Version 6 indexes, and version 2 journals, follow their header with
+// the full 64-bit size, leaving the low bits in the 32-bit field.
+struct WideSize {
+  uint64_t size;
+};
+
+// The bloom filter follows the kinds.  Readers that don't know about
+// the filter stop reading before it, so it can be added without
+// changing the version.  The blocks themselves start on a 64-byte
+// boundary within the file.
+const char filter_magic[] = "ldbloom1";
+
+struct FilterHeader {
+  char magic[magic_size];
+  uint32_t block_count;
+  uint32_t reserved;
+};
+
+const char zero_padding[BloomFilter::block_bytes] = {0};
+
+// Pad the output to a multiple of 'alignment', which must be a power
+// of two no larger than a filter block.
+void pad_to(std::ostream& out, unsigned alignment) {
+  const unsigned pad_len = (alignment - 1) & -unsigned(out.tellp());
+  if (pad_len > 0)
+    out.write(zero_padding, pad_len);
+}
+
+// The journal starts with a header tying it to the size covered by
+// the index file it extends.  Each append adds a batch: a header,
+// followed by the entries.  The checksum covers the end size and the
+// entries, so that a torn write at the end is detected and ignored.
+const char journal_magic[] = "ldumpjnl";
+const uint32_t journal_version = 2;
+
+// Version 1 journals, from before sizes and offsets were 64 bits, are
+// still replayed.
+const uint32_t narrow_journal_version = 1;
+
+struct JournalHeader {
+  char magic[magic_size];
+  uint32_t version;
+  uint32_t base_size;
+};
+
+struct BatchHeader {
+  uint32_t count;
+  uint32_t check;
+  uint64_t end_size;
+
+  uint64_t end() const { return le64toh(end_size); }
+};
+
+struct JournalEntry {
+  OID oid;
+  Kind kind;
+  uint64_t offset;
+
+  uint64_t where() const { return le64toh(offset); }
+};
+
+struct NarrowBatchHeader {
+  uint32_t count;
+  uint32_t end_size;
+  uint32_t check;
+  uint32_t reserved;
+
+  uint64_t end() const { return le32toh(end_size); }
+};
+
+struct NarrowJournalEntry {
+  OID oid;
+  uint32_t offset;
+  Kind kind;
+
+  uint64_t where() const { return le32toh(offset); }
+};
+
+template<class B, class E>
+uint32_t batch_check(const B& head, const std::vector<E>& entries) {
+  uLong crc = crc32(0, Z_NULL, 0);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(&head.end_size),
+	      sizeof(head.end_size));
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(entries.data()),
+	      entries.size() * sizeof(E));
+  return crc;
+}
+
+// Journaled entries would be merged long before they got this large,
+// so a bigger count means the batch header is damaged.
+const uint32_t max_batch = 1 << 26;
+
+// Read whole batches of one journal format, passing each entry to
+// `visit`, until `size` bytes of the data file are covered.  A short
+// or damaged batch ends the journal.  Returns the size covered.
+template<class B, class E, class F>
+uint64_t read_batches(std::istream& file, uint64_t covered, uint64_t size,
+		      F visit)
+{
+  std::vector<E> entries;
+  while (covered < size) {
+    B head;
+    file.read(reinterpret_cast<char*>(&head), sizeof(head));
+    if (!file.good() || le32toh(head.count) > max_batch)
+      break;
+    entries.resize(le32toh(head.count));
+    vector_read(file, entries);
+    if (!file.good() || batch_check(head, entries) != le32toh(head.check))
+      break;
+    const uint64_t end_size = head.end();
+    if (end_size < covered || end_size > size)
+      break;
+
+    for (const auto& ent : entries)
+      visit(ent.oid, ent.where(), ent.kind);
+    covered = end_size;
   }
-#endif
+  return covered;
+}
+
+// The journal is merged once it is this fraction of the saved index,
+// but never before it reaches journal_min entries.
+const size_t journal_ratio = 2;
+const size_t journal_min = 4096;
+
+// Write one column of the index.  `get(rank)` gives the element for
+// the entry with the given sorted rank, and the layout gives the rank
+// at each position, or sorted order, if it is empty.
+template<class E, class F>
+void write_column(std::ostream& out, size_t count,
+		  const std::vector<uint32_t>& layout, F get)
+{
+  std::vector<E> work;
+  work.reserve(count);
+  for (size_t pos = 0; pos < count; ++pos)
+    work.push_back(get(layout.empty() ? pos : layout[pos]));
+  vector_write(out, work);
 }
 
 class Saver {
   // FileIndex *index;
   FileIndex::SortedIterator iter;
-  std::vector<uint32_t> tops;
-  std::vector<uint32_t> offsets;
+  const std::vector<FileIndex::value_type>& entries;
+  unsigned version;
+
+  // Sorted position of each entry as written, empty for version 4.
+  std::vector<uint32_t> layout;
+
   std::set<Kind> kinds;
   std::map<Kind, uint32_t> kind_map;
 
-  void compute_tops();
-  void first_pass();
+  void compute_layout();
+  void compute_kinds();
   void write_kinds(std::ostream& out);
+  void write_filter(std::ostream& out);
  public:
-  Saver(FileIndex *index) :/*index(index),*/ iter(index) {
-    compute_tops();
+  Saver(FileIndex *index, unsigned version)
+    :/*index(index),*/ iter(index), entries(iter.get_entries()),
+    version(version)
+  {
+    compute_layout();
+    compute_kinds();
+  }
+
+  Saver(std::vector<FileIndex::value_type>&& work, unsigned version)
+    :iter(std::move(work)), entries(iter.get_entries()), version(version)
+  {
+    compute_layout();
+    compute_kinds();
   }
 
-  void save(const std::string name, uint32_t size);
+  void save(const std::string name, uint64_t size);
 };
 
-void Saver::save(const std::string name, uint32_t size) {
+void Saver::save(const std::string name, uint64_t size) {
+  // The older versions can only describe data files below 4 GiB, which
+  // also bounds the offsets.
+  const bool wide = version == FileIndex::wide_version;
+  if (!wide && size > UINT32_MAX)
+    throw index_error("Data file too large for index version");
+
   std::ofstream file(name, std::ios::binary|std::ios::out);
   file.exceptions(file.badbit|file.failbit);
 
   Header head;
   memcpy(head.magic, magic, magic_size);
-  head.version = htole32(magic_version);
-  head.file_size = htole32(size);
+  head.version = htole32(version);
+  head.file_size = htole32(uint32_t(size));
   file.write(reinterpret_cast<char*>(&head), sizeof(head));
-  vector_write(file, tops);
-  vector_write(file, iter.get_keys());
+  if (wide) {
+    WideSize wsize { htole64(size) };
+    file.write(reinterpret_cast<char*>(&wsize), sizeof(wsize));
+  }
 
-  first_pass();
-  vector_write(file, offsets);
+  write_column<uint32_t>(file, 256, std::vector<uint32_t>(),
+			 [&](size_t top) { return htole32(iter.get_tops()[top]); });
+  write_column<OID>(file, entries.size(), layout,
+		    [&](size_t rank) { return entries[rank].first; });
+  if (wide) {
+    pad_to(file, sizeof(uint64_t));
+    write_column<uint64_t>(file, entries.size(), layout,
+			   [&](size_t rank) {
+			     return htole64(entries[rank].second.offset);
+			   });
+  } else {
+    write_column<uint32_t>(file, entries.size(), layout,
+			   [&](size_t rank) {
+			     return htole32(uint32_t(entries[rank].second.offset));
+			   });
+  }
   write_kinds(file);
+  write_filter(file);
 }
 
-void Saver::compute_tops() {
-  tops.resize(256, 0);
-
-  auto it = iter.begin();
-  uint32_t num = 0;
-
-  for (unsigned top = 0; top < 256; ++top) {
-    // Find the first hash with a first byte greater than 'top'.
-    // TODO: Fix iterator so that it->first will work.
-    while (it != iter.end() && (*it).first.peek_first() <= top) {
-      ++it;
-      ++num;
-    }
-    tops[top] = num;
+// Versions 5 and 6 lay out each bucket as an implicit binary tree.
+void Saver::compute_layout() {
+  layout.clear();
+  if (version == FileIndex::sorted_version)
+    return;
+
+  layout.resize(entries.size());
+  std::vector<uint32_t> order;
+  uint32_t low = 0;
+  for (const auto high : iter.get_tops()) {
+    eytzinger_order(high - low, order);
+    for (uint32_t rank = 0; rank < order.size(); ++rank)
+      layout[low + order[rank]] = low + rank;
+    low = high;
   }
 }
 
-// Pass one through the hashes computes the offsets, and fills in the
-// available kinds.
-void Saver::first_pass() {
-  // TODO: Make iter have a size() method.
-  offsets.clear();
-  offsets.reserve(iter.get_keys().size());
+// Find the kinds that are present, and number them.
+void Saver::compute_kinds() {
   kinds.clear();
-  for (const auto& elt : iter) {
-    offsets.push_back(htole32(elt.second.offset));
+  for (const auto& elt : entries)
     kinds.insert(elt.second.kind);
-  }
 
   // From this, construct the kind map.
   unsigned k = 0;
@@ -130,125 +359,409 @@ void Saver::first_pass() {
 
 // Writing kinds, writes out the map, and then the items themselves.
 void Saver::write_kinds(std::ostream& out) {
-  const uint32_t num_kinds = kinds.size();
+  const uint32_t num_kinds = htole32(kinds.size());
   out.write(reinterpret_cast<const char*>(&num_kinds), sizeof(num_kinds));
 
   std::vector<Kind> knames;
-  knames.reserve(num_kinds);
+  knames.reserve(kinds.size());
   for (const auto k : kinds) {
     knames.push_back(k);
   }
   vector_write(out, knames);
 
   // All of the kinds are stored as single bytes.
-  std::vector<uint8_t> kbytes;
-  kbytes.reserve(iter.get_keys().size());
-  for (const auto& elt : iter) {
-    kbytes.push_back(kind_map[elt.second.kind]);
-  }
-  vector_write(out, kbytes);
+  write_column<uint8_t>(out, entries.size(), layout,
+			[&](size_t rank) {
+			  return kind_map[entries[rank].second.kind];
+			});
+}
+
+// The filter covers all of the keys written to the index.
+void Saver::write_filter(std::ostream& out) {
+  BloomFilter filter;
+  filter.reset(entries.size());
+  for (const auto& elt : entries)
+    filter.add(elt.first);
+
+  FilterHeader head;
+  memcpy(head.magic, filter_magic, magic_size);
+  head.block_count = htole32(filter.block_count());
+  head.reserved = 0;
+  out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+
+  pad_to(out, BloomFilter::block_bytes);
+  out.write(reinterpret_cast<const char*>(filter.data()),
+	    size_t(filter.block_count()) * BloomFilter::block_bytes);
 }
 
 } // namespace
 
-void FileIndex::save(const std::string name, uint32_t size) {
+namespace {
+// Write the index built by the saver to `name`, through a temporary
+// file, which is synced first if `sync` is set.
+void write_saved(Saver& saver, const std::string name, uint64_t size,
+		 bool sync)
+{
   const auto tmp = name + ".tmp";
-  Saver saver(this);
   saver.save(tmp, size);
+
+  // The contents must be durable before the rename is, or a crash
+  // could leave an empty index in place of the old one.
+  if (sync)
+    sync_file(tmp);
   const int result = std::rename(tmp.c_str(), name.c_str());
   if (result != 0) {
     throw index_error("Unable to rename tmp file");
   }
+  if (sync)
+    sync_parent(name);
+}
+} // namespace
+
+namespace {
+bool writable_version(unsigned version) {
+  return version == FileIndex::sorted_version ||
+    version == FileIndex::eytzinger_version ||
+    version == FileIndex::wide_version;
+}
+}
+
+void FileIndex::save(const std::string name, uint64_t size,
+		     unsigned version)
+{
+  if (!writable_version(version))
+    throw index_error("Unsupported index version to write");
+
+  Saver saver(this, version);
+  write_saved(saver, name, size, sync_writes);
+}
+
+void FileIndex::save_entries(const std::string name, uint64_t size,
+			     std::vector<value_type>&& entries,
+			     unsigned version)
+{
+  if (!writable_version(version))
+    throw index_error("Unsupported index version to write");
+
+  Saver saver(std::move(entries), version);
+  write_saved(saver, name, size, sync_writes);
+}
+
+bool FileIndex::journal_full() const {
+  if (!fdata.loaded())
+    return true;
+  return ram.size() > std::max(journal_min, fdata.size() / journal_ratio);
+}
+
+void FileIndex::append_journal(const std::string journal, uint64_t size) {
+  // Start a new journal, replacing any stale one, the first time
+  // after a save.
+  std::ofstream file(journal, std::ios::binary | std::ios::out |
+		     (journal_started ? std::ios::app : std::ios::trunc));
+  file.exceptions(file.badbit|file.failbit);
+
+  if (!journal_started) {
+    JournalHeader head;
+    memcpy(head.magic, journal_magic, magic_size);
+    head.version = htole32(journal_version);
+    head.base_size = htole32(uint32_t(saved_size));
+    file.write(reinterpret_cast<const char*>(&head), sizeof(head));
+    WideSize base { htole64(saved_size) };
+    file.write(reinterpret_cast<const char*>(&base), sizeof(base));
+  }
+
+  std::vector<JournalEntry> entries;
+  entries.reserve(fresh.size());
+  for (const auto& elt : fresh)
+    entries.push_back(JournalEntry { elt.first, elt.second.kind,
+				     htole64(elt.second.offset) });
+
+  BatchHeader head;
+  head.count = htole32(entries.size());
+  head.end_size = htole64(size);
+  head.check = htole32(batch_check(head, entries));
+  file.write(reinterpret_cast<const char*>(&head), sizeof(head));
+  vector_write(file, entries);
+  file.close();
+
+  if (sync_writes) {
+    sync_file(journal);
+    if (!journal_started)
+      sync_parent(journal);
+  }
+
+  fresh.clear();
+  journal_started = true;
+}
+
+uint64_t FileIndex::replay_journal(const std::string journal, uint64_t covered,
+				   uint64_t size)
+{
+  std::ifstream file(journal, std::ios::binary | std::ios::in);
+  if (!file.good())
+    return covered;
+
+  JournalHeader jhead;
+  file.read(reinterpret_cast<char*>(&jhead), sizeof(jhead));
+  if (!file.good() || memcmp(jhead.magic, journal_magic, magic_size) != 0)
+    return covered;
+
+  const uint32_t version = le32toh(jhead.version);
+  uint64_t base_size = le32toh(jhead.base_size);
+  if (version == journal_version) {
+    WideSize wsize;
+    file.read(reinterpret_cast<char*>(&wsize), sizeof(wsize));
+    base_size = le64toh(wsize.size);
+  } else if (version != narrow_journal_version)
+    return covered;
+  if (!file.good() || base_size != covered)
+    return covered;
+
+  // An old journal can't be appended to.  Its entries are kept as
+  // fresh instead, so that the next append writes them all to a new
+  // journal in the current format.
+  const bool narrow = version == narrow_journal_version;
+  auto visit = [&](const OID& oid, uint64_t offset, Kind kind) {
+    const value_type elt(oid, Node(offset, kind));
+    if (ram.insert(elt) && narrow)
+      fresh.push_back(elt);
+  };
+  if (narrow)
+    covered = read_batches<NarrowBatchHeader, NarrowJournalEntry>(
+	file, covered, size, visit);
+  else
+    covered = read_batches<BatchHeader, JournalEntry>(
+	file, covered, size, visit);
+
+  journal_started = !narrow;
+  return covered;
 }
 
 FileIndex::iterator FileIndex::find(const FileIndex::key_type& key) {
-  // Simple ram-only case just looks it up, builds the local result,
-  // and returns the pointer.
-  const auto fr = ram.find(key);
-  if (fr == ram.end()) {
-    if (fdata.find(key, find_result))
-      return &find_result;
-    else
-      return end();
+  if (lookup(key, find_result))
+    return &find_result;
+  else
+    return end();
+}
+
+bool FileIndex::lookup(const key_type& key, value_type& result) const {
+  // Finished files have nothing in `ram`, so don't bother hashing.
+  if (!ram.empty()) {
+    const auto fr = ram.find(key);
+    if (fr != nullptr) {
+      result = *fr;
+      return true;
+    }
+  }
+  return fdata.find(key, result);
+}
+
+void FileIndex::load(const std::string name, uint64_t size) {
+  ram.clear();
+  fresh.clear();
+  journal_started = false;
+  if (fdata.load(name) != size) {
+    fdata = FileData();
+    throw index_error("Index file incorrect size");
+  }
+  saved_size = size;
+}
+
+void FileIndex::load(const std::string name, const std::string journal,
+		     uint64_t size)
+{
+  ram.clear();
+  fresh.clear();
+  journal_started = false;
+  const uint64_t covered = fdata.load(name);
+  if (covered > size) {
+    fdata = FileData();
+    throw index_error("Index file incorrect size");
+  }
+  saved_size = covered;
+  if (covered == size)
+    return;
+  if (replay_journal(journal, covered, size) != size)
+    throw index_error("Index journal doesn't cover file");
+}
+
+uint64_t FileIndex::load_prefix(const std::string name,
+				const std::string journal, uint64_t size)
+{
+  ram.clear();
+  fresh.clear();
+  journal_started = false;
+  uint64_t covered = 0;
+  try {
+    covered = fdata.load(name);
+  } catch (index_error&) {
+    fdata = FileData();
+  }
+  if (covered > size) {
+    fdata = FileData();
+    covered = 0;
   }
-  find_result = *fr;
-  return &find_result;
+  saved_size = covered;
+  if (covered == size)
+    return covered;
+  return replay_journal(journal, covered, size);
 }
 
 // Searching of loaded data.
-bool FileIndex::FileData::find(const FileIndex::key_type& key, FileIndex::value_type& result) {
-  if (tops.size() != 256)
+bool FileIndex::FileData::find(const FileIndex::key_type& key, FileIndex::value_type& result) const {
+  if (tops == nullptr)
     return false;
 
+  if (!filter.may_contain(key))
+    return false;
+
+  // The hashes within the bucket all start with the same byte, which
+  // bounds their leading words for the interpolation.
   const auto first = key.peek_first();
+  const size_t low = (first > 0) ? le32toh(tops[first-1]) : 0;
+  const size_t high = le32toh(tops[first]);
+  size_t pos;
 
-  // It is important that these are both signed, since high can go
-  // negative.
-  int low = (first > 0) ? tops[first-1] : 0;
-  int high = tops[first] - 1;
-
-  while (high >= low) {
-    unsigned mid = low + ((high - low) / 2);
-    auto cmp = key.cmp(hashes[mid]);
-    if (cmp < 0)
-      high = mid - 1;
-    else if (cmp > 0)
-      low = mid + 1;
-    else {
-      // It matches, return the result.
-      result.first = key;
-      result.second.offset = offsets[mid];
-      result.second.kind = kind_map[kinds[mid]];
+  if (eytzinger) {
+    if (eytzinger_search_oid(hashes + low, high - low, key, pos)) {
+      result = entry(low + pos);
       return true;
     }
+    return false;
+  }
+
+  const uint64_t low_word = uint64_t(first) << 56;
+  const uint64_t high_word = low_word | ((uint64_t(1) << 56) - 1);
+  if (interpolation_search_oid(hashes, low, high, low_word, high_word,
+			       key, pos))
+  {
+    result = entry(pos);
+    return true;
   }
 
-  (void) result;
   return false;
 }
 
 //////////////////////////////////////////////////////////////////////
 // Loading
 
-void FileIndex::FileData::load(const std::string name, uint32_t size) {
-  std::ifstream file(name, std::ios::binary|std::ios::in);
-  if (!file.good()) {
+namespace {
+
+// Hands out each section of a mapped index in turn, making sure that
+// it lies within the file.
+class MapCursor {
+  const MappedFile& map;
+  size_t pos;
+
+ public:
+  MapCursor(const MappedFile& map) :map(map), pos(0) {}
+
+  size_t remaining() const {
+    return map.size() - pos;
+  }
+
+  template<class E>
+  const E* take(size_t count) {
+    if (count > remaining() / sizeof(E))
+      throw index_error("Index file is truncated");
+    const E* result = reinterpret_cast<const E*>(map.data() + pos);
+    pos += count * sizeof(E);
+    return result;
+  }
+
+  // Skip forward to a multiple of 'alignment', which must be a power
+  // of two.
+  void align(size_t alignment) {
+    pos = std::min(map.size(), (pos + alignment - 1) & ~(alignment - 1));
+  }
+};
+
+} // namespace
+
+uint64_t FileIndex::FileData::load(const std::string name) {
+  // Clear out the old data before anything can fail.
+  *this = FileData();
+
+  std::shared_ptr<MappedFile> work;
+  try {
+    work = std::make_shared<MappedFile>(name);
+  } catch (std::runtime_error&) {
     throw index_error("Unable to read index file");
   }
-  file.exceptions(file.badbit|file.failbit|file.eofbit);
 
-  Header head;
-  file.read(reinterpret_cast<char*>(&head), sizeof(head));
+  MapCursor cursor(*work);
+  const Header& head = *cursor.take<Header>(1);
   if (memcmp(head.magic, magic, magic_size) != 0)
     throw index_error("Index header has invalid magic");
-  if (le32toh(head.version) != magic_version)
+  const auto version = le32toh(head.version);
+  if (version != sorted_version && version != eytzinger_version &&
+      version != wide_version)
     throw index_error("Index file incorrect version");
-  if (le32toh(head.file_size) != size)
-    throw index_error("Index file incorrect size");
-
-  // Reading the data in.  Vector doesn't give us write access to the
-  // underlying data...  But, we can actually write to it anyway.
-  tops.resize(256);
-  vector_read(file, tops);
-  fix_vector_endian(tops);
-
-  const unsigned count = tops[255];
-  hashes.resize(count);
-  vector_read(file, hashes);
+  const bool wide = version == wide_version;
+  uint64_t file_size = le32toh(head.file_size);
+  if (wide)
+    file_size = le64toh(cursor.take<WideSize>(1)->size);
+
+  const uint32_t* new_tops = cursor.take<uint32_t>(256);
+  const uint32_t new_count = le32toh(new_tops[255]);
+  const OID* new_hashes = cursor.take<OID>(new_count);
+  const uint32_t* new_offsets = nullptr;
+  const uint64_t* new_wide_offsets = nullptr;
+  if (wide) {
+    cursor.align(sizeof(uint64_t));
+    new_wide_offsets = cursor.take<uint64_t>(new_count);
+  } else
+    new_offsets = cursor.take<uint32_t>(new_count);
+  const uint32_t kind_count = le32toh(*cursor.take<uint32_t>(1));
+  const Kind* new_kind_map = cursor.take<Kind>(kind_count);
+  const uint8_t* new_kinds = cursor.take<uint8_t>(new_count);
+
+  // The filter is optional, so reaching the end of the file here
+  // just means the index was written without one.
+  if (cursor.remaining() >= sizeof(FilterHeader)) {
+    const FilterHeader& fhead = *cursor.take<FilterHeader>(1);
+    if (memcmp(fhead.magic, filter_magic, magic_size) == 0) {
+      cursor.align(BloomFilter::block_bytes);
+      const uint32_t blocks = le32toh(fhead.block_count);
+      const uint64_t* words =
+	  cursor.take<uint64_t>(size_t(blocks) * BloomFilter::block_words);
+      filter.attach(words, blocks);
+    }
+  }
 
-  offsets.resize(count);
-  vector_read(file, offsets);
-  fix_vector_endian(offsets);
+  map = std::move(work);
+  tops = new_tops;
+  hashes = new_hashes;
+  offsets = new_offsets;
+  wide_offsets = new_wide_offsets;
+  kind_map = new_kind_map;
+  kinds = new_kinds;
+  count = new_count;
+  eytzinger = (version != sorted_version);
+  return file_size;
+}
 
-  uint32_t kind_count;
-  file.read(reinterpret_cast<char*>(&kind_count), sizeof(kind_count));
-  kind_count = le32toh(kind_count);
+template<class F>
+void FileIndex::FileData::sorted_walk(F visit) const {
+  if (!eytzinger) {
+    for (size_t i = 0; i < count; ++i)
+      visit(i);
+    return;
+  }
 
-  kind_map.resize(kind_count);
-  vector_read(file, kind_map);
+  std::vector<uint32_t> order;
+  uint32_t low = 0;
+  for (unsigned bucket = 0; bucket < 256; ++bucket) {
+    const uint32_t high = le32toh(tops[bucket]);
+    eytzinger_order(high - low, order);
+    for (const auto pos : order)
+      visit(low + pos);
+    low = high;
+  }
+}
 
-  kinds.resize(count);
-  vector_read(file, kinds);
+void FileIndex::FileData::append_entries(std::vector<value_type>& entries) const {
+  sorted_walk([&](size_t pos) { entries.push_back(entry(pos)); });
 }
 
 } // namespace cdump
@@ -8,12 +8,15 @@
 #define __INDEX_HH__
 
 #include <cstdint>
-#include <unordered_map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
+#include "bloom.hh"
 #include "kind.hh"
+#include "mapping.hh"
 #include "oid.hh"
+#include "oidmap.hh"
 
 namespace cdump {
 
@@ -33,12 +36,12 @@ class FileIndex {
   // Each index entry maps to this node.
  public:
   struct Node {
-    uint32_t offset;
+    uint64_t offset;
     Kind kind;
 
    public:
     Node() :offset(0), kind("inva") { }
-    Node(uint32_t offset, Kind kind) :offset(offset), kind(kind) { }
+    Node(uint64_t offset, Kind kind) :offset(offset), kind(kind) { }
   };
   using key_type = OID;
   using mapped_type = Node;
@@ -52,97 +55,232 @@ class FileIndex {
 
  protected:
   // Changes from the disk value are kept here.
-  std::unordered_map<OID, Node> ram;
+  OIDMap<Node> ram;
 
   // The find result is built here.  Note it isn't const, since we
   // need to set it.
   std::pair<key_type, mapped_type> find_result;
 
+  // The saved index is used in place, from a read-only mapping of the
+  // index file.  Only the header is read when loading, and the rest
+  // is paged in as lookups touch it.
   class FileData {
-    // The loaded index is stored here.
-    std::vector<uint32_t> tops;
-    std::vector<OID> hashes;
-    std::vector<uint32_t> offsets;
-    std::vector<Kind> kind_map;
-    std::vector<uint8_t> kinds;
+    std::shared_ptr<MappedFile> map;
+
+    // These all point into the mapping.  The integers are stored
+    // little-endian.
+    const uint32_t* tops = nullptr;
+    const OID* hashes = nullptr;
+    const uint32_t* offsets = nullptr;
+    const uint64_t* wide_offsets = nullptr;
+    const Kind* kind_map = nullptr;
+    const uint8_t* kinds = nullptr;
+    uint32_t count = 0;
+
+    // Version 5 and later indexes store each bucket in Eytzinger
+    // order.
+    bool eytzinger = false;
+
+    // Visit the positions of the entries in sorted order.
+    template<class F>
+    void sorted_walk(F visit) const;
+
+    // Filter to avoid searching for keys that aren't present.  Older
+    // index files don't have this, in which case it is empty.
+    BloomFilter filter;
+
+    value_type entry(size_t pos) const {
+      const uint64_t offset = wide_offsets != nullptr ?
+	le64toh(wide_offsets[pos]) : le32toh(offsets[pos]);
+      return value_type(hashes[pos], Node(offset, kind_map[kinds[pos]]));
+    }
 
    public:
-    void load(const std::string name, uint32_t size);
-    bool find(const key_type& key, value_type& result);
-    size_t size() const {
-      return hashes.size();
+    // Load the index file, returning the size of the data file that
+    // it covers.
+    uint64_t load(const std::string name);
+    bool loaded() const {
+      return tops != nullptr;
     }
-    void append_keys(std::vector<OID>& keys) {
-      for (const auto& hash : hashes)
-	keys.emplace_back(hash);
+    bool may_contain(const key_type& key) const {
+      return filter.may_contain(key);
+    }
+    bool find(const key_type& key, value_type& result) const;
+    size_t size() const {
+      return count;
     }
+    void append_entries(std::vector<value_type>& entries) const;
   };
   FileData fdata;
 
+  // Entries inserted since the index was last saved or journaled.
+  // These are also in `ram`.
+  std::vector<value_type> fresh;
+
+  // The size of the data file covered by the saved index, and whether
+  // the journal has been started since it was saved.
+  uint64_t saved_size = 0;
+  bool journal_started = false;
+
+  // Whether saves and journal appends are synced to stable storage.
+  bool sync_writes = false;
+
+  // Replay the journal on top of the saved index, from `covered`
+  // bytes up to at most `size`, returning how far it got.  A missing
+  // or mismatched journal adds nothing.
+  uint64_t replay_journal(const std::string journal, uint64_t covered,
+			  uint64_t size);
+
  public:
   // Differs in that it has no return value (and will raise an
   // exception on error.
   void insert(const value_type& value) {
-    (void)ram.insert(value);
+    if (ram.insert(value))
+      fresh.push_back(value);
   }
 
   // Looks up a key.  If not found, returns the result of end();
   iterator find(const key_type& key);
 
+  // Looks up a key, filling in `result` and returning true if it is
+  // present.  Unlike `find`, this doesn't modify the index, so it can
+  // be called from several threads at once.
+  bool lookup(const key_type& key, value_type& result) const;
+
+  // A quick test of whether `lookup` could find the key, which only
+  // reads one cache line of the saved index's bloom filter.  False
+  // means the key is certainly absent.  Entries that haven't been
+  // saved aren't in the filter, so with any of those this is true.
+  bool may_contain(const key_type& key) const {
+    return !ram.empty() || fdata.may_contain(key);
+  }
+
   // The iterator telling if the find result is actually found.  There
   // is no begin() because this can't be directly iterated.
   iterator end() {
     return nullptr;
   }
 
+  // Index file versions that can be written.  Version 4 stores each
+  // fanout bucket sorted, and version 5 stores each bucket in
+  // Eytzinger order, which is friendlier to the cache.  Version 6 is
+  // laid out like 5, but with 64-bit offsets and size, so it can
+  // describe data files of 4 GiB and over.  All can be read.
+  static const unsigned sorted_version = 4;
+  static const unsigned eytzinger_version = 5;
+  static const unsigned wide_version = 6;
+  static const unsigned current_version = wide_version;
+
+  // The counts in an index file are 32 bits, so that is the most
+  // entries one can hold.  Building a sorted index of more throws
+  // index_error, rather than writing counts that have wrapped.  Pools
+  // move on to a new file before getting there.
+  static const uint64_t max_entries = UINT32_MAX;
+  static void check_entry_count(uint64_t count);
+
+  // The number of entries, saved and unsaved.  Keys inserted again
+  // since the index was saved are counted twice.
+  uint64_t entry_count() const {
+    return fdata.size() + ram.size();
+  }
+
   // Write out this index to the given file.  The 'size' is recorded
   // with the index, and if it doesn't match on 'load', the index will
   // not be used.
-  void save(const std::string name, uint32_t size);
+  void save(const std::string name, uint64_t size,
+	    unsigned version = current_version);
 
-  // Load the index.  Obliterates currently loaded data.
-  void load(const std::string name, uint32_t size) {
-    ram.clear();
-    fdata.load(name, size);
+  // Write an index file holding just the given entries, without
+  // going through the RAM index.  This is for building the index of
+  // an existing data file in one go.  Where a key is repeated, the
+  // entry with the lowest offset is kept.  The entries are consumed.
+  void save_entries(const std::string name, uint64_t size,
+		    std::vector<value_type>&& entries,
+		    unsigned version = current_version);
+
+  // Append the entries that have been saved to the index file, in
+  // sorted order.
+  void saved_entries(std::vector<value_type>& entries) const {
+    fdata.append_entries(entries);
+  }
+
+  // Append the entries that have been inserted since the last load,
+  // in no particular order.  This includes journaled entries.
+  void unsaved_entries(std::vector<value_type>& entries) const {
+    for (const auto& elt : ram)
+      entries.emplace_back(elt);
   }
 
-  // The FullIterator iterates the FileIndex in sorted hash order.
+  // Are there any entries that aren't in the saved index file.
+  bool has_unsaved() const {
+    return !ram.empty();
+  }
+
+  // Load the index.  Obliterates currently loaded data.
+  void load(const std::string name, uint64_t size);
+
+  // Load the index, along with the journal of entries added since it
+  // was saved.  Together, they must cover 'size' bytes of the data
+  // file.  A journal left from before the index was saved is ignored.
+  void load(const std::string name, const std::string journal,
+	    uint64_t size);
+
+  // Load as much of the index and journal as is intact, without
+  // requiring them to cover the whole data file, and return the size
+  // of the prefix of the data file that they do cover.  A missing or
+  // damaged index covers nothing.  This is for recovery, which only
+  // needs to scan the data after the prefix.
+  uint64_t load_prefix(const std::string name, const std::string journal,
+		       uint64_t size);
+
+  // The journal is an append-only log of the entries added since the
+  // index file was saved, which lets a flush avoid rewriting the
+  // whole index.  Append the entries inserted since the last save or
+  // append, recording that the data file is now 'size' bytes.
+  void append_journal(const std::string journal, uint64_t size);
+
+  // When set, `save` and `append_journal` don't return until what
+  // they wrote, and its name, have reached stable storage.
+  void set_sync(bool value) { sync_writes = value; }
+
+  // Should the journal be merged into a full save of the index?  This
+  // is once the journal is large compared to the saved index, or when
+  // there is no saved index for it to extend.
+  bool journal_full() const;
+
+  // The SortedIterator iterates the FileIndex in sorted hash order.
+  //
+  // The entries are gathered along with their nodes, and then
+  // partitioned with a counting sort on the first two bytes of the
+  // hash.  Since the hashes are uniform, each partition holds only a
+  // handful of entries, which are sorted in place.  This keeps
+  // building the index linear, and yields the fanout table for free.
   class SortedIterator {
-    FileIndex* parent;
    protected:
-    std::vector<key_type> keys;
+    std::vector<value_type> entries;
+    std::vector<uint32_t> tops;
     friend class FileIndex;
+    void build(std::vector<value_type>& work);
    public:
-    SortedIterator(FileIndex* parent);
-    const std::vector<key_type>& get_keys() { return keys; };
-
-    // The iterator itself returned.
-    struct iterator {
-      FileIndex* parent;
-      decltype(keys)::iterator it;
-
-      friend bool operator==(const iterator& a, const iterator& b) {
-	return a.it == b.it;
-      }
-      friend bool operator!=(const iterator& a, const iterator& b) {
-	return a.it != b.it;
-      }
-
-      iterator& operator++() {
-	++it;
-	return *this;
-      }
-
-      value_type operator*() {
-	return *parent->find(*it);
-      }
-    };
-
-    const iterator begin() {
-      return iterator { parent, keys.begin() };
+    SortedIterator(const FileIndex* parent);
+
+    // Sort the given entries, rather than those of an index.
+    SortedIterator(std::vector<value_type>&& work);
+
+    size_t size() const { return entries.size(); }
+    const std::vector<value_type>& get_entries() const { return entries; }
+
+    // For each possible first byte, the number of entries whose first
+    // byte is less than or equal to it.
+    const std::vector<uint32_t>& get_tops() const { return tops; }
+
+    using iterator = std::vector<value_type>::const_iterator;
+
+    iterator begin() const {
+      return entries.begin();
     }
-    const iterator end() {
-      return iterator { parent, keys.end() };
+    iterator end() const {
+      return entries.end();
     }
   };
 };
@@ -0,0 +1,119 @@
+// Parallel insertion into a pool.
+
+#include "ingest.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace cdump {
+
+const size_t Ingest::default_queue_limit;
+
+Ingest::Ingest(Pool& pool, unsigned worker_count, size_t queue_limit)
+  : pool(pool), queue_limit(queue_limit > 0 ? queue_limit : 1)
+{
+  if (worker_count == 0)
+    worker_count = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < worker_count; ++i)
+    workers.emplace_back(&Ingest::run_worker, this);
+  writer = std::thread(&Ingest::run_writer, this);
+}
+
+Ingest::~Ingest() {
+  finish();
+}
+
+std::future<OID> Ingest::submit(Kind kind, Chunk::data_type&& data) {
+  std::unique_ptr<Job> job(new Job(kind, std::move(data)));
+  auto result = job->result.get_future();
+
+  std::unique_lock<std::mutex> guard(lock);
+  room_cond.wait(guard, [this]() {
+      return closing || jobs.size() < queue_limit;
+    });
+  if (closing)
+    throw std::logic_error("Submit to finished ingest");
+
+  work.push_back(job.get());
+  jobs.push_back(std::move(job));
+  work_cond.notify_one();
+  return result;
+}
+
+void Ingest::finish() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (closing)
+      return;
+    closing = true;
+  }
+  work_cond.notify_all();
+  ready_cond.notify_all();
+  room_cond.notify_all();
+
+  for (auto& worker : workers)
+    worker.join();
+  writer.join();
+}
+
+void Ingest::run_worker() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    work_cond.wait(guard, [this]() { return closing || !work.empty(); });
+    if (work.empty())
+      return;
+
+    Job* job = work.front();
+    work.pop_front();
+    guard.unlock();
+
+    // The expensive part: hashing, and then trying to compress, which
+    // is remembered by the chunk.  Choosing the pool's dictionary here
+    // keeps `insert` from compressing again on the writer.
+    try {
+      auto chunk = new PlainChunk(job->kind, std::move(job->data));
+      job->chunk.reset(chunk);
+      pool.use_dictionary(*chunk);
+      chunk->write_size();
+    } catch (...) {
+      job->error = std::current_exception();
+    }
+
+    guard.lock();
+    job->ready = true;
+    if (job == jobs.front().get())
+      ready_cond.notify_one();
+  }
+}
+
+void Ingest::run_writer() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    ready_cond.wait(guard, [this]() {
+	return (!jobs.empty() && jobs.front()->ready) ||
+	  (closing && jobs.empty());
+      });
+    if (jobs.empty())
+      return;
+
+    std::unique_ptr<Job> job(std::move(jobs.front()));
+    jobs.pop_front();
+    room_cond.notify_one();
+
+    guard.unlock();
+    if (job->error) {
+      job->result.set_exception(job->error);
+    } else {
+      try {
+	pool.insert(*job->chunk);
+	job->result.set_value(job->chunk->oid());
+      } catch (...) {
+	job->result.set_exception(std::current_exception());
+      }
+    }
+    guard.lock();
+  }
+}
+
+} // namespace cdump
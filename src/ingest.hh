@@ -0,0 +1,107 @@
+// Parallel insertion into a pool.
+
+#ifndef __INGEST_HH__
+#define __INGEST_HH__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "chunk.hh"
+#include "pool.hh"
+
+namespace cdump {
+
+/**
+ * A pipeline for inserting data into a pool.
+ *
+ * Building a chunk means hashing its data, and then trying to
+ * compress it, both of which are much slower than writing it.  The
+ * pipeline does these on a set of worker threads, while a single
+ * writer thread inserts the finished chunks into the pool, in the
+ * order they were submitted.
+ *
+ * At most `queue_limit` chunks are in the pipeline at once.  Beyond
+ * that, `submit` waits for the writer to catch up, which bounds the
+ * memory used when the producer is faster than the pool.
+ *
+ * While the pipeline is running, the writer thread owns the pool, and
+ * nothing else should use it.  The workers only ask it for the
+ * dictionary to compress with.  `finish` (or destruction) waits for
+ * everything submitted to be written.  The pool isn't flushed.
+ */
+class Ingest {
+ public:
+  static const size_t default_queue_limit = 256;
+
+  /**
+   * Start a pipeline writing to `pool`, with `workers` threads
+   * building chunks.  Zero workers means one per hardware thread.
+   */
+  Ingest(Pool& pool, unsigned workers = 0,
+	 size_t queue_limit = default_queue_limit);
+  ~Ingest();
+
+  Ingest(const Ingest&) = delete;
+  Ingest& operator=(const Ingest&) = delete;
+
+  /**
+   * Submit data to be stored as a chunk of the given kind.  The
+   * future becomes ready once the chunk has been inserted into the
+   * pool, and gives its OID, or the exception raised building or
+   * inserting it.
+   */
+  std::future<OID> submit(Kind kind, Chunk::data_type&& data);
+
+  /// Wait for everything submitted to be written, and stop the
+  /// threads.  Nothing can be submitted afterward.
+  void finish();
+
+ private:
+  struct Job {
+    Kind kind;
+    Chunk::data_type data;
+    Chunk::ChunkPtr chunk;
+    std::exception_ptr error;
+    std::promise<OID> result;
+    bool ready = false;
+
+    Job(Kind kind, Chunk::data_type&& data)
+      :kind(kind), data(std::move(data)) {}
+  };
+
+  Pool& pool;
+  const size_t queue_limit;
+
+  std::mutex lock;
+  // Workers wait for `work`, the writer for the front job to be
+  // ready, and submitters for there to be room.
+  std::condition_variable work_cond;
+  std::condition_variable ready_cond;
+  std::condition_variable room_cond;
+
+  // Every job in the pipeline, in submission order.
+  std::deque<std::unique_ptr<Job>> jobs;
+
+  // The jobs that no worker has started on.
+  std::deque<Job*> work;
+
+  bool closing = false;
+
+  std::vector<std::thread> workers;
+  std::thread writer;
+
+  void run_worker();
+  void run_writer();
+};
+
+} // namespace cdump
+
+#endif // __INGEST_HH__
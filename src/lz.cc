@@ -0,0 +1,274 @@
+// Fast LZ77 compression.
+
+#include "lz.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+#include <stdexcept>
+
+namespace cdump {
+namespace lz {
+
+namespace {
+
+// The format requires the last 5 bytes to be literals, and the last
+// match to start at least 12 bytes before the end.  A block shorter
+// than that is all literals.
+const unsigned min_match = 4;
+const unsigned last_literals = 5;
+const unsigned match_margin = 12;
+const unsigned max_offset = 65535;
+
+// A small table keeps it in L1.  Each entry is the last position
+// whose 4 bytes hashed there.
+const unsigned hash_bits = 12;
+
+inline uint32_t read32(const unsigned char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t read64(const unsigned char* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Copy in 16 byte blocks, which may write up to 15 bytes past `len`,
+// for when there is room for it.  This is much faster for the short
+// copies that most sequences are than an exact copy.  The source
+// must not overlap the destination by less than 16 bytes.
+inline void wild_copy(unsigned char* dest, const unsigned char* src,
+		      unsigned len)
+{
+  for (unsigned pos = 0; pos < len; pos += 16)
+    memcpy(dest + pos, src + pos, 16);
+}
+
+inline unsigned hash_of(uint32_t seq) {
+  return (seq * 2654435761u) >> (32 - hash_bits);
+}
+
+// Write the extra bytes of a length whose field in the token is
+// full.
+unsigned char* put_length(unsigned char* op, unsigned char* oend,
+			  unsigned len)
+{
+  while (len >= 255) {
+    if (op == oend)
+      return nullptr;
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op == oend)
+    return nullptr;
+  *op++ = len;
+  return op;
+}
+
+// Write one sequence: the literals, and then a match, unless
+// `match_len` is zero, which ends the block.  Returns null if the
+// output is full.
+unsigned char* emit(unsigned char* op, unsigned char* oend,
+		    const unsigned char* lit, unsigned lit_len,
+		    unsigned offset, unsigned match_len)
+{
+  if (op == oend)
+    return nullptr;
+  unsigned char* token = op++;
+  const unsigned extra = match_len > 0 ? match_len - min_match : 0;
+  *token = (std::min(lit_len, 15u) << 4) | std::min(extra, 15u);
+
+  if (lit_len >= 15 && (op = put_length(op, oend, lit_len - 15)) == nullptr)
+    return nullptr;
+  if (unsigned(oend - op) < lit_len)
+    return nullptr;
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+
+  if (match_len == 0)
+    return op;
+
+  if (oend - op < 2)
+    return nullptr;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (extra >= 15)
+    op = put_length(op, oend, extra - 15);
+  return op;
+}
+
+[[noreturn]] void corrupt() {
+  throw std::runtime_error("Corrupt LZ compressed data");
+}
+
+} // namespace
+
+int compress(const char* csrc, unsigned src_len, char* cdest, unsigned dest_cap) {
+  const auto src = reinterpret_cast<const unsigned char*>(csrc);
+  const auto dest = reinterpret_cast<unsigned char*>(cdest);
+  unsigned char* op = dest;
+  unsigned char* const oend = dest + dest_cap;
+  unsigned anchor = 0;
+
+  if (src_len > match_margin) {
+    uint32_t table[1 << hash_bits] = { 0 };
+    const unsigned match_limit = src_len - last_literals;
+    const unsigned start_limit = src_len - match_margin;
+
+    // Skip ahead faster the longer nothing matches, so incompressible
+    // data is given up on quickly.
+    unsigned misses = 0;
+    unsigned ip = 0;
+    while (ip < start_limit) {
+      const uint32_t seq = read32(src + ip);
+      const unsigned h = hash_of(seq);
+      const unsigned ref = table[h];
+      table[h] = ip;
+
+      if (ref >= ip || ip - ref > max_offset || read32(src + ref) != seq) {
+	ip += 1 + (misses++ >> 5);
+	continue;
+      }
+      misses = 0;
+
+      // Extend the match in both directions.
+      const unsigned offset = ip - ref;
+      unsigned start = ip;
+      while (start > anchor && start > offset &&
+	     src[start - 1] == src[start - 1 - offset])
+	--start;
+      unsigned end = ip + min_match;
+      while (end + 8 <= match_limit) {
+	const uint64_t diff = read64(src + end) ^ read64(src + end - offset);
+	if (diff != 0) {
+	  end += __builtin_ctzll(le64toh(diff)) / 8;
+	  goto extended;
+	}
+	end += 8;
+      }
+      while (end < match_limit && src[end] == src[end - offset])
+	++end;
+    extended:
+
+      op = emit(op, oend, src + anchor, start - anchor, offset, end - start);
+      if (op == nullptr)
+	return -1;
+      ip = anchor = end;
+
+      // Remember a position near the end of the match, so that a
+      // repeat of what follows it is found.
+      if (ip < start_limit)
+	table[hash_of(read32(src + ip - 2))] = ip - 2;
+    }
+  }
+
+  op = emit(op, oend, src + anchor, src_len - anchor, 0, 0);
+  if (op == nullptr)
+    return -1;
+  return op - dest;
+}
+
+void decompress(const char* csrc, unsigned src_len,
+		char* cdest, unsigned dest_len)
+{
+  const auto* ip = reinterpret_cast<const unsigned char*>(csrc);
+  const auto* const iend = ip + src_len;
+  const auto dest = reinterpret_cast<unsigned char*>(cdest);
+  unsigned char* op = dest;
+  unsigned char* const oend = dest + dest_len;
+
+  auto get_length = [&](unsigned len) {
+    unsigned char byte;
+    do {
+      if (ip == iend || len > dest_len)
+	corrupt();
+      byte = *ip++;
+      len += byte;
+    } while (byte == 255);
+    return len;
+  };
+
+  for (;;) {
+    if (ip == iend)
+      corrupt();
+    const unsigned token = *ip++;
+    unsigned lit_len = token >> 4;
+    unsigned len = token & 15;
+    unsigned offset;
+
+    if (lit_len < 15 && len < 15 && iend - ip >= 32 && oend - op >= 32) {
+      // Most sequences are short, and far enough from the ends of
+      // the buffers to copy a fixed amount, which needs no checks
+      // beyond the offset.
+      memcpy(op, ip, 16);
+      op += lit_len;
+      ip += lit_len;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      len += min_match;
+      if (offset >= 8 && offset <= unsigned(op - dest)) {
+	const unsigned char* match = op - offset;
+	memcpy(op, match, 8);
+	memcpy(op + 8, match + 8, 8);
+	memcpy(op + 16, match + 16, 2);
+	op += len;
+	continue;
+      }
+    } else {
+      if (lit_len == 15)
+	lit_len = get_length(lit_len);
+      if (unsigned(iend - ip) < lit_len || unsigned(oend - op) < lit_len)
+	corrupt();
+      if (unsigned(iend - ip) >= lit_len + 16 &&
+	  unsigned(oend - op) >= lit_len + 16)
+	wild_copy(op, ip, lit_len);
+      else
+	memcpy(op, ip, lit_len);
+      op += lit_len;
+      ip += lit_len;
+
+      // The block ends after the literals of the last sequence.
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	corrupt();
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (len == 15)
+	len = get_length(len);
+      len += min_match;
+    }
+
+    if (offset == 0 || offset > unsigned(op - dest))
+      corrupt();
+    if (unsigned(oend - op) < len)
+      corrupt();
+
+    // A match can overlap what it produces, repeating a pattern.
+    // Copying as much of the pattern as has been produced each time
+    // keeps the copies from overlapping.
+    const unsigned char* match = op - offset;
+    if (offset >= 16 && unsigned(oend - op) >= len + 16) {
+      wild_copy(op, match, len);
+      op += len;
+      continue;
+    }
+    while (len > 0) {
+      const unsigned count = std::min(unsigned(op - match), len);
+      memcpy(op, match, count);
+      op += count;
+      len -= count;
+    }
+  }
+
+  if (op != oend)
+    corrupt();
+}
+
+} // namespace lz
+} // namespace cdump
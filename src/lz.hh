@@ -0,0 +1,41 @@
+// Fast LZ77 compression.
+
+#ifndef __LZ_HH__
+#define __LZ_HH__
+
+namespace cdump {
+
+/**
+ * A byte-oriented LZ77 compressor, using the LZ4 block format.
+ *
+ * The compressor is a single greedy pass, finding matches through a
+ * small hash table of 4-byte sequences, and the decompressor only
+ * copies literals and matches, with no entropy coding, so both run
+ * at memory speed.  The ratio is well below zlib's, which is the
+ * price of decompressing several times faster.
+ *
+ * The compressed block doesn't record the uncompressed size, which
+ * the caller must keep.
+ */
+namespace lz {
+
+/**
+ * Compress `src_len` bytes from `src` into `dest`, which has room for
+ * `dest_cap` bytes.  Returns the compressed size, or -1 if it would
+ * not fit.
+ */
+int compress(const char* src, unsigned src_len, char* dest, unsigned dest_cap);
+
+/**
+ * Decompress a block, which must expand to exactly `dest_len` bytes.
+ * Throws std::runtime_error if the block is damaged.  Never reads or
+ * writes outside of the given buffers.
+ */
+void decompress(const char* src, unsigned src_len,
+		char* dest, unsigned dest_len);
+
+} // namespace lz
+
+} // namespace cdump
+
+#endif // __LZ_HH__
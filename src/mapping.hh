@@ -0,0 +1,68 @@
+// Read-only file mappings.
+
+#ifndef __MAPPING_HH__
+#define __MAPPING_HH__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+namespace cdump {
+
+/**
+ * A read-only mapping of an entire file.
+ *
+ * Pages are brought in by the kernel as they are touched, and are
+ * shared through the page cache with any other process mapping or
+ * reading the same file.  The mapping remains valid even if the file
+ * is replaced by a rename, since it holds onto the original inode.
+ */
+class MappedFile {
+  const char* base;
+  size_t length;
+
+ public:
+  MappedFile(const std::string& path) :base(nullptr), length(0) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("Unable to open file to map");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("Unable to stat file to map");
+    }
+    length = st.st_size;
+
+    // An empty mapping isn't allowed, but an empty file is.
+    if (length > 0) {
+      void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+	close(fd);
+	throw std::runtime_error("Unable to map file");
+      }
+      base = static_cast<const char*>(addr);
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (base != nullptr)
+      munmap(const_cast<char*>(base), length);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return base; }
+  size_t size() const { return length; }
+};
+
+} // namespace cdump
+
+#endif // __MAPPING_HH__
@@ -75,6 +75,15 @@ struct OID {
     return raw[0];
   }
 
+  // Peek at the 64-bit big-endian word starting at byte 'pos', which
+  // must be no more than hash_length - 8.  Because the words are
+  // big-endian, they order the same way the OIDs themselves do.
+  uint64_t peek_word(unsigned pos) const {
+    uint64_t word;
+    memcpy(&word, raw + pos, sizeof(word));
+    return be64toh(word);
+  }
+
  private:
   friend struct std::hash<OID>;
   union {
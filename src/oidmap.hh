@@ -0,0 +1,238 @@
+// Flat hash table keyed by OID.
+
+#ifndef __OIDMAP_HH__
+#define __OIDMAP_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "oid.hh"
+
+namespace cdump {
+
+/**
+ * An open-addressing hash table mapping OIDs to values.
+ *
+ * The entries are stored inline in a single array, rather than in a
+ * node per entry, as std::unordered_map does.  A parallel array holds
+ * one control byte per slot: either `empty`, or 7 bits of the hash
+ * (the tag).  Probing examines a group of 16 control bytes at a time
+ * (with SSE2 when it is available), and only compares the keys whose
+ * tag matches, so a lookup usually touches one control group and one
+ * entry.
+ *
+ * OIDs are already uniformly distributed, so the hash is just
+ * `std::hash<OID>`, which takes bits straight from the OID.
+ *
+ * Entries can't be erased individually, which the index has no need
+ * for, so there are no tombstones to deal with.
+ */
+template<class V>
+class OIDMap {
+ public:
+  using key_type = OID;
+  using mapped_type = V;
+  using value_type = std::pair<OID, V>;
+
+ private:
+  static const unsigned group_size = 16;
+  static const uint8_t empty_ctrl = 0x80;
+
+  std::vector<uint8_t> ctrl;
+  std::vector<value_type> slots;
+  size_t count = 0;
+  size_t group_mask = 0;  // Number of groups - 1.
+
+  static uint32_t hash_of(const OID& key) {
+    return std::hash<OID>()(key);
+  }
+
+  // The tag comes from the high bits, and the starting group from the
+  // low bits, so they are independent.
+  static uint8_t tag_of(uint32_t hash) {
+    return hash >> 25;
+  }
+
+  // Bit mask of the control bytes in the group at `pos` that equal
+  // `value`.
+  uint32_t match(size_t pos, uint8_t value) const {
+#ifdef __SSE2__
+    const __m128i group = _mm_loadu_si128(
+	reinterpret_cast<const __m128i*>(ctrl.data() + pos));
+    return _mm_movemask_epi8(
+	_mm_cmpeq_epi8(group, _mm_set1_epi8(char(value))));
+#else
+    uint32_t result = 0;
+    for (unsigned i = 0; i < group_size; ++i) {
+      if (ctrl[pos + i] == value)
+	result |= 1u << i;
+    }
+    return result;
+#endif
+  }
+
+  // Visit the groups of the probe sequence for a hash.  Groups are
+  // probed triangularly, which covers every group since the count is
+  // a power of two.  The visitor returns true to stop.
+  template<class F>
+  void probe(uint32_t hash, F visit) const {
+    size_t group = hash & group_mask;
+    for (size_t step = 1; ; ++step) {
+      if (visit(group * group_size))
+	return;
+      group = (group + step) & group_mask;
+    }
+  }
+
+  void grow();
+
+  // Put a value known not to be present into the table, which must
+  // have room for it.
+  void place(const value_type& value) {
+    const uint32_t hash = hash_of(value.first);
+    probe(hash, [&](size_t pos) {
+	const uint32_t bits = match(pos, empty_ctrl);
+	if (bits == 0)
+	  return false;
+	const size_t slot = pos + __builtin_ctz(bits);
+	ctrl[slot] = tag_of(hash);
+	slots[slot] = value;
+	return true;
+      });
+    ++count;
+  }
+
+ public:
+  OIDMap() {
+    clear();
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  // The total number of slots.
+  size_t capacity() const { return slots.size(); }
+
+  // Remove everything, and release the storage.
+  void clear() {
+    ctrl.assign(group_size, empty_ctrl);
+    std::vector<value_type>(group_size).swap(slots);
+    count = 0;
+    group_mask = 0;
+  }
+
+  // Make room for at least `want` entries without growing.
+  void reserve(size_t want);
+
+  /**
+   * Look up a key, returning a pointer to its entry, or nullptr if it
+   * isn't present.  The pointer is invalidated by an insert.
+   */
+  const value_type* find(const OID& key) const {
+    const uint32_t hash = hash_of(key);
+    const uint8_t tag = tag_of(hash);
+    const value_type* result = nullptr;
+    probe(hash, [&](size_t pos) {
+	for (uint32_t bits = match(pos, tag); bits != 0; bits &= bits - 1) {
+	  const size_t slot = pos + __builtin_ctz(bits);
+	  if (slots[slot].first == key) {
+	    result = &slots[slot];
+	    return true;
+	  }
+	}
+	return match(pos, empty_ctrl) != 0;
+      });
+    return result;
+  }
+
+  /**
+   * Insert an entry, if the key isn't already present.  Returns true
+   * if it was inserted.
+   */
+  bool insert(const value_type& value) {
+    if (find(value.first) != nullptr)
+      return false;
+    if ((count + 1) * 8 > capacity() * 7)
+      grow();
+    place(value);
+    return true;
+  }
+
+  // Iteration visits the entries in no particular order.
+  class const_iterator {
+    const OIDMap* map;
+    size_t slot;
+
+    void skip() {
+      while (slot < map->capacity() && map->ctrl[slot] == empty_ctrl)
+	++slot;
+    }
+
+   public:
+    const_iterator(const OIDMap* map, size_t slot) :map(map), slot(slot) {
+      skip();
+    }
+
+    const value_type& operator*() const { return map->slots[slot]; }
+    const value_type* operator->() const { return &map->slots[slot]; }
+
+    const_iterator& operator++() {
+      ++slot;
+      skip();
+      return *this;
+    }
+
+    friend bool operator==(const const_iterator& a, const const_iterator& b) {
+      return a.slot == b.slot;
+    }
+    friend bool operator!=(const const_iterator& a, const const_iterator& b) {
+      return a.slot != b.slot;
+    }
+  };
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, capacity()); }
+};
+
+template<class V>
+const unsigned OIDMap<V>::group_size;
+template<class V>
+const uint8_t OIDMap<V>::empty_ctrl;
+
+template<class V>
+void OIDMap<V>::reserve(size_t want) {
+  size_t groups = group_mask + 1;
+  while (want * 8 > groups * group_size * 7)
+    groups *= 2;
+  if (groups == group_mask + 1)
+    return;
+
+  // Move the old entries into fresh tables.
+  std::vector<uint8_t> old_ctrl(groups * group_size, empty_ctrl);
+  std::vector<value_type> old_slots(groups * group_size);
+  old_ctrl.swap(ctrl);
+  old_slots.swap(slots);
+  group_mask = groups - 1;
+  count = 0;
+
+  for (size_t slot = 0; slot < old_slots.size(); ++slot) {
+    if (old_ctrl[slot] != empty_ctrl)
+      place(old_slots[slot]);
+  }
+}
+
+template<class V>
+void OIDMap<V>::grow() {
+  reserve(capacity());
+}
+
+} // namespace cdump
+
+#endif // __OIDMAP_HH__
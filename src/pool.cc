@@ -1,29 +1,39 @@
 // Storage pools.
 
 #include "pool.hh"
+#include "codec.hh"
 #include "except.hh"
+#include "mapping.hh"
+#include "sync.hh"
 
+#include <algorithm>
+#include <cerrno>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
-#include <boost/regex.hpp>
 #include <boost/random/random_device.hpp>
 
 namespace bf = boost::filesystem;
 namespace bu = boost::uuids;
 namespace po = boost::program_options;
 
-// This can be made std once that works in all toolchains.
-namespace re = boost;
-
 namespace cdump {
 
 namespace {
@@ -43,12 +53,36 @@ void ensure_empty(const std::string path) {
     throw std::invalid_argument("path doesn't name empty directory");
 }
 
+// Write all of the buffers, continuing after short writes.  The
+// vector is modified.
+void write_fully(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t done = ::writev(fd, iov, count);
+    if (done < 0) {
+      if (errno == EINTR)
+	continue;
+      throw std::runtime_error("Unable to write to pool file");
+    }
+
+    // Skip past what was written.
+    while (count > 0 && size_t(done) >= iov->iov_len) {
+      done -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+      iov->iov_len -= done;
+    }
+  }
+}
+
 } // namespace
 
 // Pool construction.  Ensures the directory is completely blank, and
 // writes the properties file to it.
 void Pool::create_pool(const std::string path,
-		       unsigned limit,
+		       uint64_t limit,
 		       bool newlib)
 {
   if (limit < limit_lower_bound || limit >= limit_upper_bound)
@@ -82,7 +116,7 @@ void Pool::read_props(std::string path) {
   desc.add_options()
       ("uuid", po::value<bu::uuid>(&props.uuid), "uuid")
       ("newfile", po::value<bool>(&props.newfile), "newfile")
-      ("limit", po::value<unsigned>(&props.limit), "limit");
+      ("limit", po::value<uint64_t>(&props.limit), "limit");
 
   po::variables_map vm;
   po::store(po::parse_config_file<char>(path.c_str(), desc), vm);
@@ -127,10 +161,11 @@ Pool::Pool(const std::string path, bool writable, bool recover)
   ppath /= "props.txt";
   read_props(ppath.string());
   first_newfile = props.newfile;
+  dictionaries = std::make_shared<DictionarySet>(read_dictionaries());
   if (recover)
     recover_files();
   else
-    scan_files();
+    open_pool();
 }
 
 void Pool::recover_index(const std::string path) {
@@ -139,22 +174,186 @@ void Pool::recover_index(const std::string path) {
   Pool (path, true, true);
 }
 
+void Pool::upgrade_indexes(const std::string path) {
+  Pool pool(path, true);
+  for (auto& f : pool.files) {
+    pool.load_index(f);
+    const auto name = pool.construct_name(f.pos, ".idx");
+    f.index.set_sync(true);
+    f.index.save(name, f.size);
+    f.index.load(name, f.size);
+    bf::remove(pool.construct_name(f.pos, ".jnl"));
+  }
+
+  // And merge the pool index into a single run.
+  pool.need_pool_index();
+  pool.pool_index.set_sync(true);
+  pool.pool_index.merge(true);
+}
+
 std::string Pool::lock_path() {
   auto work = base;
   work /= "lock";
   return work.string();
 }
 
-Chunk::ChunkPtr Pool::find(const OID& key) {
-  for (auto& f : files) {
-    const auto res = f.index.find(key);
-    if (res != f.index.end()) {
-      f.file.seekg(res->second.offset);
-      return Chunk::read(f.file);
+Chunk::SharedPtr Pool::find(const OID& key) {
+  need_pool_index();
+
+  PoolIndex::Location loc;
+  if (pool_index.find(key, loc))
+    return fetch(key, loc);
+  return Chunk::SharedPtr();
+}
+
+Chunk::SharedPtr Pool::fetch(const OID& key, const PoolIndex::Location& loc) {
+  if (!chunk_cache)
+    return read_chunk(loc);
+
+  auto chunk = chunk_cache->find(key);
+  if (!chunk) {
+    chunk = read_chunk(loc);
+    chunk_cache->insert(chunk);
+  }
+  return chunk;
+}
+
+Chunk::ChunkPtr Pool::read_chunk(const PoolIndex::Location& loc) {
+  // Only the last file can still be written to, and only if the pool
+  // is writable.
+  const bool last = loc.file == files.front().pos;
+  if (mapped_reads && (!writable || !last))
+    return Chunk::read_mapped(mapping_of(*file_table[loc.file]), loc.offset,
+			      dictionaries);
+
+  if (dirty && last) {
+    std::lock_guard<std::mutex> guard(staging_lock);
+    write_staging();
+  }
+
+  const auto handle = open_files.get(loc.file, [this, &loc]() {
+      return construct_name(loc.file, ".data");
+    });
+  return Chunk::read_at(handle->fd(), loc.offset, dictionaries);
+}
+
+std::shared_ptr<const MappedFile> Pool::mapping_of(File& file) {
+  // Once the mapping exists, readers only need an atomic load of it.
+  // The lock is just for making it, so that it is made once.
+  auto mapping = std::atomic_load(&file.mapping);
+  if (mapping)
+    return mapping;
+
+  std::lock_guard<std::mutex> guard(mapping_lock);
+  mapping = std::atomic_load(&file.mapping);
+  if (!mapping) {
+    try {
+      mapping = std::make_shared<MappedFile>(
+	construct_name(file.pos, ".data"));
+    } catch (std::runtime_error&) {
+      throw pool_open_error("Unable to map pool file");
     }
+    std::atomic_store(&file.mapping, mapping);
+  }
+  return mapping;
+}
+
+bool Pool::contains(const OID& key) {
+  need_pool_index();
+
+  PoolIndex::Location loc;
+  return pool_index.find(key, loc);
+}
+
+std::vector<Pool::Lookup> Pool::locate_many(const OID* keys, size_t count) {
+  need_pool_index();
+
+  std::vector<Lookup> results;
+  pool_index.find_many(keys, count, results);
+  return results;
+}
+
+std::vector<Chunk::SharedPtr> Pool::find_many(const OID* keys, size_t count) {
+  const auto where = locate_many(keys, count);
+
+  std::vector<uint32_t> order;
+  for (size_t i = 0; i < count; ++i) {
+    if (where[i].found)
+      order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&where](uint32_t a, uint32_t b) {
+      const auto& la = where[a].loc;
+      const auto& lb = where[b].loc;
+      return la.file < lb.file || (la.file == lb.file && la.offset < lb.offset);
+    });
+
+  std::vector<Chunk::SharedPtr> result(count);
+  for (const auto i : order)
+    result[i] = fetch(keys[i], where[i].loc);
+  return result;
+}
+
+void Pool::need_pool_index() {
+  if (pool_index_built)
+    return;
+
+  std::lock_guard<std::mutex> guard(pool_index_lock);
+  if (!pool_index_built)
+    build_pool_index();
+}
+
+void Pool::build_pool_index() {
+  // `files` is newest first, and the pool index wants them oldest
+  // first.
+  std::vector<File*> order;
+  for (auto& f : files)
+    order.push_back(&f);
+  std::reverse(order.begin(), order.end());
+
+  PoolIndex::FileSizes sizes;
+  for (const auto f : order)
+    sizes.emplace_back(f->pos, f->size);
+  auto metadata = base;
+  metadata /= "metadata";
+  pool_index.open(metadata.string(), sizes, writable);
+
+  // The files newer than the saved runs are searched through their own
+  // indexes, which loading only maps.  All but the last are finished.
+  for (const auto f : order) {
+    if (pool_index.covers(f->pos))
+      continue;
+    load_index(*f);
+    pool_index.add(f->pos, &f->index);
+    if (f != &files.front())
+      pool_index.finish(f->pos, f->size);
   }
+  pool_index_built = true;
+}
+
+void Pool::add_file(unsigned pos, uint64_t size) {
+  files.emplace_front(pos, size);
+  if (file_table.size() <= pos)
+    file_table.resize(pos + 1, nullptr);
+  file_table[pos] = &files.front();
+}
 
-  return Chunk::ChunkPtr();
+void Pool::create_file(unsigned pos) {
+  add_file(pos, 0);
+  auto& file = files.front();
+  file.make_writable(*this);
+  file.new_entry = true;
+  file.index_loaded = true;
+  if (pool_index_built)
+    pool_index.add(pos, &file.index);
+  write_manifest();
+}
+
+void Pool::load_index(File& file) {
+  if (file.index_loaded)
+    return;
+  file.index.load(construct_name(file.pos, ".idx"),
+		  construct_name(file.pos, ".jnl"), file.size);
+  file.index_loaded = true;
 }
 
 void Pool::prepare_write(unsigned size) {
@@ -163,18 +362,19 @@ void Pool::prepare_write(unsigned size) {
   // Decide if we need to open a new file, or the existing one.
   if (dirty) {
     // If there is room, just write.
-    if (write_pos + size <= props.limit)
+    if (has_room(files.front(), size))
       return;
 
-    // Otherwise, flush, and move on to a new file.
-    flush();
+    // Otherwise, seal this file, and move on to a new file.
+    flush_index(true);
     force_new = true;
   } else {
     // If there is a file, see if there would be room to write to it.
     if (files.empty())
       force_new = true;
     else {
-      if (files.front().size + size > props.limit)
+      load_index(files.front());
+      if (!has_room(files.front(), size))
 	force_new = true;
     }
   }
@@ -183,9 +383,22 @@ void Pool::prepare_write(unsigned size) {
   // or opening the last one.
   if (force_new) {
     unsigned index = 0;
-    if (!files.empty())
+    if (!files.empty()) {
+      // The previous file won't be written to again, so merge any
+      // journal it has.
+      load_index(files.front());
+      files.front().index.set_sync(durability.mode != Durability::None);
+      seal_index(files.front());
+      files.front().index.set_sync(false);
       index = files.front().pos + 1;
-    files.emplace_front(*this, index, true);
+
+      // It can now go into the pool index's runs.
+      need_pool_index();
+      pool_index.finish(files.front().pos, files.front().size);
+      pool_index.set_sync(durability.mode != Durability::None);
+      pool_index.merge();
+    }
+    create_file(index);
   } else {
     files.front().make_writable(*this);
   }
@@ -194,48 +407,163 @@ void Pool::prepare_write(unsigned size) {
   first_newfile = false;
 }
 
-void Pool::insert(Chunk const& chunk) {
+bool Pool::has_room(const File& file, unsigned size) const {
+  return file.size + size <= props.limit &&
+    file.index.entry_count() < FileIndex::max_entries;
+}
+
+bool Pool::insert(Chunk const& chunk) {
   if (!writable)
     throw std::logic_error("Attempt to insert into class opened as read-only");
 
-  prepare_write(chunk.write_size());
+  if (dedup && contains(chunk.oid()))
+    return false;
+
+  // A chunk whose codec was left alone is compressed with the pool's
+  // dictionary for its kind, if there is one.  The caller's chunk is
+  // const, so this works on a copy.
+  const auto plain = dynamic_cast<const PlainChunk*>(&chunk);
+  if (plain && !plain->codec_chosen() && dictionaries->for_kind(chunk.kind())) {
+    PlainChunk with(chunk.kind(), chunk.oid(),
+		    Chunk::data_type(chunk.data(), chunk.data() + chunk.size()));
+    use_dictionary(with);
+    return write_chunk(with);
+  }
+  return write_chunk(chunk);
+}
+
+bool Pool::write_chunk(Chunk const& chunk) {
+  uint32_t dict_id;
+  if (chunk.zdictionary(dict_id) && !dictionaries->by_id(dict_id))
+    throw std::runtime_error("Chunk is compressed with a dictionary the "
+			     "pool doesn't store");
+
+  // Plan where the chunk goes from its upper bound, which doesn't need
+  // it compressed.  Only when that wouldn't fit in the current file is
+  // the exact size worth finding first, since it may still fit.
+  unsigned needed = chunk.write_size_bound();
+  if (!files.empty() && files.front().size + needed > props.limit)
+    needed = chunk.write_size();
+  prepare_write(needed);
 
   auto& file = files.front();
+  const unsigned size = chunk.write_size();
+  if (size < direct_size) {
+    const size_t base = staging.size();
+    chunk.append_to(staging);
+    if (staging.size() - base != size)
+      throw std::runtime_error("Chunk size mismatch on write");
+    if (staging.size() >= staging_limit)
+      write_staging();
+  } else {
+    const size_t base = staging.size();
+    const auto payload = chunk.append_header(staging);
+    const unsigned pad = size - (staging.size() - base) - payload.second;
+    static const char zeros[16] = { 0 };
+    if (pad >= sizeof(zeros))
+      throw std::runtime_error("Chunk size mismatch on write");
+
+    struct iovec iov[3];
+    iov[0].iov_base = staging.data();
+    iov[0].iov_len = staging.size();
+    iov[1].iov_base = const_cast<char*>(payload.first);
+    iov[1].iov_len = payload.second;
+    iov[2].iov_base = const_cast<char*>(zeros);
+    iov[2].iov_len = pad;
+    write_fully(file.write_fd, iov, 3);
+    staging.clear();
+  }
 
-  // It seems that fstream doesn't properly handle tellp() if the
-  // position isn't sought first.  It would be more efficient to not
-  // do this, and perhaps that could be done without the check below.
-  // The danger is losing track.
-  file.file.seekp(0, std::ios::end);
-  // std::cout << std::hex;
-  // std::cout << "--------------\n";
-  // std::cout << "Pre : " << file.size << std::endl;
-  // std::cout << "PPos: " << file.file.tellp() << std::endl;
-  chunk.write(file.file);
   file.index.insert(FileIndex::value_type(chunk.oid(),
 					  FileIndex::Node(file.size, chunk.kind())));
-  file.size += chunk.write_size();
-  // std::cout << "Wsiz: " << chunk->write_size() << std::endl;
-  // std::cout << "Size: " << file.size << std::endl;
-  // std::cout << " Pos: " << file.file.tellp() << std::endl;
-  // std::cout << std::dec;
-  if (file.size != file.file.tellp()) {
-    throw std::runtime_error("File position mismatch on write");
-  }
+  file.size += size;
+  unsynced_bytes += size;
+  unjournaled_bytes += size;
+
+  if (durability.mode == Durability::Group && sync_due())
+    flush_index(false, true);
+  else if (checkpoint_bytes > 0 && unjournaled_bytes >= checkpoint_bytes)
+    flush_index(false);
+  return true;
+}
+
+void Pool::write_staging() {
+  if (staging.empty())
+    return;
+
+  struct iovec iov;
+  iov.iov_base = staging.data();
+  iov.iov_len = staging.size();
+  write_fully(files.front().write_fd, &iov, 1);
+  staging.clear();
 }
 
 void Pool::flush() {
+  flush_index(false);
+}
+
+void Pool::flush_index(bool seal, bool force_sync) {
   if (dirty) {
     auto& file = files.front();
-    file.unmake_writable(*this);
-    const auto name = construct_name(file.pos, ".idx");
-    files.front().index.save(name, file.size);
-    files.front().index.load(name, file.size);
+    write_staging();
+
+    bool sync = force_sync;
+    switch (durability.mode) {
+      case Durability::None:
+	break;
+      case Durability::Flush:
+	sync = true;
+	break;
+      case Durability::Group:
+	sync = sync || seal || sync_due();
+	break;
+    }
 
+    // The data has to be durable before the index entries referring
+    // to it are.
+    if (sync) {
+      sync_data(file.write_fd);
+      if (file.new_entry) {
+	sync_parent(construct_name(file.pos, ".data"));
+	file.new_entry = false;
+      }
+    }
+    file.unmake_writable();
+
+    file.index.set_sync(sync);
+    if (seal || file.index.journal_full())
+      seal_index(file);
+    else
+      file.index.append_journal(construct_name(file.pos, ".jnl"), file.size);
+    file.index.set_sync(false);
+
+    if (sync) {
+      unsynced_bytes = 0;
+      last_sync = std::chrono::steady_clock::now();
+    }
+    unjournaled_bytes = 0;
     dirty = false;
   }
 }
 
+bool Pool::sync_due() const {
+  return unsynced_bytes >= durability.bytes ||
+    std::chrono::steady_clock::now() - last_sync >= durability.interval;
+}
+
+void Pool::seal_index(File& file) {
+  if (!file.index.has_unsaved())
+    return;
+
+  const auto name = construct_name(file.pos, ".idx");
+  file.index.save(name, file.size);
+  file.index.load(name, file.size);
+
+  // The index now covers the whole file, so the journal would be
+  // ignored anyway.
+  bf::remove(construct_name(file.pos, ".jnl"));
+}
+
 namespace {
 // Attempt to decode the given filename to determine if it is a pool
 // data file.  These files are of the form "pool-data-nnnn.data",
@@ -243,12 +571,23 @@ namespace {
 // does not represent a numbered file, or a non-negative integer if it
 // does.
 int decode_name(const std::string name) {
-  static const re::regex pattern (R"(pool-data-(\d{4})\.data)");
-  re::smatch result;
-  if (re::regex_match(name, result, pattern)) {
-    return std::stoi(result.str(1));
+  static const std::string prefix = "pool-data-";
+  static const std::string suffix = ".data";
+  static const unsigned digits = 4;
+
+  if (name.size() != prefix.size() + digits + suffix.size() ||
+      name.compare(0, prefix.size(), prefix) != 0 ||
+      name.compare(prefix.size() + digits, suffix.size(), suffix) != 0)
+    return -1;
+
+  int result = 0;
+  for (unsigned i = 0; i < digits; ++i) {
+    const char ch = name[prefix.size() + i];
+    if (ch < '0' || ch > '9')
+      return -1;
+    result = result * 10 + (ch - '0');
   }
-  return -1;
+  return result;
 }
 
 // Get the set of all files in the given directory, returning the
@@ -271,47 +610,329 @@ std::vector<unsigned> find_pool_files(const bf::path base) {
 }
 }
 
+void Pool::open_pool() {
+  if (!read_manifest()) {
+    scan_files();
+    if (writable)
+      write_manifest();
+  }
+}
+
 void Pool::scan_files() {
-  // Open each of the files.
-  for (auto elt : find_pool_files(base)) {
-    files.emplace_front(*this, elt);
+  for (auto elt : find_pool_files(base))
+    add_file(elt, bf::file_size(construct_name(elt, ".data")));
+}
+
+std::string Pool::manifest_path() const {
+  auto work = base;
+  work /= "metadata";
+  work /= "manifest.txt";
+  return work.string();
+}
+
+bool Pool::read_manifest() {
+  std::ifstream inp(manifest_path());
+  if (!inp.is_open())
+    return false;
+
+  std::vector<std::pair<unsigned, uint64_t>> listed;
+  std::string line;
+  while (std::getline(inp, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    unsigned pos;
+    uint64_t size;
+    if (!(fields >> pos >> size))
+      return false;
+    if (!listed.empty() && pos <= listed.back().first)
+      return false;
+    listed.emplace_back(pos, size);
+  }
+
+  for (const auto& elt : listed)
+    add_file(elt.first, elt.second);
+
+  // The last file may have grown since the manifest was written, and
+  // files may have been added after it, if the writer didn't get to
+  // update it.
+  if (!files.empty()) {
+    auto& last = files.front();
+    bf::path name(construct_name(last.pos, ".data"));
+    if (!bf::exists(name))
+      throw pool_open_error("Pool file in manifest is missing");
+    last.size = bf::file_size(name);
+  }
+  unsigned next = files.empty() ? 0 : files.front().pos + 1;
+  while (bf::exists(construct_name(next, ".data"))) {
+    add_file(next, bf::file_size(construct_name(next, ".data")));
+    ++next;
   }
 
-  // std::copy(known.begin(), known.end(),
-  //           std::ostream_iterator<unsigned>(std::cout, ", "));
-  // std::cout << std::endl;
+  return true;
 }
 
-void Pool::recover_files() {
-  // TODO: Move recovery into File struct instead of expanding all of
-  // this here.
-
-  // Open each file, and recover the index if necessary.
-  for (auto elt : find_pool_files(base)) {
-    std::fstream file(construct_name(elt, ".data"), std::ios::in | std::ios::binary);
-    file.seekg(0, std::ios::end);
-    unsigned size = file.tellg();
-    FileIndex index;
-    try {
-      index.load(construct_name(elt, ".idx"), size);
-    } catch (index_error) {
-      std::cerr << "Recovering index " << construct_name(elt, ".idx") << std::endl;
-
-      unsigned pos = 0;
-      while (pos < size) {
-	Chunk::HeaderInfo hinfo;
-	file.seekg(pos);
-	if (!Chunk::read_header(file, hinfo))
-	  throw pool_open_error("Unable to read from pool file");
+void Pool::write_manifest() {
+  const auto name = manifest_path();
+  const auto tmp = name + ".tmp";
+  {
+    std::ofstream out(tmp);
+    out << "# Ldump pool manifest: file number and size\n";
+
+    std::vector<const File*> ordered;
+    for (const auto& f : files)
+      ordered.push_back(&f);
+    for (auto it = ordered.rbegin(); it != ordered.rend(); ++it)
+      out << (*it)->pos << ' ' << (*it)->size << '\n';
+
+    out.close();
+    if (out.fail())
+      throw pool_open_error("Unable to write pool manifest");
+  }
+
+  if (durability.mode != Durability::None)
+    sync_file(tmp);
+  bf::rename(tmp, name);
+  if (durability.mode != Durability::None)
+    sync_parent(name);
+}
+
+std::string Pool::dictionary_path() const {
+  auto work = base;
+  work /= "metadata";
+  work /= "dictionaries";
+  return work.string();
+}
+
+std::vector<Dictionary::Ptr> Pool::read_dictionaries() const {
+  std::ifstream inp(dictionary_path(), std::ios::binary);
+  if (!inp.is_open())
+    return std::vector<Dictionary::Ptr>();
+  try {
+    return Dictionary::read(inp);
+  } catch (std::runtime_error& e) {
+    throw pool_open_error(e.what());
+  }
+}
 
-	index.insert(FileIndex::value_type(hinfo.oid,
-					   FileIndex::Node{pos, hinfo.kind}));
-	pos += hinfo.stored_size;
+namespace {
+// Chunks with fewer samples than this don't have enough in common to
+// learn from, and only the start of a large chunk is used.
+const size_t min_dictionary_samples = 8;
+const size_t max_sample_size = 64 << 10;
+}
+
+std::vector<Dictionary::Ptr>
+Pool::train_dictionaries(const std::vector<Kind>& kinds, size_t size,
+			 unsigned samples)
+{
+  if (!writable)
+    throw std::logic_error("Attempt to train dictionaries in a read-only pool");
+  if (samples == 0)
+    throw std::invalid_argument("Dictionaries need at least one sample");
+
+  // Anything staged has to be in the file to be read back.
+  flush();
+
+  std::map<Kind, std::vector<Location>> found;
+  for (const auto kind : kinds)
+    found[kind];
+  for (auto& f : files) {
+    load_index(f);
+    std::vector<FileIndex::value_type> entries;
+    f.index.saved_entries(entries);
+    f.index.unsaved_entries(entries);
+    for (const auto& elt : entries) {
+      const auto it = found.find(elt.second.kind);
+      if (it != found.end())
+	it->second.push_back(Location { f.pos, elt.second.kind,
+					elt.second.offset });
+    }
+  }
+
+  std::vector<Dictionary::Ptr> trained;
+  for (const auto kind : kinds) {
+    const auto& locs = found[kind];
+    if (locs.size() < min_dictionary_samples)
+      continue;
+
+    // Spread the sample over all of them, rather than only taking the
+    // newest or the oldest.
+    const size_t step = std::max<size_t>(locs.size() / samples, 1);
+    std::vector<std::string> sample;
+    for (size_t i = 0; i < locs.size() && sample.size() < samples; i += step) {
+      const auto chunk = read_chunk(locs[i]);
+      sample.emplace_back(chunk->data(),
+			  std::min<size_t>(chunk->size(), max_sample_size));
+    }
+
+    auto data = Dictionary::train(sample, size);
+    if (!data.empty())
+      trained.push_back(std::make_shared<Dictionary>(kind, std::move(data)));
+  }
+  if (trained.empty())
+    return trained;
+
+  auto all = read_dictionaries();
+  all.insert(all.end(), trained.begin(), trained.end());
+  const auto name = dictionary_path();
+  const auto tmp = name + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    Dictionary::write(out, all);
+    out.close();
+    if (out.fail())
+      throw pool_open_error("Unable to write compression dictionaries");
+  }
+  if (durability.mode != Durability::None)
+    sync_file(tmp);
+  bf::rename(tmp, name);
+  if (durability.mode != Durability::None)
+    sync_parent(name);
+
+  dictionaries = std::make_shared<DictionarySet>(all);
+  return trained;
+}
+
+bool Pool::use_dictionary(PlainChunk& chunk) const {
+  auto dict = dictionaries->for_kind(chunk.kind());
+  if (!dict)
+    return false;
+  chunk.set_codec(Codec::by_id(Codec::zlib_id));
+  chunk.set_dictionary(std::move(dict));
+  return true;
+}
+
+namespace {
+// Read up to `len` bytes at `offset`, continuing after short reads,
+// and returning how many were read, which is only less than `len` at
+// the end of the file.
+size_t read_upto(int fd, char* buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    const ssize_t got = ::pread(fd, buf + done, len - done, offset + done);
+    if (got < 0) {
+      if (errno == EINTR)
+	continue;
+      throw pool_open_error("Unable to read from pool file");
+    }
+    if (got == 0)
+      break;
+    done += got;
+  }
+  return done;
+}
+}
+
+void Pool::recover_file(unsigned pos, uint64_t size) {
+  // Whatever the index and its journal still cover doesn't need to be
+  // scanned again.
+  FileIndex index;
+  const uint64_t start = index.load_prefix(construct_name(pos, ".idx"),
+					   construct_name(pos, ".jnl"), size);
+  std::vector<FileIndex::value_type> entries;
+  index.saved_entries(entries);
+  index.unsaved_entries(entries);
+
+  const auto name = construct_name(pos, ".data");
+  const int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw pool_open_error("Unable to open pool file");
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Walk the headers out of large reads, only reading again when the
+  // next header isn't in the buffer.  Chunks bigger than the buffer
+  // are skipped over without being read.
+  std::vector<char> buffer(recovery_buffer);
+  uint64_t buf_start = 0;
+  size_t buf_len = 0;
+  uint64_t offset = start;
+  try {
+    while (offset < size) {
+      if (offset < buf_start || offset + Chunk::header_size > buf_start + buf_len) {
+	buf_start = offset;
+	buf_len = read_upto(fd, buffer.data(),
+			    std::min<size_t>(buffer.size(), size - offset),
+			    offset);
+	if (buf_len < Chunk::header_size)
+	  throw pool_open_error("Unable to read from pool file");
       }
 
-      index.save(construct_name(elt, ".idx"), size);
+      Chunk::HeaderInfo hinfo;
+      if (!Chunk::parse_header(buffer.data() + (offset - buf_start), hinfo))
+	throw pool_open_error("Unable to read from pool file");
+
+      entries.emplace_back(hinfo.oid, FileIndex::Node{offset, hinfo.kind});
+      offset += hinfo.stored_size;
     }
+  } catch (...) {
+    ::close(fd);
+    throw;
   }
+  ::close(fd);
+
+  index.set_sync(durability.mode != Durability::None);
+  index.save_entries(construct_name(pos, ".idx"), size, std::move(entries));
+  bf::remove(construct_name(pos, ".jnl"));
+}
+
+void Pool::recover_files() {
+  const auto known = find_pool_files(base);
+  std::vector<uint64_t> sizes;
+  for (auto elt : known)
+    sizes.push_back(bf::file_size(construct_name(elt, ".data")));
+
+  // Check and recover the files on several threads at once.  Recovery
+  // is mostly waiting on the disk, so use more threads than there are
+  // cores, to keep several reads outstanding.
+  std::atomic<size_t> next { 0 };
+  std::mutex report_lock;
+  std::vector<std::exception_ptr> errors(known.size());
+  auto work = [&]() {
+    for (;;) {
+      const size_t i = next++;
+      if (i >= known.size())
+	return;
+      try {
+	FileIndex index;
+	try {
+	  index.load(construct_name(known[i], ".idx"),
+		     construct_name(known[i], ".jnl"), sizes[i]);
+	  continue;
+	} catch (index_error) {
+	}
+
+	{
+	  std::lock_guard<std::mutex> guard(report_lock);
+	  std::cerr << "Recovering index " << construct_name(known[i], ".idx")
+		    << std::endl;
+	}
+	recover_file(known[i], sizes[i]);
+      } catch (...) {
+	errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  const unsigned count = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(),
+	       unsigned(min_recovery_threads)),
+      known.size());
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < count; ++t)
+    threads.emplace_back(work);
+  work();
+  for (auto& t : threads)
+    t.join();
+
+  for (const auto& error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  for (size_t i = 0; i < known.size(); ++i)
+    add_file(known[i], sizes[i]);
+  write_manifest();
 }
 
 /**
@@ -331,40 +952,24 @@ std::string Pool::construct_name(unsigned pos, const std::string extension) cons
   return work.string();
 }
 
-namespace {
-std::ios::openmode determine_mode(bool create) {
-  std::ios::openmode result = std::ios::binary | std::ios::in;
-  if (create)
-    result |= std::ios::out | std::ios::app;
-  return result;
-}
-}
-
-Pool::File::File(const Pool& parent, unsigned pos, bool create)
-  : pos(pos),
-    file(parent.construct_name(pos, ".data"),
-	 determine_mode(create))
-{
-  // std::cout << "file: " << parent.construct_name(pos, ".data") << std::endl;
-  // std::cout << "mode: " << determine_mode(create) << std::endl;
-  if (!file.is_open())
-    throw pool_open_error("Unable to open pool file");
-  file.seekg(0, std::ios::end);
-  size = file.tellg();
-  if (!create)
-    index.load(parent.construct_name(pos, ".idx"), size);
+Pool::File::~File() {
+  unmake_writable();
 }
 
 void Pool::File::make_writable(const Pool& parent) {
-  file.close();
-  file.open(parent.construct_name(pos, ".data"),
-	    determine_mode(true));
+  if (write_fd >= 0)
+    return;
+  write_fd = ::open(parent.construct_name(pos, ".data").c_str(),
+		    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (write_fd < 0)
+    throw pool_open_error("Unable to open pool file for writing");
 }
 
-void Pool::File::unmake_writable(const Pool& parent) {
-  file.close();
-  file.open(parent.construct_name(pos, ".data"),
-	    determine_mode(false));
+void Pool::File::unmake_writable() {
+  if (write_fd >= 0) {
+    ::close(write_fd);
+    write_fd = -1;
+  }
 }
 
 } // namespace cdump
@@ -3,17 +3,26 @@
 #ifndef __POOL_HH__
 #define __POOL_HH__
 
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <forward_list>
+#include <utility>
 
 #include <boost/filesystem.hpp>
 #include <boost/uuid/uuid.hpp>
 
 #include "lockfile.hh"
 #include "index.hh"
+#include "poolindex.hh"
 #include "chunk.hh"
+#include "chunkcache.hh"
+#include "dictionary.hh"
+#include "fdcache.hh"
 #include "oid.hh"
 
 namespace cdump {
@@ -26,6 +35,42 @@ namespace cdump {
  * pool (such as files, or remotely accessed).
  */
 class Pool {
+ public:
+  /**
+   * How hard the pool works to make sure what has been written
+   * survives a crash.
+   *
+   * - `None` leaves it to the OS to write things out eventually.
+   * - `Flush` syncs on every `flush`.  Once `flush` returns,
+   *   everything inserted before it is durable.
+   * - `Group` commits groups of flushes: a flush is only synced once
+   *   `interval` has passed, or `bytes` have been written, since the
+   *   last sync.  A commit is also made when enough has been
+   *   inserted, flushes or not.  This bounds how much can be lost,
+   *   while the cost of each sync is shared by many writes.
+   *
+   * Closing the pool, and moving on to a new file, always sync,
+   * unless the policy is `None`.
+   *
+   * A synced flush writes and syncs the data, then writes and syncs
+   * the index or journal, and then the directory, so the index it
+   * leaves never refers to data that was lost.  A flush that isn't
+   * synced (every flush under `None`, and under `Group`, those made
+   * before the next commit is due) appends to the journal without
+   * syncing the data first.  After a crash, the journal may then
+   * reach past the end of the data that made it to disk.  That
+   * file's index fails to load, with an `index_error`, and has to be
+   * rebuilt from the chunks by `recover_index`, which keeps
+   * everything that survived.
+   */
+  struct Durability {
+    enum Mode { None, Flush, Group };
+    Mode mode = None;
+    std::chrono::milliseconds interval { 100 };
+    size_t bytes = 64 << 20;
+  };
+
+ private:
   const boost::filesystem::path base;
   const bool writable;
 
@@ -37,7 +82,7 @@ class Pool {
   struct Props {
     boost::uuids::uuid uuid;
     bool newfile;
-    unsigned limit;
+    uint64_t limit;
   };
   Props props;
   void read_props(const std::string path);
@@ -49,15 +94,32 @@ class Pool {
   // Within each pool, we have zero or more files.  At most, the last
   // file can be open for writing.  Generally, the intermediate ones
   // will be opened only for reading.
+  //
+  // Nothing is opened until it is needed.  Reads get a descriptor from
+  // `open_files`, and use positional reads, so that readers don't
+  // share any state.  `write_fd` is only open while the file is being
+  // written to, and is in append mode.  The index is loaded on first
+  // use, by `load_index`.
   struct File {
     unsigned     pos;
-    std::fstream file;
+    uint64_t     size;
     FileIndex    index;
-    unsigned     size;
+    bool         index_loaded = false;
+    int          write_fd = -1;
+
+    // Set when the file is created, until its directory entry has
+    // been synced.
+    bool         new_entry = false;
 
-    File(const Pool& parent, unsigned pos, bool create = false);
+    // A mapping of the whole file, made on first use, once nothing
+    // will be written to the file.  Only accessed with
+    // std::atomic_load and std::atomic_store, by `mapping_of`.
+    std::shared_ptr<const MappedFile> mapping;
+
+    File(unsigned pos, uint64_t size) :pos(pos), size(size) {}
+    ~File();
     void make_writable(const Pool& parent);
-    void unmake_writable(const Pool& parent);
+    void unmake_writable();
   };
 
   // All of the pool files, in reverse order (pushed at the front).
@@ -65,22 +127,133 @@ class Pool {
   // inside.
   std::forward_list<File> files;
 
+  // The files, indexed by their number.  Numbers that aren't present
+  // are null.
+  std::vector<File*> file_table;
+  void add_file(unsigned pos, uint64_t size);
+  void create_file(unsigned pos);
+  void load_index(File& file);
+
+  FdCache open_files;
+
+  // The manifest lists the files of the pool, and their sizes, so
+  // opening the pool doesn't need to look at the files themselves.
+  // Only the size of the last file, which may still be growing, is
+  // checked.
+  std::string manifest_path() const;
+  bool read_manifest();
+  void write_manifest();
+
+  // Compression dictionaries trained for the pool's chunks.  Every
+  // dictionary ever trained is kept, since chunks may use it.  Chunks
+  // read from the pool are decompressed with these, and `insert`
+  // refuses chunks that need a dictionary not among them.
+  std::string dictionary_path() const;
+  std::vector<Dictionary::Ptr> read_dictionaries() const;
+  DictionarySet::Ptr dictionaries;
+
+  // The merged index of every file.  Its runs are kept in the metadata
+  // directory, and are opened on the first lookup, along with the
+  // indexes of the files newer than them, so opening a pool just to
+  // look at its backups doesn't pay for it.  Files are added as they
+  // are created, and merged into the runs once they are finished.
+  PoolIndex pool_index;
+  std::atomic<bool> pool_index_built { false };
+  std::mutex pool_index_lock;
+  void build_pool_index();
+
+  // Make sure the pool index has been built.  Readers in several
+  // threads may race to be the first.
+  void need_pool_index();
+
+  // Read the chunk at the given location.
+  Chunk::ChunkPtr read_chunk(const PoolIndex::Location& loc);
+
+  // Files that won't be written to again are read through a mapping,
+  // so that chunks stored uncompressed aren't copied.
+  bool mapped_reads = true;
+  std::mutex mapping_lock;
+  std::shared_ptr<const MappedFile> mapping_of(File& file);
+
+  // Optional cache in front of the reads.
+  std::shared_ptr<ChunkCache> chunk_cache;
+
+  // Read the chunk at `loc`, going through the cache, if there is
+  // one.
+  Chunk::SharedPtr fetch(const OID& key, const PoolIndex::Location& loc);
+
+  // Find the pool files from the manifest, falling back to scanning
+  // the directory (and writing a manifest) if there isn't one.
+  void open_pool();
   void scan_files();
   void recover_files();
 
-  // Indicates we've started writing.  When true, files.front().file
-  // will be opened for writing, and write_pos will be set to the
+  // Rebuild the index of one file by reading the chunk headers.
+  void recover_file(unsigned pos, uint64_t size);
+  static const size_t recovery_buffer = 8 << 20;
+  static const unsigned min_recovery_threads = 4;
+
+  // Indicates we've started writing.  When true, files.front().write_fd
+  // will be open, and files.front().size is the
   // position to write into that file.
   bool dirty = false;
-  unsigned write_pos = 0;
+
+  // Inserted chunks are gathered here, and written to the end of the
+  // current file in one go, once enough have accumulated, or before
+  // anything needs to see them in the file.  files.front().size
+  // includes them.
+  //
+  // Chunks of at least `direct_size` are written immediately, along
+  // with anything staged, with a gathered write from the chunk's own
+  // buffer, since copying them costs more than the write saves.
+  Chunk::data_type staging;
+  static const size_t staging_limit = 1 << 20;
+  static const size_t direct_size = 16 << 10;
+  void write_staging();
+
+  // Readers write out what is staged before reading a chunk that may
+  // be in it, and several may do so at once.
+  std::mutex staging_lock;
+
+  // When set, `insert` skips chunks that are already present.
+  bool dedup = false;
+
+  // Write out the index of the file being written.  Normally, the new
+  // entries are appended to the file's index journal, but when the
+  // file is being sealed (nothing more will be written to it), or the
+  // journal has grown large, the whole index is saved instead.
+  //
+  // The flush is synced when `force_sync` is set, or the durability
+  // policy calls for it.
+  void flush_index(bool seal, bool force_sync = false);
+  void seal_index(File& file);
+
+  // Whether a chunk of `size` bytes can go in `file`.  Besides the
+  // size limit, the file's index can only hold so many entries, which
+  // a file of small chunks can reach.
+  bool has_room(const File& file, unsigned size) const;
 
   // Prepare to write `needed` bytes of data.  When finished, 'dirty'
-  // will be tru, and files.front().file will be opened for write, and
-  // write_pos set to the position in that file to write at.
+  // will be tru, and files.front().write_fd will be open.
   void prepare_write(unsigned needed);
 
+  // The rest of `insert`, once the chunk is as it will be written.
+  bool write_chunk(Chunk const& chunk);
+
   std::string construct_name(unsigned pos, const std::string extension) const;
 
+  Durability durability;
+
+  // What has been written since the index was last journaled.
+  size_t checkpoint_bytes = default_checkpoint_bytes;
+  size_t unjournaled_bytes = 0;
+
+  // What has been written since the last sync, for group commit.
+  size_t unsynced_bytes = 0;
+  std::chrono::steady_clock::time_point last_sync =
+    std::chrono::steady_clock::now();
+  bool sync_due() const;
+
   // Private constructor.
   Pool(const std::string path, bool writable, bool recover);
 
@@ -96,14 +269,40 @@ class Pool {
     : Pool(path, writable, false) {}
 
   ~Pool() {
-    flush();
+    flush_index(false, durability.mode != Durability::None);
   }
 
+  /// Set the durability policy, described with `Durability` above.
+  void set_durability(const Durability& value) { durability = value; }
+
+  /**
+   * Whether chunks in files that are no longer being written are read
+   * through a memory mapping of the file, rather than with a read.
+   * Uncompressed chunks read this way refer to their data in the
+   * mapping, avoiding a copy, which helps most with large blobs.  On
+   * by default.
+   */
+  void set_mapped_reads(bool value) { mapped_reads = value; }
+
+  /**
+   * While a file is being written, its index is checkpointed to the
+   * journal after every `bytes` of data, even without a flush.  After
+   * a crash, recovery then only has to scan what was written after
+   * the last checkpoint.  Zero turns this off.
+   */
+  static const size_t default_checkpoint_bytes = 64 << 20;
+  void set_checkpoint_interval(size_t bytes) { checkpoint_bytes = bytes; }
+
   /// The default limit on the size of a file for the pool.  640 MB
   /// fits on a CD, with 7 fitting on a DVD.
   static const unsigned default_limit = 640 * 1024 * 1024;
   static const unsigned limit_lower_bound = 1 << 20;
-  static const unsigned limit_upper_bound = (1 << 30) - 1;
+
+  /// Offsets within a file are 64 bits, so files can be much larger,
+  /// which keeps the number of files down in a large pool.  Files of
+  /// 4 GiB and over need version 6 indexes.  A file is also sealed
+  /// once its index holds `FileIndex::max_entries` entries.
+  static const uint64_t limit_upper_bound = (uint64_t(1) << 40) - 1;
 
   /**
    * Create a new file pool in an empty directory.
@@ -115,7 +314,7 @@ class Pool {
    * @throws std::runtime_error if the pool cannot be created.
    */
   static void create_pool(const std::string path,
-			  unsigned limit = default_limit,
+			  uint64_t limit = default_limit,
 			  bool newlib = false);
 
   /**
@@ -124,6 +323,16 @@ class Pool {
    */
   static void recover_index(const std::string path);
 
+  /**
+   * Rewrite the index of every file of a pool in the current format,
+   * merging any journals.  Indexes in older formats can still be
+   * read, and are rewritten as files are sealed, so this is only
+   * needed to bring an existing pool up to date in one go.  The pool
+   * index is merged into a single run at the same time.  Must be able
+   * to write to the pool.
+   */
+  static void upgrade_indexes(const std::string path);
+
   bool is_writable() { return writable; }
 
   /**
@@ -135,14 +344,100 @@ class Pool {
   /**
    * Attempt to read a chunk from the pool.  Throws a ___ exception if
    * the chunk couldn't be found.
+   *
+   * `find`, and the other lookups below, can be called from any
+   * number of threads at once, but not while `insert`, `flush`, or
+   * `train_dictionaries` runs in another thread.  Between inserts,
+   * lookups may find chunks that haven't been written to the file
+   * yet; the first such read writes out the staged chunks, under a
+   * lock, so concurrent lookups never see a partly written file.
+   */
+  Chunk::SharedPtr find(const OID& key);
+
+  /// Where a chunk is stored: file number, offset, and kind.
+  using Location = PoolIndex::Location;
+  using Lookup = PoolIndex::Lookup;
+
+  /**
+   * Look up the locations of `count` keys, without reading any data.
+   * The results are in the same order as the keys.  This is much
+   * faster than calling `find` for each key, when all that is needed
+   * is to know which keys are present.
+   */
+  std::vector<Lookup> locate_many(const OID* keys, size_t count);
+
+  /**
+   * Read the chunks for `count` keys.  The results are in the same
+   * order as the keys, with a null pointer for any key that isn't
+   * present.  The reads are done in order of file and offset, rather
+   * than the order of the keys.
    */
-  Chunk::ChunkPtr find(const OID& key);
+  std::vector<Chunk::SharedPtr> find_many(const OID* keys, size_t count);
 
   /**
-   * Insert the given chunk into the storage pool.
+   * Put a cache of decoded chunks in front of `find` and `find_many`.
+   * Since chunks are named by their content, a single cache can be
+   * shared by several pools.  A null pointer removes the cache.
    */
-  void insert(Chunk const& chunk);
+  void set_cache(std::shared_ptr<ChunkCache> cache) {
+    chunk_cache = std::move(cache);
+  }
+  ChunkCache* cache() const { return chunk_cache.get(); }
+
+  /**
+   * Determine if a chunk is present in the pool.  Only the indexes
+   * are consulted, no data is read.
+   */
+  bool contains(const OID& key);
+
+  /**
+   * Insert the given chunk into the storage pool.  Returns true if it
+   * was written, which is always the case unless `set_dedup` is on.
+   * A PlainChunk whose codec hasn't been chosen is compressed with the
+   * pool's dictionary for its kind, as by `use_dictionary`, if there
+   * is one.  Throws std::runtime_error if the chunk is compressed with
+   * a dictionary that the pool doesn't store, since it couldn't be
+   * read back.
+   */
+  bool insert(Chunk const& chunk);
+
+  /**
+   * When `dedup` is set, `insert` first checks whether the chunk is
+   * already present, in any file, or in what has been written but not
+   * flushed, and skips writing it if it is.  This costs an index probe
+   * per insert, but saves writing the same data again.
+   */
+  void set_dedup(bool value) { dedup = value; }
   void flush();
+
+  /**
+   * Train a compression dictionary for each of `kinds`, from up to
+   * `samples` of the pool's chunks of that kind, and store it with
+   * the pool, for `use_dictionary`.  This pays off for small chunks
+   * that share a lot of structure, such as directories.  Kinds with
+   * too few chunks to learn from are skipped.  Returns the
+   * dictionaries trained.  Throws std::invalid_argument if `samples`
+   * is zero.
+   */
+  static const size_t default_dictionary_size = 8 << 10;
+  static const unsigned default_dictionary_samples = 2000;
+  std::vector<Dictionary::Ptr>
+  train_dictionaries(const std::vector<Kind>& kinds,
+		     size_t size = default_dictionary_size,
+		     unsigned samples = default_dictionary_samples);
+
+  /**
+   * If the pool has a dictionary for the chunk's kind, set the chunk
+   * to be compressed with zlib, starting from it, and return true.
+   * This trades lz's decompression speed for a better ratio on small
+   * chunks.  `insert` does it for chunks whose codec was left alone;
+   * calling it first lets the compression happen elsewhere, as
+   * `Ingest` does on its workers.  The chunk can then only be
+   * inserted into pools that store the same dictionary.  The
+   * dictionaries only change in `train_dictionaries`, so this may run
+   * on other threads while chunks are inserted.
+   */
+  bool use_dictionary(PlainChunk& chunk) const;
 };
 
 } // namespace cdump
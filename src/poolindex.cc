@@ -0,0 +1,488 @@
+// Pool-wide index.
+
+#include "poolindex.hh"
+#include "except.hh"
+#include "search.hh"
+#include "sync.hh"
+#include "utility.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace cdump {
+
+namespace {
+
+// A run starts with a header, followed by the number and size of each
+// file it covers, and then the fanout, giving the index one past the
+// end of each bucket of records sharing their leading `fanout_bits`.
+// The records follow, sorted.  Everything up to the records is 8-byte
+// aligned, and they only need 4.
+const int magic_size = 8;
+const char run_magic[] = "ldpoolrn";
+const uint32_t run_version = 1;
+const char run_prefix[] = "pool-index-";
+
+// The fanout is sized for a few records per bucket, so a search is
+// mostly a read of the fanout, and one of the bucket.  That costs about
+// a byte per record.
+const unsigned min_fanout_bits = 8;
+const unsigned max_fanout_bits = 24;
+const unsigned bucket_bits = 3;
+
+struct RunHeader {
+  char magic[magic_size];
+  uint32_t version;
+  uint32_t file_count;
+  uint64_t count;
+  uint32_t fanout_bits;
+  uint32_t reserved;
+};
+
+struct RunFile {
+  uint32_t pos;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+static_assert(sizeof(PoolIndex::Record) == 36,
+	      "Pool index records must not be padded");
+
+// Records are written out this many at a time.
+const size_t write_batch = 4096;
+
+// How many keys ahead of the current search to prefetch.  Enough to
+// cover a cache miss, but few enough that the lines are still cached
+// when their search comes around.
+const size_t prefetch_distance = 8;
+
+// Check if `run` covers the files starting at `next`.
+bool covers_from(const PoolIndex::FileSizes& run,
+		 const PoolIndex::FileSizes& files, size_t next)
+{
+  return run.size() <= files.size() - next &&
+    std::equal(run.begin(), run.end(), files.begin() + next);
+}
+
+// Drop the keys that have been found from `pending`.
+void drop_found(std::vector<uint32_t>& pending,
+		const std::vector<PoolIndex::Lookup>& results)
+{
+  size_t out = 0;
+  for (const auto i : pending) {
+    if (!results[i].found)
+      pending[out++] = i;
+  }
+  pending.resize(out);
+}
+
+} // namespace
+
+const unsigned PoolIndex::merge_files;
+const unsigned PoolIndex::merge_ratio;
+
+PoolIndex::Record::Record(const OID& oid, const Location& loc)
+  :oid(oid), file(htole32(loc.file)), kind(loc.kind),
+   offset_low(htole32(uint32_t(loc.offset))),
+   offset_high(htole32(uint32_t(loc.offset >> 32)))
+{
+}
+
+PoolIndex::Location PoolIndex::Record::location() const {
+  return Location { le32toh(file), kind,
+      le32toh(offset_low) | uint64_t(le32toh(offset_high)) << 32 };
+}
+
+//////////////////////////////////////////////////////////////////////
+// Runs
+
+PoolIndex::Run::Run(const std::string& path) :path(path) {
+  try {
+    map.reset(new MappedFile(path));
+  } catch (std::runtime_error&) {
+    throw index_error("Unable to map pool index run");
+  }
+  const char* data = map->data();
+  const size_t size = map->size();
+
+  RunHeader head;
+  if (size < sizeof(head))
+    throw index_error("Pool index run is truncated");
+  memcpy(&head, data, sizeof(head));
+  if (memcmp(head.magic, run_magic, magic_size) != 0 ||
+      le32toh(head.version) != run_version)
+    throw index_error("Pool index run has wrong magic or version");
+  size_t pos = sizeof(head);
+
+  const uint32_t file_count = le32toh(head.file_count);
+  if (file_count == 0 || (size - pos) / sizeof(RunFile) < file_count)
+    throw index_error("Pool index run is truncated");
+  for (uint32_t i = 0; i < file_count; ++i, pos += sizeof(RunFile)) {
+    RunFile file;
+    memcpy(&file, data + pos, sizeof(file));
+    covered.emplace_back(le32toh(file.pos), le64toh(file.size));
+  }
+
+  bits = le32toh(head.fanout_bits);
+  if (bits < min_fanout_bits || bits > max_fanout_bits)
+    throw index_error("Pool index run has a bad fanout");
+  const size_t fanout = size_t(1) << bits;
+  if ((size - pos) / sizeof(uint64_t) < fanout)
+    throw index_error("Pool index run is truncated");
+  tops = reinterpret_cast<const uint64_t*>(data + pos);
+  pos += fanout * sizeof(uint64_t);
+
+  count = le64toh(head.count);
+  if ((size - pos) % sizeof(Record) != 0 ||
+      (size - pos) / sizeof(Record) != count)
+    throw index_error("Pool index run is the wrong size");
+  records = reinterpret_cast<const Record*>(data + pos);
+
+  // Only the end of the fanout is checked here, so that opening the
+  // run doesn't read all of it.  Searches check the buckets they use.
+  if (le64toh(tops[fanout - 1]) != count)
+    throw index_error("Pool index run has a damaged fanout");
+}
+
+void PoolIndex::Run::bucket(uint64_t word, size_t& low, size_t& high) const {
+  const size_t top = word >> (64 - bits);
+  low = top > 0 ? le64toh(tops[top - 1]) : 0;
+  high = le64toh(tops[top]);
+  if (low > high || high > count)
+    throw index_error("Pool index run has a damaged fanout");
+}
+
+bool PoolIndex::Run::find(const OID& key, size_t& pos) const {
+  // The records within the bucket all share the leading bits, which
+  // bounds their leading words for the interpolation.
+  const uint64_t word = key.peek_word(0);
+  size_t low, high;
+  bucket(word, low, high);
+  const uint64_t within = (uint64_t(1) << (64 - bits)) - 1;
+  const uint64_t low_word = word & ~within;
+  return interpolation_search_oid(records, low, high, low_word,
+				  low_word | within, key, pos);
+}
+
+const PoolIndex::Record* PoolIndex::Run::guess(const OID& key) const {
+  const uint64_t word = key.peek_word(0);
+  size_t low, high;
+  bucket(word, low, high);
+  const uint64_t within = (uint64_t(1) << (64 - bits)) - 1;
+  return records + low +
+    size_t(double(word & within) / (double(within) + 1.0) * (high - low));
+}
+
+//////////////////////////////////////////////////////////////////////
+// Building
+
+void PoolIndex::open(const std::string& path, const FileSizes& sizes,
+		     bool can_write)
+{
+  clear();
+  dir = path;
+  writable = can_write;
+
+  std::vector<std::unique_ptr<Run>> found;
+  std::vector<std::string> unusable;
+  if (bf::is_directory(dir)) {
+    for (auto elt = bf::directory_iterator(dir);
+	 elt != bf::directory_iterator();
+	 ++elt) {
+      const auto name = elt->path().filename().string();
+      if (name.compare(0, strlen(run_prefix), run_prefix) != 0)
+	continue;
+      if (elt->path().extension() == ".tmp") {
+	unusable.push_back(elt->path().string());
+	continue;
+      }
+      try {
+	found.emplace_back(new Run(elt->path().string()));
+      } catch (index_error&) {
+	unusable.push_back(elt->path().string());
+      }
+    }
+  }
+
+  // Take the runs in order from the oldest file.  A run that was
+  // merged from others may still be around with them, after a crash,
+  // and covers the most files.
+  size_t next = 0;
+  while (true) {
+    auto best = found.end();
+    for (auto it = found.begin(); it != found.end(); ++it) {
+      if (*it && covers_from((*it)->files(), sizes, next) &&
+	  (best == found.end() ||
+	   (*it)->files().size() > (*best)->files().size()))
+	best = it;
+    }
+    if (best == found.end())
+      break;
+    next += (*best)->files().size();
+    runs.push_back(std::move(*best));
+  }
+
+  if (writable) {
+    for (const auto& run : found) {
+      if (run)
+	unusable.push_back(run->name());
+    }
+    for (const auto& name : unusable)
+      bf::remove(name);
+  }
+}
+
+bool PoolIndex::covers(uint32_t file) const {
+  // The runs cover the files from the oldest one on.
+  return !runs.empty() && file <= runs.back()->files().back().first;
+}
+
+void PoolIndex::add(uint32_t file, const FileIndex* index) {
+  files.push_back(Member { file, index, false, 0 });
+}
+
+void PoolIndex::finish(uint32_t file, uint64_t size) {
+  for (auto& member : files) {
+    if (member.file == file) {
+      member.finished = true;
+      member.size = size;
+    }
+  }
+}
+
+void PoolIndex::merge(bool everything) {
+  if (!writable)
+    return;
+
+  size_t ready = 0;
+  while (ready < files.size() && files[ready].finished)
+    ++ready;
+  if (everything ? ready + runs.size() < 2 : ready < merge_files)
+    return;
+
+  // Take in the newest runs, as long as they aren't much larger than
+  // what is being merged, which keeps the runs growing geometrically.
+  uint64_t total = 0;
+  for (size_t i = 0; i < ready; ++i)
+    total += files[i].index->entry_count();
+  size_t first = runs.size();
+  while (first > 0 &&
+	 (everything || runs[first - 1]->size() <= total * merge_ratio)) {
+    --first;
+    total += runs[first]->size();
+  }
+
+  FileSizes covered;
+  for (size_t i = first; i < runs.size(); ++i)
+    covered.insert(covered.end(), runs[i]->files().begin(),
+		   runs[i]->files().end());
+  for (size_t i = 0; i < ready; ++i)
+    covered.emplace_back(files[i].file, files[i].size);
+
+  const auto name = run_name(covered.front().first, covered.back().first);
+  write_run(name, covered, first, ready);
+  std::unique_ptr<Run> run(new Run(name));
+
+  // The mappings of the merged runs keep them readable after they are
+  // removed, until they are dropped here.
+  for (size_t i = first; i < runs.size(); ++i) {
+    if (runs[i]->name() != name)
+      bf::remove(runs[i]->name());
+  }
+  runs.erase(runs.begin() + first, runs.end());
+  runs.push_back(std::move(run));
+  files.erase(files.begin(), files.begin() + ready);
+}
+
+std::string PoolIndex::run_name(uint32_t first, uint32_t last) const {
+  std::ostringstream name;
+  name << run_prefix << std::setfill('0') << std::setw(4) << first
+       << '-' << std::setw(4) << last;
+  return (bf::path(dir) / name.str()).string();
+}
+
+// Merge the runs from `first_run` on, and the first `file_count`
+// files, into a new run.
+void PoolIndex::write_run(const std::string& name, const FileSizes& covered,
+			  size_t first_run, size_t file_count)
+{
+  // Gather the entries of the files, newest first, so that sorting
+  // them stably puts the newest of any repeated key first.
+  std::vector<Record> fresh;
+  std::vector<FileIndex::value_type> elts;
+  for (size_t i = file_count; i-- > 0;) {
+    elts.clear();
+    files[i].index->unsaved_entries(elts);
+    files[i].index->saved_entries(elts);
+    for (const auto& elt : elts)
+      fresh.emplace_back(elt.first, Location { files[i].file, elt.second.kind,
+					       elt.second.offset });
+  }
+  std::stable_sort(fresh.begin(), fresh.end(),
+		   [](const Record& a, const Record& b) {
+		     return a.oid < b.oid;
+		   });
+
+  // The sorted inputs, newest first.  Where several have a key, the
+  // first one wins.
+  std::vector<std::pair<const Record*, const Record*>> inputs;
+  inputs.emplace_back(fresh.data(), fresh.data() + fresh.size());
+  for (size_t i = runs.size(); i-- > first_run;)
+    inputs.emplace_back(runs[i]->begin(), runs[i]->end());
+
+  // The fanout is sized for all of the inputs, before any repeated
+  // keys are dropped.
+  uint64_t bound = 0;
+  for (const auto& input : inputs)
+    bound += input.second - input.first;
+  unsigned bits = min_fanout_bits;
+  while (bits < max_fanout_bits &&
+	 (uint64_t(1) << (bits + bucket_bits)) < bound)
+    ++bits;
+
+  const auto tmp = name + ".tmp";
+  std::ofstream out(tmp, std::ios::binary|std::ios::out|std::ios::trunc);
+  out.exceptions(out.badbit|out.failbit);
+
+  // The count and fanout are filled in once the records are written.
+  RunHeader head;
+  memcpy(head.magic, run_magic, magic_size);
+  head.version = htole32(run_version);
+  head.file_count = htole32(covered.size());
+  head.count = 0;
+  head.fanout_bits = htole32(bits);
+  head.reserved = 0;
+  out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+  for (const auto& file : covered) {
+    const RunFile elt { htole32(file.first), 0, htole64(file.second) };
+    out.write(reinterpret_cast<const char*>(&elt), sizeof(elt));
+  }
+  std::vector<uint64_t> tops(size_t(1) << bits, 0);
+  vector_write(out, tops);
+
+  std::vector<Record> batch;
+  batch.reserve(write_batch);
+  uint64_t count = 0;
+  while (true) {
+    size_t best = inputs.size();
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      if (inputs[i].first != inputs[i].second &&
+	  (best == inputs.size() ||
+	   inputs[i].first->oid < inputs[best].first->oid))
+	best = i;
+    }
+    if (best == inputs.size())
+      break;
+
+    const Record rec = *inputs[best].first;
+    for (auto& input : inputs) {
+      while (input.first != input.second && input.first->oid == rec.oid)
+	++input.first;
+    }
+    batch.push_back(rec);
+    ++tops[rec.oid.peek_word(0) >> (64 - bits)];
+    ++count;
+    if (batch.size() == write_batch) {
+      vector_write(out, batch);
+      batch.clear();
+    }
+  }
+  vector_write(out, batch);
+
+  uint64_t total = 0;
+  for (auto& top : tops) {
+    total += top;
+    top = htole64(total);
+  }
+  head.count = htole64(count);
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+  out.seekp(sizeof(head) + covered.size() * sizeof(RunFile));
+  vector_write(out, tops);
+  out.close();
+
+  // As with the file indexes, the contents must be durable before the
+  // rename is.
+  if (sync_writes)
+    sync_file(tmp);
+  if (std::rename(tmp.c_str(), name.c_str()) != 0)
+    throw index_error("Unable to rename tmp file");
+  if (sync_writes)
+    sync_parent(name);
+}
+
+void PoolIndex::clear() {
+  runs.clear();
+  files.clear();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Lookups
+
+bool PoolIndex::find(const OID& key, Location& loc) const {
+  // Most of the files won't have the key, and their filters say so
+  // with a single cache line.
+  FileIndex::value_type res;
+  for (auto it = files.rbegin(); it != files.rend(); ++it) {
+    if (it->index->may_contain(key) && it->index->lookup(key, res)) {
+      loc = Location { it->file, res.second.kind, res.second.offset };
+      return true;
+    }
+  }
+
+  size_t pos;
+  for (auto it = runs.rbegin(); it != runs.rend(); ++it) {
+    if ((*it)->find(key, pos)) {
+      loc = (**it)[pos].location();
+      return true;
+    }
+  }
+  return false;
+}
+
+void PoolIndex::find_many(const OID* keys, size_t count,
+			  std::vector<Lookup>& results) const
+{
+  results.assign(count, Lookup { false, Location() });
+
+  // The keys still to be found, which shrinks as each file and run is
+  // done.
+  std::vector<uint32_t> pending(count);
+  for (size_t i = 0; i < count; ++i)
+    pending[i] = i;
+
+  FileIndex::value_type res;
+  for (auto it = files.rbegin();
+       it != files.rend() && !pending.empty(); ++it) {
+    for (const auto i : pending) {
+      if (it->index->may_contain(keys[i]) && it->index->lookup(keys[i], res))
+	results[i] = Lookup { true, Location { it->file, res.second.kind,
+					       res.second.offset } };
+    }
+    drop_found(pending, results);
+  }
+
+  size_t pos;
+  for (auto it = runs.rbegin(); it != runs.rend() && !pending.empty(); ++it) {
+    const auto& run = **it;
+    for (size_t n = 0; n < pending.size(); ++n) {
+      if (n + prefetch_distance < pending.size())
+	__builtin_prefetch(run.guess(keys[pending[n + prefetch_distance]]));
+      const auto i = pending[n];
+      if (run.find(keys[i], pos))
+	results[i] = Lookup { true, run[pos].location() };
+    }
+    drop_found(pending, results);
+  }
+}
+
+} // namespace cdump
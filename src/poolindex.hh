@@ -0,0 +1,200 @@
+// Pool-wide index.
+
+#ifndef __POOLINDEX_HH__
+#define __POOLINDEX_HH__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "index.hh"
+#include "kind.hh"
+#include "mapping.hh"
+#include "oid.hh"
+
+namespace cdump {
+
+/**
+ * The PoolIndex merges the indexes of the files in a pool into sorted
+ * tables, so that a lookup costs a few searches, regardless of how
+ * many files the pool has.
+ *
+ * The merged tables are kept on disk, as "runs" alongside the pool's
+ * other metadata, and searched in place through a read-only mapping,
+ * the same way the file indexes are.  Each run covers a series of
+ * consecutive files, and its header records their sizes, so that a
+ * run that no longer agrees with the files isn't used.
+ *
+ * Files newer than the runs, including the one being written, are
+ * searched through their own indexes, behind their bloom filters.  Once enough of those files are
+ * finished, `merge` writes them, along with any runs not much larger
+ * than them, out as a new run.  The runs stay few, and sorted from
+ * largest (oldest) to smallest, and each entry is only rewritten a
+ * handful of times as the pool grows.
+ */
+class PoolIndex {
+ public:
+  // 16 bytes: the kind comes before the offset, so there is no
+  // padding between them.
+  struct Location {
+    uint32_t file;    //< The pool file number.
+    Kind kind;
+    uint64_t offset;  //< Offset of the chunk within that file.
+  };
+
+  /**
+   * An entry of a run, as stored.  The offset is split into 32-bit
+   * halves, so the record is 36 bytes, with no padding.  The integers
+   * are little-endian.
+   */
+  struct Record {
+    OID oid;
+    uint32_t file;
+    Kind kind;
+    uint32_t offset_low;
+    uint32_t offset_high;
+
+    Record() {}
+    Record(const OID& oid, const Location& loc);
+    Location location() const;
+  };
+
+  // The number and size of each file of a pool, oldest first.
+  using FileSizes = std::vector<std::pair<uint32_t, uint64_t>>;
+
+  /**
+   * Use the runs saved in `dir` for a pool with the given `files`.
+   * Runs are only used while they cover the files from the oldest one
+   * on, with the sizes given.  Files that aren't covered still have
+   * to be `add`ed.  If `writable`, runs that can't be used are
+   * removed, and `merge` writes new ones to `dir`.
+   */
+  void open(const std::string& dir, const FileSizes& files, bool writable);
+
+  /// Does one of the runs cover this file?
+  bool covers(uint32_t file) const;
+
+  /**
+   * Add a file that isn't covered by the runs, which is newer than any
+   * added so far.  It is searched through its `index`, which must stay
+   * alive, and may still have entries added to it.
+   */
+  void add(uint32_t file, const FileIndex* index);
+
+  /**
+   * Nothing more will be added to the file, which was last `add`ed
+   * with this `size`, so it can be merged into a run.  Files must be
+   * finished in the order they were added.
+   */
+  void finish(uint32_t file, uint64_t size);
+
+  /**
+   * Write the finished files out as a run, if there are enough of
+   * them, or if `everything` is set, in which case all of the runs
+   * are merged together with them.
+   */
+  void merge(bool everything = false);
+
+  /// Whether new runs are synced to stable storage.
+  void set_sync(bool value) { sync_writes = value; }
+
+  /**
+   * Look up a key, filling in `loc` and returning true if it is
+   * present.  Where several files have the key, the newest wins.
+   */
+  bool find(const OID& key, Location& loc) const;
+
+  // The result of looking up one key of a batch.
+  struct Lookup {
+    bool found;
+    Location loc;
+  };
+
+  /**
+   * Look up `count` keys at once, filling in `results` in the same
+   * order as the keys.
+   *
+   * Each run is searched for all of the keys still missing before
+   * moving on to the next, prefetching the likely position of a key a
+   * little ahead, which overlaps its cache miss with the current
+   * search.
+   */
+  void find_many(const OID* keys, size_t count,
+		 std::vector<Lookup>& results) const;
+
+  /// The number of runs.
+  size_t run_count() const { return runs.size(); }
+
+  /// The number of files searched through their own index.
+  size_t file_count() const { return files.size(); }
+
+  void clear();
+
+  // Merge once this many files are finished, and take in the runs no
+  // more than `merge_ratio` times larger than what is being merged.
+  static const unsigned merge_files = 8;
+  static const unsigned merge_ratio = 2;
+
+ private:
+  // A run, searched in place from its mapping.
+  class Run {
+    std::unique_ptr<MappedFile> map;
+    const uint64_t* tops = nullptr;
+    const Record* records = nullptr;
+    uint64_t count = 0;
+    unsigned bits = 0;
+    FileSizes covered;
+    std::string path;
+
+   public:
+    // Map the run, checking that it is laid out correctly.  Throws
+    // index_error if it isn't.
+    explicit Run(const std::string& path);
+
+    const std::string& name() const { return path; }
+    const FileSizes& files() const { return covered; }
+    uint64_t size() const { return count; }
+    const Record* begin() const { return records; }
+    const Record* end() const { return records + count; }
+
+    bool find(const OID& key, size_t& pos) const;
+    const Record& operator[](size_t pos) const { return records[pos]; }
+
+    // Where `key` is likely to be, for prefetching.
+    const Record* guess(const OID& key) const;
+
+   private:
+    // The range of records with the same leading bits as `word`.
+    void bucket(uint64_t word, size_t& low, size_t& high) const;
+  };
+
+  struct Member {
+    uint32_t file;
+    const FileIndex* index;
+    bool finished;
+    uint64_t size;
+  };
+
+  std::string dir;
+  bool writable = false;
+  bool sync_writes = false;
+
+  // Both oldest first.  The files are all newer than the runs.
+  std::vector<std::unique_ptr<Run>> runs;
+  std::vector<Member> files;
+
+  std::string run_name(uint32_t first, uint32_t last) const;
+  void write_run(const std::string& name, const FileSizes& covered,
+		 size_t first_run, size_t file_count);
+};
+
+// For the searches in search.hh.
+inline const OID& oid_of(const PoolIndex::Record& record) {
+  return record.oid;
+}
+
+} // namespace cdump
+
+#endif // __POOLINDEX_HH__
@@ -0,0 +1,50 @@
+// Sample directory chunks.
+
+#ifndef __SAMPLEDIR_HH__
+#define __SAMPLEDIR_HH__
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace cdump {
+
+/**
+ * Something like a small directory chunk: a few entries, each a set of
+ * properties, generated from `index`, so the same index always gives
+ * the same text.  The tests and benchmarks of dictionaries share these,
+ * as they are the kind of chunk dictionaries are meant for.
+ */
+inline std::string sample_dir(unsigned index) {
+  static const char* const names[] = {
+    "src", "include", "README", "Makefile", "main.cc", "pool.cc",
+    "index.hh", "test", "docs", "LICENSE",
+  };
+  std::mt19937 gen(index);
+  std::ostringstream out;
+  const unsigned entries = 2 + gen() % 3;
+  for (unsigned i = 0; i < entries; ++i) {
+    out << "name=" << names[gen() % 10] << '/' << names[gen() % 10] << '\n'
+	<< "kind=" << (gen() % 4 == 0 ? "DIR" : "REG") << '\n'
+	<< "mode=0" << 600 + gen() % 200 << '\n'
+	<< "uid=1000\ngid=1000\n"
+	<< "size=" << gen() % 100000 << '\n'
+	<< "mtime=" << 1400000000 + gen() % 100000000 << '\n'
+	<< "ctime=" << 1400000000 + gen() % 100000000 << '\n'
+	<< "data=" << std::hex << gen() << gen() << gen() << std::dec << '\n';
+  }
+  return out.str();
+}
+
+// The samples for `count` indexes, starting at `first`.
+inline std::vector<std::string> sample_dirs(unsigned first, unsigned count) {
+  std::vector<std::string> result;
+  for (unsigned i = first; i < first + count; ++i)
+    result.push_back(sample_dir(i));
+  return result;
+}
+
+} // namespace cdump
+
+#endif // __SAMPLEDIR_HH__
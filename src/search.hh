@@ -0,0 +1,152 @@
+// Searching sorted tables of OIDs.
+
+#ifndef __SEARCH_HH__
+#define __SEARCH_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "oid.hh"
+
+namespace cdump {
+
+// The searches work on any table whose elements have an `oid_of`
+// overload.  Plain OID tables are the simplest case.
+inline const OID& oid_of(const OID& oid) { return oid; }
+
+/**
+ * Binary search for `key` within [low, high) of the sorted `table`.
+ *
+ * @return true, with `pos` set to the matching index, if the key is
+ * present.
+ */
+template<class E>
+bool binary_search_oid(const E* table, size_t low, size_t high,
+		       const OID& key, size_t& pos)
+{
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    const auto cmp = key.cmp(oid_of(table[mid]));
+    if (cmp < 0)
+      high = mid;
+    else if (cmp > 0)
+      low = mid + 1;
+    else {
+      pos = mid;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Interpolation search for `key` within [low, high) of the sorted
+ * `table`.
+ *
+ * Since OIDs are SHA-1 hashes, they are close to uniformly
+ * distributed, and the position of a key can be estimated from its
+ * leading 64 bits.  The caller gives the range of leading words that
+ * the elements of [low, high) can have (inclusive), typically from
+ * the fanout bucket, so the first guess doesn't need to read
+ * anything.  Each probe narrows both the position and word ranges.
+ *
+ * A run of bad guesses (which can only happen with a skewed table)
+ * is bounded by falling back to binary search after a few steps, or
+ * once the range is small enough that binary search is as good.
+ */
+template<class E>
+bool interpolation_search_oid(const E* table, size_t low, size_t high,
+			      uint64_t low_word, uint64_t high_word,
+			      const OID& key, size_t& pos)
+{
+  static const unsigned max_steps = 4;
+  static const size_t min_range = 8;
+
+  const uint64_t word = key.peek_word(0);
+  if (word < low_word || word > high_word)
+    return false;
+
+  for (unsigned step = 0; step < max_steps && high - low > min_range; ++step) {
+    const double fraction =
+	double(word - low_word) / (double(high_word - low_word) + 1.0);
+    size_t guess = low + size_t(fraction * (high - low));
+    if (guess >= high)
+      guess = high - 1;
+
+    const OID& probe = oid_of(table[guess]);
+    const auto cmp = key.cmp(probe);
+    if (cmp < 0) {
+      high = guess;
+      high_word = probe.peek_word(0);
+    } else if (cmp > 0) {
+      low = guess + 1;
+      low_word = probe.peek_word(0);
+    } else {
+      pos = guess;
+      return true;
+    }
+  }
+
+  return binary_search_oid(table, low, high, key, pos);
+}
+
+namespace detail {
+inline void eytzinger_fill(size_t pos, size_t n, uint32_t& rank,
+			   std::vector<uint32_t>& order)
+{
+  if (pos >= n)
+    return;
+  eytzinger_fill(2 * pos + 1, n, rank, order);
+  order[rank++] = pos;
+  eytzinger_fill(2 * pos + 2, n, rank, order);
+}
+} // namespace detail
+
+/**
+ * Compute the Eytzinger (breadth-first binary tree) layout of a
+ * sorted run of `n` elements.  On return, `order[rank]` is the
+ * position within the layout of the element with the given sorted
+ * rank.  Visiting the layout in `order` gives sorted order.
+ */
+inline void eytzinger_order(size_t n, std::vector<uint32_t>& order) {
+  order.resize(n);
+  uint32_t rank = 0;
+  detail::eytzinger_fill(0, n, rank, order);
+}
+
+/**
+ * Search the `n` elements of `table`, which are in Eytzinger layout.
+ *
+ * The children of the element at `pos` are at 2*pos+1 and 2*pos+2,
+ * so each level of the search is in a predictable place, unlike a
+ * binary search over a sorted array.  The four grandchildren are
+ * adjacent, so they are prefetched while the current element is
+ * being compared, which hides most of the latency of the next level.
+ *
+ * @return true, with `pos` set to the matching index, if the key is
+ * present.
+ */
+template<class E>
+bool eytzinger_search_oid(const E* table, size_t n, const OID& key,
+			  size_t& pos)
+{
+  size_t cur = 0;
+  while (cur < n) {
+    const char* next = reinterpret_cast<const char*>(table + 4 * cur + 3);
+    __builtin_prefetch(next);
+    __builtin_prefetch(next + 64);
+
+    const auto cmp = key.cmp(oid_of(table[cur]));
+    if (cmp == 0) {
+      pos = cur;
+      return true;
+    }
+    cur = 2 * cur + 1 + (cmp > 0);
+  }
+  return false;
+}
+
+} // namespace cdump
+
+#endif // __SEARCH_HH__
@@ -0,0 +1,50 @@
+// Forcing data to stable storage.
+
+#include "sync.hh"
+
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace cdump {
+
+namespace {
+// Sync the file at `path`, opened with `flags`.
+void sync_path(const std::string& path, int flags) {
+  const int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Unable to open file to sync: " + path);
+  const int result = ::fsync(fd);
+  ::close(fd);
+  if (result != 0)
+    throw std::runtime_error("Unable to sync: " + path);
+}
+} // namespace
+
+void sync_data(int fd) {
+  int result;
+  do {
+    result = ::fdatasync(fd);
+  } while (result != 0 && errno == EINTR);
+  if (result != 0)
+    throw std::runtime_error("Unable to sync file data");
+}
+
+void sync_file(const std::string& path) {
+  sync_path(path, O_RDONLY);
+}
+
+void sync_parent(const std::string& path) {
+  auto dir = bf::path(path).parent_path();
+  if (dir.empty())
+    dir = ".";
+  sync_path(dir.string(), O_RDONLY | O_DIRECTORY);
+}
+
+} // namespace cdump
@@ -0,0 +1,23 @@
+// Forcing data to stable storage.
+
+#ifndef __SYNC_HH__
+#define __SYNC_HH__
+
+#include <string>
+
+namespace cdump {
+
+// Wait for the data written to `fd` to reach stable storage.  Only
+// the metadata needed to read it back (such as the size) is synced.
+void sync_data(int fd);
+
+// Sync the data of the file with the given name.
+void sync_file(const std::string& path);
+
+// Sync the directory containing `path`, which makes the creation,
+// rename, or removal of `path` durable.
+void sync_parent(const std::string& path);
+
+} // namespace cdump
+
+#endif // __SYNC_HH__
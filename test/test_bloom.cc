@@ -0,0 +1,53 @@
+// Testing the bloom filter.
+
+#include "bloom.hh"
+
+#include "gtest/gtest.h"
+
+#include "tutil.hh"
+#include "oid.hh"
+
+namespace {
+const unsigned bloom_count = 10000;
+}
+
+TEST(Bloom, Absent) {
+  cdump::BloomFilter filter;
+  ASSERT_TRUE(filter.empty());
+  ASSERT_TRUE(filter.may_contain(int_oid(1)));
+}
+
+TEST(Bloom, Membership) {
+  cdump::BloomFilter filter;
+  filter.reset(bloom_count);
+  ASSERT_FALSE(filter.empty());
+
+  for (unsigned i = 0; i < bloom_count; ++i)
+    filter.add(int_oid(i));
+
+  // There must never be false negatives.
+  for (unsigned i = 0; i < bloom_count; ++i)
+    ASSERT_TRUE(filter.may_contain(int_oid(i)));
+
+  // The false positive rate should be a few percent at most.
+  unsigned false_positives = 0;
+  for (unsigned i = bloom_count; i < 2 * bloom_count; ++i) {
+    if (filter.may_contain(int_oid(i)))
+      ++false_positives;
+  }
+  ASSERT_LT(false_positives, bloom_count / 30);
+
+  // Filters built from the same data are interchangeable.
+  cdump::BloomFilter copy;
+  copy.attach(filter.data(), filter.block_count());
+  ASSERT_EQ(copy.block_count(), filter.block_count());
+  for (unsigned i = 0; i < bloom_count; ++i)
+    ASSERT_TRUE(copy.may_contain(int_oid(i)));
+}
+
+TEST(Bloom, Empty) {
+  cdump::BloomFilter filter;
+  filter.reset(0);
+  ASSERT_FALSE(filter.empty());
+  ASSERT_FALSE(filter.may_contain(int_oid(1)));
+}
@@ -1,14 +1,21 @@
 // Testing chunks and chunk IO.
 
 #include "chunk.hh"
+#include "entropy.hh"
+#include "mapping.hh"
 #include "pdump.hh"
 #include "tutil.hh"
 
 #include <algorithm>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include "gtest/gtest.h"
 
 // Verify that compression and decompression directly work.
@@ -107,6 +114,33 @@ TEST(Chunk, IO) {
   ct.check_read();
 }
 
+// The bound is known without compressing, and never too small.
+TEST(Chunk, WriteSize) {
+  for (auto size : build_sizes()) {
+    const auto text = make_random_string(size, size);
+    std::string noise(size, 0);
+    for (unsigned i = 0; i < size; ++i)
+      noise[i] = (i * 2654435761u) >> 24;
+
+    for (const auto& data : { text, noise }) {
+      cdump::Compressibility::reset_stats();
+      cdump::PlainChunk chunk("blob", data.data(), data.size());
+      const unsigned bound = chunk.write_size_bound();
+      ASSERT_EQ(cdump::Compressibility::stats().tried, 0u);
+
+      const unsigned exact = chunk.write_size();
+      ASSERT_LE(exact, bound);
+      if (!chunk.has_zdata()) {
+	ASSERT_EQ(exact, bound);
+      }
+
+      cdump::Chunk::data_type buf;
+      chunk.append_to(buf);
+      ASSERT_EQ(buf.size(), exact);
+    }
+  }
+}
+
 // Verify that the move constructors work.
 TEST(Chunk, CopyMove) {
   cdump::PlainChunk ch1("blob", "hello", 5);
@@ -120,3 +154,38 @@ TEST(Chunk, CopyMove) {
   // This should be a compilation failure.
   // auto ch3 = ch2;
 }
+
+namespace {
+class ChunkFile : public Tmpdir {
+};
+} // namespace
+
+// Damaged lengths in a header are refused before anything is
+// allocated for them, whether the chunk is read or mapped.
+TEST_F(ChunkFile, BadLength) {
+  const std::string name = path + "/chunk";
+  const std::string data = make_random_string(1000, 1);
+
+  auto check = [&](unsigned at, int32_t value) {
+    {
+      std::ofstream out(name);
+      cdump::PlainChunk("blob", data.data(), data.size()).write(out);
+    }
+    {
+      std::fstream file(name, std::ios::in | std::ios::out);
+      file.seekp(at);
+      file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    const int fd = ::open(name.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_THROW(cdump::Chunk::read_at(fd, 0), std::runtime_error);
+    ::close(fd);
+    const auto map = std::make_shared<cdump::MappedFile>(name);
+    ASSERT_THROW(cdump::Chunk::read_mapped(map, 0), std::runtime_error);
+  };
+
+  // The lengths follow the 16 byte magic.
+  check(16, -5);
+  check(16, 0x7fffffff);
+  check(20, -2);
+}
@@ -0,0 +1,71 @@
+// Testing the chunk cache.
+
+#include "chunkcache.hh"
+
+#include "gtest/gtest.h"
+
+#include "tutil.hh"
+
+namespace {
+cdump::Chunk::SharedPtr make_chunk(const char* kind, unsigned size,
+				   unsigned index)
+{
+  auto buf = make_random_string(size, index);
+  return cdump::Chunk::SharedPtr(new cdump::PlainChunk(kind, buf.data(),
+						       buf.size()));
+}
+}
+
+TEST(ChunkCache, HitMiss) {
+  cdump::ChunkCache cache(1 << 20);
+  auto ch = make_chunk("dir ", 1000, 1);
+
+  ASSERT_FALSE(bool(cache.find(ch->oid())));
+  cache.insert(ch);
+  auto ch2 = cache.find(ch->oid());
+  ASSERT_EQ(ch2.get(), ch.get());
+
+  const auto stats = cache.stats();
+  ASSERT_EQ(stats.hits, 1u);
+  ASSERT_EQ(stats.misses, 1u);
+  ASSERT_EQ(stats.entries, 1u);
+}
+
+// The budget is kept by evicting the least recently used chunks.
+TEST(ChunkCache, Eviction) {
+  cdump::ChunkCache cache(64 * 1024, 1);
+  std::vector<cdump::Chunk::SharedPtr> chunks;
+  for (unsigned i = 0; i < 200; ++i) {
+    chunks.push_back(make_chunk("dir ", 1000, i));
+    cache.insert(chunks.back());
+
+    // Keep the first one in use.
+    ASSERT_TRUE(bool(cache.find(chunks[0]->oid())));
+  }
+
+  const auto stats = cache.stats();
+  ASSERT_LE(stats.bytes, cache.budget());
+  ASSERT_GT(stats.evictions, 0u);
+  ASSERT_EQ(stats.entries + stats.evictions, 200u);
+  ASSERT_TRUE(bool(cache.find(chunks[0]->oid())));
+  ASSERT_TRUE(bool(cache.find(chunks[199]->oid())));
+  ASSERT_FALSE(bool(cache.find(chunks[1]->oid())));
+}
+
+TEST(ChunkCache, Admission) {
+  cdump::ChunkCache cache(1 << 20);
+  auto small = make_chunk("blob", 1000, 1);
+  auto large = make_chunk("blob", 10000, 2);
+  auto dir = make_chunk("dir ", 10000, 3);
+  cache.insert(small);
+  cache.insert(large);
+  cache.insert(dir);
+  ASSERT_TRUE(bool(cache.find(small->oid())));
+  ASSERT_FALSE(bool(cache.find(large->oid())));
+  ASSERT_TRUE(bool(cache.find(dir->oid())));
+
+  cache.set_limit("dir ", 0);
+  auto dir2 = make_chunk("dir ", 100, 4);
+  cache.insert(dir2);
+  ASSERT_FALSE(bool(cache.find(dir2->oid())));
+}
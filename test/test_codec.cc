@@ -0,0 +1,207 @@
+// Testing compression codecs.
+
+#include "chunk.hh"
+#include "codec.hh"
+#include "lz.hh"
+#include "tutil.hh"
+
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include <zlib.h>
+
+namespace {
+
+// Text, random bytes, and long runs, which make overlapping matches.
+std::vector<std::string> sample_data(unsigned size) {
+  std::vector<std::string> result;
+  result.push_back(make_random_string(size, size));
+
+  std::mt19937 gen(size);
+  std::string noise(size, 0);
+  for (auto& ch : noise)
+    ch = gen();
+  result.push_back(noise);
+
+  std::string runs;
+  while (runs.size() < size)
+    runs.append(gen() % 300 + 1, 'a' + gen() % 3);
+  runs.resize(size);
+  result.push_back(runs);
+  return result;
+}
+
+void check_round_trip(const cdump::Codec& codec, const std::string& data) {
+  std::vector<char> zdata(data.size());
+  const int zlen = codec.compress(data.data(), data.size(), zdata.data());
+  if (zlen < 0)
+    return;
+  ASSERT_LT(unsigned(zlen), data.size());
+
+  std::vector<char> out(data.size());
+  codec.decompress(zdata.data(), zlen, out.data(), out.size());
+  ASSERT_EQ(memcmp(out.data(), data.data(), data.size()), 0);
+}
+
+} // namespace
+
+TEST(Codec, Registry) {
+  const auto codecs = cdump::Codec::all();
+  ASSERT_EQ(codecs.size(), 3u);
+  for (const auto codec : codecs) {
+    ASSERT_EQ(&cdump::Codec::by_id(codec->id()), codec);
+    ASSERT_EQ(&cdump::Codec::by_name(codec->name()), codec);
+  }
+  ASSERT_EQ(cdump::Codec::by_id(cdump::Codec::zlib_id).name(),
+	    std::string("zlib"));
+  ASSERT_THROW(cdump::Codec::by_id(0), std::runtime_error);
+  ASSERT_THROW(cdump::Codec::by_id(200), std::runtime_error);
+  ASSERT_THROW(cdump::Codec::by_name("bogus"), std::invalid_argument);
+}
+
+TEST(Codec, RoundTrip) {
+  for (const auto codec : cdump::Codec::all()) {
+    for (auto size : build_sizes()) {
+      for (const auto& data : sample_data(size))
+	check_round_trip(*codec, data);
+    }
+  }
+}
+
+// The zlib codec reuses its streams, which mustn't change what it
+// writes, or be upset by a failure partway through.
+TEST(Codec, ZlibReuse) {
+  const auto& zlib = cdump::Codec::by_name("zlib");
+  for (auto size : build_sizes()) {
+    if (size < 16)
+      continue;
+    for (const auto& data : sample_data(size)) {
+      std::vector<char> zdata(size);
+      const int zlen = zlib.compress(data.data(), size, zdata.data());
+
+      std::vector<char> expect(compressBound(size));
+      uLongf expect_len = expect.size();
+      ASSERT_EQ(compress2(reinterpret_cast<Bytef*>(expect.data()), &expect_len,
+			  reinterpret_cast<const Bytef*>(data.data()), size, 3),
+		Z_OK);
+      if (expect_len >= size) {
+	ASSERT_EQ(zlen, -1);
+	continue;
+      }
+      ASSERT_EQ(unsigned(zlen), expect_len);
+      ASSERT_EQ(memcmp(zdata.data(), expect.data(), zlen), 0);
+
+      std::vector<char> out(size);
+      ASSERT_THROW(zlib.decompress(zdata.data(), zlen - 1,
+				   out.data(), out.size()),
+		   std::runtime_error);
+      zlib.decompress(zdata.data(), zlen, out.data(), out.size());
+      ASSERT_EQ(memcmp(out.data(), data.data(), size), 0);
+    }
+  }
+}
+
+// Every codec should at least do something with text.
+TEST(Codec, Compresses) {
+  const auto text = make_random_string(65536, 1);
+  for (const auto codec : cdump::Codec::all()) {
+    std::vector<char> zdata(text.size());
+    const int zlen = codec->compress(text.data(), text.size(), zdata.data());
+    ASSERT_GT(zlen, 0);
+    ASSERT_LT(unsigned(zlen), text.size() / 2);
+  }
+}
+
+// Damaged data must be rejected, not read or written out of bounds.
+TEST(Codec, Corrupt) {
+  const auto text = make_random_string(16384, 2);
+  for (const auto codec : cdump::Codec::all()) {
+    std::vector<char> zdata(text.size());
+    const int zlen = codec->compress(text.data(), text.size(), zdata.data());
+    ASSERT_GT(zlen, 0);
+    std::vector<char> out(text.size());
+
+    ASSERT_THROW(codec->decompress(zdata.data(), zlen / 2,
+				   out.data(), out.size()),
+		 std::runtime_error);
+    ASSERT_THROW(codec->decompress(zdata.data(), zlen,
+				   out.data(), out.size() - 1),
+		 std::runtime_error);
+  }
+
+  // The lz decoder does no checksumming, so throw garbage at it.
+  std::mt19937 gen(3);
+  std::vector<char> garbage(256);
+  std::vector<char> out(1024);
+  for (int i = 0; i < 1000; ++i) {
+    for (auto& ch : garbage)
+      ch = gen();
+    try {
+      cdump::lz::decompress(garbage.data(), garbage.size(),
+			    out.data(), out.size());
+    } catch (std::runtime_error&) {
+    }
+  }
+}
+
+// Chunks record their codec, and read back with it.
+TEST(Codec, Chunks) {
+  const auto text = make_random_string(10000, 4);
+  for (const auto codec : cdump::Codec::all()) {
+    cdump::PlainChunk chunk("blob", text.data(), text.size());
+    chunk.set_codec(*codec);
+    ASSERT_TRUE(chunk.has_zdata());
+    ASSERT_EQ(chunk.zcodec(), codec->id());
+
+    std::stringstream buf;
+    chunk.write(buf);
+    buf.seekg(0);
+    auto back = cdump::Chunk::read(buf);
+    ASSERT_EQ(back->oid(), chunk.oid());
+    ASSERT_EQ(back->zcodec(), codec->id());
+    ASSERT_EQ(back->size(), text.size());
+    ASSERT_EQ(memcmp(back->data(), text.data(), text.size()), 0);
+  }
+}
+
+// Chunks written before there were codecs are still readable.
+TEST(Codec, OldChunks) {
+  const auto text = make_random_string(10000, 5);
+  cdump::PlainChunk chunk("blob", text.data(), text.size());
+  chunk.set_codec(cdump::Codec::by_name("zlib"));
+
+  cdump::Chunk::data_type buf;
+  chunk.append_to(buf);
+  memcpy(buf.data(), "adump-pool-v1.1\n", 16);
+
+  cdump::Chunk::HeaderInfo info;
+  ASSERT_TRUE(cdump::Chunk::parse_header(buf.data(), info));
+  ASSERT_EQ(info.size, text.size());
+  ASSERT_EQ(info.stored_size, buf.size());
+
+  std::stringstream in(std::string(buf.data(), buf.size()));
+  auto back = cdump::Chunk::read(in);
+  ASSERT_EQ(back->zcodec(), cdump::Codec::zlib_id);
+  ASSERT_EQ(memcmp(back->data(), text.data(), text.size()), 0);
+
+  // An unknown codec is refused when read, not misread.
+  memcpy(buf.data(), "adump-pool-v1.2", 15);
+  buf[15] = 99;
+  std::stringstream bad(std::string(buf.data(), buf.size()));
+  ASSERT_THROW(cdump::Chunk::read(bad), std::runtime_error);
+}
+
+TEST(Codec, Default) {
+  const auto& saved = cdump::Codec::default_codec();
+  const auto text = make_random_string(1000, 6);
+  for (const auto codec : cdump::Codec::all()) {
+    cdump::Codec::set_default(*codec);
+    cdump::PlainChunk chunk("blob", text.data(), text.size());
+    ASSERT_EQ(chunk.zcodec(), codec->id());
+  }
+  cdump::Codec::set_default(saved);
+}
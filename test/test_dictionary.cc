@@ -0,0 +1,255 @@
+// Testing compression dictionaries.
+
+#include "chunk.hh"
+#include "codec.hh"
+#include "dictionary.hh"
+#include "pool.hh"
+#include "sampledir.hh"
+#include "tutil.hh"
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include <boost/filesystem.hpp>
+
+namespace bf = boost::filesystem;
+
+namespace {
+
+class Dictionary : public Tmpdir {
+};
+
+// Fill a pool with directories, and train a dictionary for them.
+cdump::Dictionary::Ptr train_pool(const std::string& path) {
+  cdump::Pool::create_pool(path);
+  cdump::Pool pool(path, true);
+  for (const auto& text : cdump::sample_dirs(0, 300)) {
+    cdump::PlainChunk chunk("dir ", text.data(), text.size());
+    pool.insert(chunk);
+  }
+  const auto trained = pool.train_dictionaries({ "dir ", "back" });
+  return trained.size() == 1 ? trained[0] : cdump::Dictionary::Ptr();
+}
+
+} // namespace
+
+TEST_F(Dictionary, Train) {
+  const auto data = cdump::Dictionary::train(cdump::sample_dirs(0, 500), 4096);
+  ASSERT_GT(data.size(), 1000u);
+  ASSERT_LE(data.size(), 4096u);
+  ASSERT_NE(data.find("mtime=1"), std::string::npos);
+
+  // Nothing in common, nothing to learn.
+  ASSERT_TRUE(cdump::Dictionary::train({ "abcdefghijkl", "mnopqrstuvwx" },
+				       4096).empty());
+}
+
+TEST_F(Dictionary, Compress) {
+  const auto sample = cdump::sample_dirs(0, 500);
+  const auto dirs = cdump::sample_dirs(1000, 100);
+  auto dict = std::make_shared<cdump::Dictionary>(
+    "dir ", cdump::Dictionary::train(sample, 8192));
+  const auto& zlib = cdump::Codec::by_id(cdump::Codec::zlib_id);
+
+  auto total = [&](const cdump::Dictionary::Ptr& use) {
+    unsigned bytes = 0;
+    for (const auto& text : dirs) {
+      cdump::PlainChunk chunk("dir ", text.data(), text.size());
+      chunk.set_codec(zlib);
+      chunk.set_dictionary(use);
+      bytes += chunk.has_zdata() ? chunk.zsize() : chunk.size();
+    }
+    return bytes;
+  };
+
+  const unsigned plain = total(nullptr);
+  const unsigned trained = total(dict);
+  ASSERT_LT(trained, plain * 3 / 4);
+
+  // A dictionary never changes the codec, and codecs that don't take
+  // one ignore it.
+  cdump::PlainChunk lz("dir ", dirs[0].data(), dirs[0].size());
+  lz.set_codec(cdump::Codec::by_name("lz"));
+  lz.set_dictionary(dict);
+  ASSERT_TRUE(lz.has_zdata());
+  ASSERT_EQ(lz.zcodec(), cdump::Codec::lz_id);
+  uint32_t id;
+  ASSERT_FALSE(lz.zdictionary(id));
+
+  cdump::PlainChunk chunk("dir ", dirs[0].data(), dirs[0].size());
+  chunk.set_codec(zlib);
+  chunk.set_dictionary(dict);
+  ASSERT_TRUE(chunk.has_zdata());
+  ASSERT_EQ(chunk.zcodec(), cdump::Codec::zlib_id);
+  ASSERT_TRUE(chunk.zdictionary(id));
+  ASSERT_EQ(id, dict->id());
+  std::stringstream buf;
+  chunk.write(buf);
+
+  buf.seekg(0);
+  const auto dicts = std::make_shared<cdump::DictionarySet>(
+    std::vector<cdump::Dictionary::Ptr> { dict });
+  auto back = cdump::Chunk::read(buf, dicts);
+  ASSERT_EQ(std::string(back->data(), back->size()), dirs[0]);
+
+  // Without the dictionary, the chunk can't be read.
+  buf.seekg(0);
+  back = cdump::Chunk::read(buf);
+  ASSERT_THROW(back->data(), std::runtime_error);
+}
+
+TEST_F(Dictionary, ReadWrite) {
+  std::vector<cdump::Dictionary::Ptr> dicts {
+    std::make_shared<cdump::Dictionary>("dir ", "some dictionary"),
+    std::make_shared<cdump::Dictionary>("back", std::string(100, 'x')),
+  };
+  std::stringstream buf;
+  cdump::Dictionary::write(buf, dicts);
+  const auto data = buf.str();
+
+  auto back = cdump::Dictionary::read(buf);
+  ASSERT_EQ(back.size(), 2u);
+  for (unsigned i = 0; i < 2; ++i) {
+    ASSERT_EQ(back[i]->kind(), dicts[i]->kind());
+    ASSERT_EQ(back[i]->data(), dicts[i]->data());
+    ASSERT_EQ(back[i]->id(), dicts[i]->id());
+  }
+
+  std::stringstream truncated(data.substr(0, data.size() - 10));
+  ASSERT_THROW(cdump::Dictionary::read(truncated), std::runtime_error);
+}
+
+// Dictionaries trained for a pool are stored with it, and used for
+// reading its chunks when it is opened again.
+TEST_F(Dictionary, Pool) {
+  const auto trained = train_pool(path);
+  ASSERT_TRUE(bool(trained));
+  ASSERT_EQ(trained->kind(), cdump::Kind("dir "));
+  ASSERT_TRUE(bf::exists(bf::path(path) / "metadata" / "dictionaries"));
+
+  std::vector<cdump::OID> oids;
+  {
+    cdump::Pool pool(path, true);
+    for (const auto& text : cdump::sample_dirs(1000, 50)) {
+      cdump::PlainChunk chunk("dir ", text.data(), text.size());
+      ASSERT_TRUE(pool.use_dictionary(chunk));
+      pool.insert(chunk);
+      oids.push_back(chunk.oid());
+    }
+
+    // Only kinds with a dictionary are changed.
+    cdump::PlainChunk blob("blob", "some blob data", 14);
+    ASSERT_FALSE(pool.use_dictionary(blob));
+
+    ASSERT_THROW(pool.train_dictionaries({ "dir " },
+					  cdump::Pool::default_dictionary_size, 0),
+		 std::invalid_argument);
+  }
+
+  cdump::Pool pool(path);
+  for (unsigned i = 0; i < oids.size(); ++i) {
+    const auto chunk = pool.find(oids[i]);
+    ASSERT_EQ(std::string(chunk->data(), chunk->size()), cdump::sample_dir(1000 + i));
+  }
+}
+
+// Dictionaries belong to their pool.  Having one pool open doesn't
+// affect what is written to another, and a chunk that needs a
+// dictionary the pool doesn't have is refused.
+TEST_F(Dictionary, TwoPools) {
+  const std::string path_a = path + "/a";
+  const std::string path_b = path + "/b";
+  bf::create_directory(path_a);
+  bf::create_directory(path_b);
+  ASSERT_TRUE(bool(train_pool(path_a)));
+  cdump::Pool::create_pool(path_b);
+
+  std::vector<cdump::OID> oids;
+  {
+    cdump::Pool a(path_a, true);
+    cdump::Pool b(path_b, true);
+    for (const auto& text : cdump::sample_dirs(1000, 20)) {
+      cdump::PlainChunk chunk("dir ", text.data(), text.size());
+      chunk.set_codec(cdump::Codec::by_id(cdump::Codec::zlib_id));
+      ASSERT_FALSE(b.use_dictionary(chunk));
+      b.insert(chunk);
+      oids.push_back(chunk.oid());
+      uint32_t id;
+      ASSERT_FALSE(chunk.zdictionary(id));
+
+      ASSERT_TRUE(a.use_dictionary(chunk));
+      ASSERT_THROW(b.insert(chunk), std::runtime_error);
+      a.insert(chunk);
+    }
+  }
+
+  // A fresh reader of b, with nothing else open, reads it all.
+  cdump::Pool b(path_b);
+  for (unsigned i = 0; i < oids.size(); ++i) {
+    const auto chunk = b.find(oids[i]);
+    ASSERT_EQ(std::string(chunk->data(), chunk->size()), cdump::sample_dir(1000 + i));
+  }
+}
+
+// An ordinary insert into a pool with a dictionary for the kind uses
+// it, unless the caller chose a codec.
+TEST_F(Dictionary, Insert) {
+  const std::string path_a = path + "/a";
+  const std::string path_b = path + "/b";
+  bf::create_directory(path_a);
+  bf::create_directory(path_b);
+  const auto dict = train_pool(path_a);
+  ASSERT_TRUE(bool(dict));
+  cdump::Pool::create_pool(path_b);
+
+  // The bytes each pool grows by, inserting the same chunks.
+  auto grow = [&](const std::string& where) {
+    auto size = [&]() {
+      uint64_t total = 0;
+      for (auto elt = bf::directory_iterator(where);
+	   elt != bf::directory_iterator(); ++elt) {
+	if (elt->path().extension() == ".data")
+	  total += bf::file_size(elt->path());
+      }
+      return total;
+    };
+    const uint64_t before = size();
+    {
+      cdump::Pool pool(where, true);
+      for (const auto& text : cdump::sample_dirs(1000, 100)) {
+	cdump::PlainChunk chunk("dir ", text.data(), text.size());
+	pool.insert(chunk);
+      }
+    }
+    return size() - before;
+  };
+  ASSERT_LT(grow(path_a), grow(path_b) * 3 / 4);
+
+  std::vector<cdump::OID> oids;
+  const auto text = cdump::sample_dir(2000);
+  {
+    cdump::Pool pool(path_a, true);
+    cdump::PlainChunk chunk("dir ", text.data(), text.size());
+    pool.insert(chunk);
+    oids.push_back(chunk.oid());
+
+    cdump::PlainChunk chosen("dir ", text.data(), text.size() - 1);
+    chosen.set_codec(cdump::Codec::default_codec());
+    pool.insert(chosen);
+    oids.push_back(chosen.oid());
+  }
+
+  cdump::Pool pool(path_a);
+  uint32_t id;
+  auto chunk = pool.find(oids[0]);
+  ASSERT_EQ(std::string(chunk->data(), chunk->size()), text);
+  ASSERT_TRUE(chunk->zdictionary(id));
+  ASSERT_EQ(id, dict->id());
+  chunk = pool.find(oids[1]);
+  ASSERT_EQ(std::string(chunk->data(), chunk->size()),
+	    text.substr(0, text.size() - 1));
+  ASSERT_FALSE(chunk->zdictionary(id));
+}
@@ -0,0 +1,88 @@
+// Testing the compressibility check.
+
+#include "chunk.hh"
+#include "entropy.hh"
+#include "tutil.hh"
+
+#include <random>
+#include <string>
+#include "gtest/gtest.h"
+
+namespace {
+
+std::string random_bytes(unsigned size, unsigned seed) {
+  std::mt19937 gen(seed);
+  std::string result(size, 0);
+  for (auto& ch : result)
+    ch = gen();
+  return result;
+}
+
+} // namespace
+
+TEST(Entropy, Sampled) {
+  using cdump::Compressibility;
+  for (unsigned size : { 1024u, 4096u, 5000u, 1u << 20 }) {
+    const auto noise = random_bytes(size, size);
+    ASSERT_GE(Compressibility::sampled_entropy(noise.data(), size),
+	      Compressibility::entropy_limit);
+
+    const auto text = make_random_string(size, size);
+    ASSERT_LT(Compressibility::sampled_entropy(text.data(), size), 6.0);
+
+    const std::string zeros(size, 0);
+    ASSERT_LT(Compressibility::sampled_entropy(zeros.data(), size), 0.01);
+  }
+}
+
+TEST(Entropy, Check) {
+  using cdump::Compressibility;
+  const auto text = make_random_string(8192, 1);
+  ASSERT_EQ(Compressibility::check(text.data(), text.size()),
+	    Compressibility::Try);
+
+  const auto gzip = "\x1f\x8b" + text;
+  ASSERT_EQ(Compressibility::check(gzip.data(), gzip.size()),
+	    Compressibility::KnownFormat);
+
+  const auto noise = random_bytes(8192, 2);
+  ASSERT_EQ(Compressibility::check(noise.data(), noise.size()),
+	    Compressibility::HighEntropy);
+
+  // Too short to be worth checking.
+  ASSERT_EQ(Compressibility::check(noise.data(), 100),
+	    Compressibility::Try);
+}
+
+TEST(Entropy, Chunks) {
+  using cdump::Compressibility;
+  Compressibility::reset_stats();
+
+  const auto noise = random_bytes(65536, 3);
+  cdump::PlainChunk skipped("blob", noise.data(), noise.size());
+  ASSERT_FALSE(skipped.has_zdata());
+
+  const auto text = make_random_string(65536, 3);
+  cdump::PlainChunk compressed("blob", text.data(), text.size());
+  ASSERT_TRUE(compressed.has_zdata());
+
+  auto stats = Compressibility::stats();
+  ASSERT_EQ(stats.checked, 2u);
+  ASSERT_EQ(stats.skipped_entropy, 1u);
+  ASSERT_EQ(stats.skipped_format, 0u);
+  ASSERT_EQ(stats.skipped_bytes, 65536u);
+  ASSERT_EQ(stats.tried, 1u);
+  ASSERT_EQ(stats.tried_failed, 0u);
+
+  // With the check off, everything is tried.
+  Compressibility::set_enabled(false);
+  cdump::PlainChunk tried("blob", noise.data(), noise.size());
+  ASSERT_FALSE(tried.has_zdata());
+  Compressibility::set_enabled(true);
+
+  stats = Compressibility::stats();
+  ASSERT_EQ(stats.checked, 2u);
+  ASSERT_EQ(stats.tried, 2u);
+  ASSERT_EQ(stats.tried_failed, 1u);
+  ASSERT_EQ(stats.failed_bytes, 65536u);
+}
@@ -0,0 +1,64 @@
+// Testing the descriptor cache.
+
+#include "fdcache.hh"
+#include "except.hh"
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "tutil.hh"
+
+namespace {
+
+class FdCache : public Tmpdir {
+ protected:
+  std::string name(unsigned key) {
+    return path + "/file-" + std::to_string(key);
+  }
+
+  void make_files(unsigned count) {
+    for (unsigned i = 0; i < count; ++i)
+      std::ofstream(name(i)) << "file " << i;
+  }
+};
+
+} // namespace
+
+// The path is only asked for when the file isn't already open.
+TEST_F(FdCache, Hit) {
+  make_files(1);
+  cdump::FdCache cache;
+  unsigned opens = 0;
+  auto make_path = [&]() {
+    ++opens;
+    return name(0);
+  };
+
+  const auto first = cache.get(0, make_path);
+  const auto second = cache.get(0, make_path);
+  ASSERT_EQ(opens, 1u);
+  ASSERT_EQ(first.get(), second.get());
+  ASSERT_EQ(cache.size(), 1u);
+}
+
+// Each shard keeps its share of the limit.
+TEST_F(FdCache, Limit) {
+  make_files(40);
+  cdump::FdCache cache(16, 4);
+  std::vector<cdump::FdCache::Handle> held;
+  for (unsigned i = 0; i < 40; ++i)
+    held.push_back(cache.get(i, [&]() { return name(i); }));
+  ASSERT_EQ(cache.size(), 16u);
+
+  // Evicted descriptors stay open while they're held.
+  char buf[4];
+  ASSERT_EQ(::pread(held[0]->fd(), buf, 4, 0), 4);
+
+  ASSERT_THROW(cache.get(99, [&]() { return name(99); }),
+	       cdump::pool_open_error);
+  ASSERT_THROW(cdump::FdCache(16, 3), std::invalid_argument);
+}
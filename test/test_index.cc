@@ -3,13 +3,18 @@
 #include "index.hh"
 
 #include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <set>
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <boost/filesystem.hpp>
+#include <endian.h>
+#include <zlib.h>
 #include "gtest/gtest.h"
 
+#include "except.hh"
 #include "tutil.hh"
 #include "oid.hh"
 
@@ -144,3 +149,255 @@ TEST_F(IndexTest, Generate) {
   index.check_all();
   index.check_iter();
 }
+
+// Both of the index layouts must be readable.
+TEST_F(IndexTest, Versions) {
+  for (auto version : { cdump::FileIndex::sorted_version,
+			cdump::FileIndex::eytzinger_version,
+			cdump::FileIndex::wide_version })
+  {
+    const std::string name = path + "/version.idx";
+
+    IndexTracker index;
+    index.add(0, index_count);
+    index.index.save(name, index.inserted.size(), version);
+    index.index.load(name, index.inserted.size());
+    index.check_all();
+    index.check_iter();
+  }
+
+  // Unknown versions can't be written.
+  IndexTracker index;
+  ASSERT_THROW(index.index.save(path + "/bad.idx", 0, 99),
+	       cdump::index_error);
+}
+
+// An index can be written straight from a list of entries, as
+// recovery does.  Repeated keys keep the first entry.
+TEST_F(IndexTest, SaveEntries) {
+  const std::string name = path + "/entries.idx";
+
+  IndexTracker index;
+  std::vector<cdump::FileIndex::value_type> entries;
+  for (unsigned i = 0; i < unsigned(index_count); ++i) {
+    index.inserted.insert(i);
+    entries.emplace_back(int_oid(i),
+			 cdump::FileIndex::mapped_type {i, kind_of(i)});
+  }
+  for (unsigned i = 0; i < unsigned(index_count); i += 7)
+    entries.emplace_back(int_oid(i),
+			 cdump::FileIndex::mapped_type {i + index_count,
+							kind_of(i)});
+  std::reverse(entries.begin(), entries.end());
+
+  index.index.save_entries(name, index_count, std::move(entries));
+  index.index.load(name, index_count);
+  index.check_all();
+  index.check_iter();
+}
+
+// Version 6 indexes hold offsets beyond 4 GiB, which the older
+// versions can't.
+TEST_F(IndexTest, Wide) {
+  const std::string name = path + "/wide.idx";
+  const std::string journal = path + "/wide.jnl";
+  const uint64_t base = uint64_t(5) << 30;
+
+  cdump::FileIndex index;
+  for (unsigned i = 0; i < unsigned(index_count); ++i)
+    index.insert(cdump::FileIndex::value_type(
+	int_oid(i), cdump::FileIndex::Node(base + i * 16, kind_of(i))));
+  ASSERT_THROW(index.save(name, base + index_count * 16,
+			  cdump::FileIndex::eytzinger_version),
+	       cdump::index_error);
+  index.save(name, base + index_count * 16);
+  index.load(name, journal, base + index_count * 16);
+
+  index.insert(cdump::FileIndex::value_type(
+      int_oid(index_count), cdump::FileIndex::Node(base * 2, "blob")));
+  index.append_journal(journal, base * 2 + 16);
+
+  cdump::FileIndex other;
+  other.load(name, journal, base * 2 + 16);
+  for (unsigned i = 0; i < unsigned(index_count); ++i) {
+    auto res = other.find(int_oid(i));
+    ASSERT_NE(res, other.end());
+    ASSERT_EQ(res->second.offset, base + i * 16);
+  }
+  auto res = other.find(int_oid(index_count));
+  ASSERT_NE(res, other.end());
+  ASSERT_EQ(res->second.offset, base * 2);
+}
+
+namespace {
+// The layout of a version 1 journal, which had 32-bit sizes and
+// offsets.
+struct OldJournalHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t base_size;
+};
+
+struct OldBatchHeader {
+  uint32_t count;
+  uint32_t end_size;
+  uint32_t check;
+  uint32_t reserved;
+};
+
+struct OldJournalEntry {
+  cdump::OID oid;
+  uint32_t offset;
+  cdump::Kind kind;
+};
+} // namespace
+
+// Journals written before the offsets were widened are still replayed,
+// and the next append carries their entries over to a new journal.
+TEST_F(IndexTest, OldJournal) {
+  const std::string name = path + "/sample.idx";
+  const std::string journal = path + "/sample.jnl";
+
+  IndexTracker index;
+  index.add(0, index_count);
+  index.index.save(name, index_count, cdump::FileIndex::eytzinger_version);
+
+  std::vector<OldJournalEntry> entries;
+  for (unsigned i = index_count; i < unsigned(index_count) + 10; ++i) {
+    index.inserted.insert(i);
+    entries.push_back(OldJournalEntry { int_oid(i), htole32(i), kind_of(i) });
+  }
+  {
+    std::ofstream out(journal, std::ios::binary);
+    OldJournalHeader jhead { { 'l', 'd', 'u', 'm', 'p', 'j', 'n', 'l' },
+			     htole32(1), htole32(index_count) };
+    out.write(reinterpret_cast<const char*>(&jhead), sizeof(jhead));
+
+    OldBatchHeader head { htole32(entries.size()),
+			  htole32(index_count + 10), 0, 0 };
+    uLong crc = crc32(0, Z_NULL, 0);
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(&head.end_size),
+		sizeof(head.end_size));
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(entries.data()),
+		entries.size() * sizeof(OldJournalEntry));
+    head.check = htole32(crc);
+    out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+    out.write(reinterpret_cast<const char*>(entries.data()),
+	      entries.size() * sizeof(OldJournalEntry));
+  }
+
+  index.index.load(name, journal, index_count + 10);
+  index.check_all();
+
+  index.add(index_count + 10, index_count + 20);
+  index.index.append_journal(journal, index_count + 20);
+  index.index.load(name, journal, index_count + 20);
+  index.check_all();
+  index.check_iter();
+}
+
+// The journal extends a saved index.
+TEST_F(IndexTest, Journal) {
+  const std::string name = path + "/sample.idx";
+  const std::string journal = path + "/sample.jnl";
+
+  IndexTracker index;
+  index.add(0, index_count);
+  index.index.save(name, index_count);
+  index.index.load(name, journal, index_count);
+  ASSERT_FALSE(index.index.has_unsaved());
+
+  // Two batches.
+  index.add(index_count, index_count + 10);
+  index.index.append_journal(journal, index_count + 10);
+  index.add(index_count + 10, index_count + 20);
+  index.index.append_journal(journal, index_count + 20);
+
+  index.index.load(name, journal, index_count + 20);
+  ASSERT_TRUE(index.index.has_unsaved());
+  index.check_all();
+  index.check_iter();
+
+  // The journal must reach all the way to the given size.
+  cdump::FileIndex other;
+  ASSERT_THROW(other.load(name, journal, index_count + 21),
+	       cdump::index_error);
+
+  // A torn final batch is dropped, leaving the first one usable.
+  boost::filesystem::resize_file(journal,
+				 boost::filesystem::file_size(journal) - 1);
+  other.load(name, journal, index_count + 10);
+  ASSERT_THROW(other.load(name, journal, index_count + 20),
+	       cdump::index_error);
+
+  // Once the index is saved again, the old journal is ignored, and a
+  // new one replaces it.
+  index.index.save(name, index_count + 20);
+  index.index.load(name, journal, index_count + 20);
+  index.add(index_count + 20, index_count + 30);
+  index.index.append_journal(journal, index_count + 30);
+  index.index.load(name, journal, index_count + 30);
+  index.check_all();
+}
+
+// Damaged or missing index files must be reported as index errors, so
+// that recovery can rebuild them.
+TEST_F(IndexTest, Damaged) {
+  const std::string name = path + "/sample.idx";
+
+  IndexTracker index;
+  index.add(0, index_count);
+  index.index.save(name, index.inserted.size());
+
+  cdump::FileIndex other;
+  ASSERT_THROW(other.load(path + "/missing.idx", index.inserted.size()),
+	       cdump::index_error);
+  ASSERT_THROW(other.load(name, index.inserted.size() + 1),
+	       cdump::index_error);
+
+  // Chop off the end of the hashes.
+  boost::filesystem::resize_file(name, 2048);
+  ASSERT_THROW(other.load(name, index.inserted.size()),
+	       cdump::index_error);
+}
+
+// The filter of a saved index rules out nearly all absent keys, but
+// can't once there are entries that haven't been saved.
+TEST_F(IndexTest, Filter) {
+  const std::string name = path + "/sample.idx";
+  IndexTracker index;
+  index.add(0, index_count);
+  ASSERT_TRUE(index.index.may_contain(int_oid(index_count)));
+  index.index.save(name, index_count);
+  index.index.load(name, index_count);
+
+  for (unsigned i = 0; i < index_count; ++i)
+    ASSERT_TRUE(index.index.may_contain(int_oid(i)));
+  unsigned passed = 0;
+  for (unsigned i = index_count; i < 11 * index_count; ++i) {
+    if (index.index.may_contain(int_oid(i)))
+      ++passed;
+  }
+  ASSERT_LT(passed, unsigned(index_count / 5));
+
+  index.add(11 * index_count);
+  ASSERT_TRUE(index.index.may_contain(int_oid(11 * index_count + 1)));
+  index.check_all();
+}
+
+// Index files count entries in 32 bits.  Building an index of more
+// can't be tested directly, but it is refused by the same check.
+TEST_F(IndexTest, EntryLimit) {
+  ASSERT_EQ(cdump::FileIndex::max_entries, uint64_t(UINT32_MAX));
+  cdump::FileIndex::check_entry_count(cdump::FileIndex::max_entries);
+  ASSERT_THROW(cdump::FileIndex::check_entry_count(
+		 cdump::FileIndex::max_entries + 1), cdump::index_error);
+
+  IndexTracker index;
+  index.add(0, index_count);
+  ASSERT_EQ(index.index.entry_count(), uint64_t(index_count));
+  index.index.save(path + "/sample.idx", index_count);
+  index.index.load(path + "/sample.idx", index_count);
+  index.add(index_count, index_count + 10);
+  ASSERT_EQ(index.index.entry_count(), uint64_t(index_count + 10));
+}
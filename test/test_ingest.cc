@@ -0,0 +1,47 @@
+// Testing the ingest pipeline.
+
+#include "ingest.hh"
+#include "pool.hh"
+
+#include "gtest/gtest.h"
+
+#include "tutil.hh"
+
+#include <future>
+#include <vector>
+
+class Ingest : public Tmpdir {
+};
+
+// Chunks are written in the order they were submitted, no matter
+// which worker built them.
+TEST_F(Ingest, Order) {
+  const unsigned count = 2000;
+  cdump::Pool::create_pool(path);
+  cdump::Pool pool(path, true);
+
+  std::vector<std::future<cdump::OID>> results;
+  {
+    cdump::Ingest ingest(pool, 4, 16);
+    for (unsigned i = 0; i < count; ++i) {
+      const auto text = make_random_string(32 + i % 200, i);
+      cdump::Chunk::data_type data(text.begin(), text.end());
+      results.push_back(ingest.submit("blob", std::move(data)));
+    }
+  }
+
+  std::vector<cdump::OID> oids;
+  for (unsigned i = 0; i < count; ++i) {
+    oids.push_back(results[i].get());
+    auto ch = make_random_chunk(32 + i % 200, i);
+    ASSERT_EQ(oids.back(), ch->oid());
+  }
+
+  const auto where = pool.locate_many(oids.data(), oids.size());
+  for (unsigned i = 0; i < count; ++i) {
+    ASSERT_TRUE(where[i].found);
+    if (i > 0) {
+      ASSERT_LT(where[i - 1].loc.offset, where[i].loc.offset);
+    }
+  }
+}
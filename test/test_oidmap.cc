@@ -0,0 +1,55 @@
+// Testing the flat OID map.
+
+#include "oidmap.hh"
+
+#include <set>
+#include "gtest/gtest.h"
+
+#include "tutil.hh"
+#include "oid.hh"
+
+TEST(OIDMap, Basic) {
+  const unsigned count = 10000;
+  cdump::OIDMap<unsigned> map;
+  ASSERT_TRUE(map.empty());
+  ASSERT_EQ(map.find(int_oid(0)), nullptr);
+
+  for (unsigned i = 0; i < count; ++i) {
+    ASSERT_TRUE(map.insert(std::make_pair(int_oid(i), i)));
+    // Duplicates are not replaced.
+    ASSERT_FALSE(map.insert(std::make_pair(int_oid(i), i + 1)));
+  }
+  ASSERT_EQ(map.size(), count);
+  ASSERT_LE(map.size() * 8, map.capacity() * 7);
+
+  for (unsigned i = 0; i < count; ++i) {
+    auto res = map.find(int_oid(i));
+    ASSERT_NE(res, nullptr);
+    ASSERT_EQ(res->first, int_oid(i));
+    ASSERT_EQ(res->second, i);
+  }
+  for (unsigned i = count; i < 2 * count; ++i)
+    ASSERT_EQ(map.find(int_oid(i)), nullptr);
+
+  // Iteration visits everything once.
+  std::set<unsigned> seen;
+  for (const auto& elt : map) {
+    ASSERT_EQ(elt.first, int_oid(elt.second));
+    ASSERT_TRUE(seen.insert(elt.second).second);
+  }
+  ASSERT_EQ(seen.size(), count);
+
+  map.clear();
+  ASSERT_TRUE(map.empty());
+  ASSERT_EQ(map.find(int_oid(0)), nullptr);
+  ASSERT_TRUE(map.begin() == map.end());
+}
+
+TEST(OIDMap, Reserve) {
+  cdump::OIDMap<unsigned> map;
+  map.reserve(1000);
+  const auto capacity = map.capacity();
+  for (unsigned i = 0; i < 1000; ++i)
+    map.insert(std::make_pair(int_oid(i), i));
+  ASSERT_EQ(map.capacity(), capacity);
+}
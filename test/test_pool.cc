@@ -7,20 +7,29 @@
 #include "gtest/gtest.h"
 
 #include <boost/filesystem.hpp>
+#include <endian.h>
 
+#include <atomic>
 #include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
 
 namespace bf = boost::filesystem;
 
 class Pool : public Tmpdir {
+ protected:
   // Use indirection, since this is driven by requests.
   std::unique_ptr<cdump::Pool> pool;
+ private:
   std::set<unsigned> known;
  public:
   virtual void SetUp();
   virtual void TearDown();
 
-  void create(unsigned limit = cdump::Pool::default_limit,
+  void create(uint64_t limit = cdump::Pool::default_limit,
 	      bool newlib = false);
   void open(bool writable = false);
   void close();
@@ -53,7 +62,7 @@ void Pool::TearDown() {
   Tmpdir::TearDown();
 }
 
-void Pool::create(unsigned limit, bool newlib) {
+void Pool::create(uint64_t limit, bool newlib) {
   ASSERT_FALSE(bool(pool));
   cdump::Pool::create_pool(path, limit, newlib);
 }
@@ -116,6 +125,75 @@ TEST_F(Pool, NewFile) {
   // TODO: Verify that it is present.
 }
 
+// Lookups need to span every file of the pool, including the part of
+// the current file that hasn't been flushed yet.
+TEST_F(Pool, MultipleFiles) {
+  create(cdump::Pool::default_limit, true);
+  for (unsigned i = 0; i < 4; ++i) {
+    open(true);
+    add(i * 500 + 1, (i + 1) * 500 + 1);
+    check();
+    close();
+  }
+
+  open(true);
+  check();
+  add(2001, 2500);
+  check();
+  flush();
+  check();
+  add(2500, 3000);
+  check();
+  close();
+
+  open();
+  check();
+  auto ch = make_random_chunk(32, 0);
+  ASSERT_FALSE(bool(pool->find(ch->oid())));
+}
+
+// The manifest lets the pool be opened without scanning the
+// directory.  Without one, the directory is scanned, and files added
+// after it was written are still found.
+TEST_F(Pool, Manifest) {
+  bf::path manifest = path;
+  manifest /= "metadata";
+  manifest /= "manifest.txt";
+  bf::path stale = manifest;
+  stale += ".stale";
+
+  create(cdump::Pool::default_limit, true);
+  for (unsigned i = 0; i < 3; ++i) {
+    open(true);
+    add(i * 100 + 1, (i + 1) * 100 + 1);
+    close();
+  }
+  ASSERT_TRUE(bf::exists(manifest));
+  bf::copy_file(manifest, stale);
+
+  open(true);
+  add(301, 400);
+  close();
+
+  // Missing the last file.
+  bf::rename(stale, manifest);
+  open();
+  check();
+  close();
+
+  bf::remove(manifest);
+  open();
+  check();
+  close();
+  ASSERT_FALSE(bf::exists(manifest));
+
+  open(true);
+  close();
+  ASSERT_TRUE(bf::exists(manifest));
+  open();
+  check();
+}
+
 // TODO: Index recovery.
 TEST_F(Pool, IndexRecovery) {
   create();
@@ -145,16 +223,24 @@ TEST_F(Pool, IndexRecovery) {
   add(100, 200);
   close();
 
-  // And put the old index back.
+  // And put the old index back.  The new nodes are only recorded in
+  // the index journal, so remove that as well.
   bf::rename(idx2, idx);
+  bf::path jnl = path;
+  jnl /= "pool-data-0000.jnl";
+  ASSERT_TRUE(bf::exists(jnl));
+  bf::remove(jnl);
 
-  // And open, which should throw.
+  // The indexes are loaded lazily, so opening succeeds, but the first
+  // lookup should throw.
+  open();
   try {
-    open();
+    check();
     FAIL();
   } catch (cdump::index_error) {
     // This is OK.
   }
+  close();
 
   // Do index recovery?
   cdump::Pool::recover_index(path);
@@ -162,6 +248,407 @@ TEST_F(Pool, IndexRecovery) {
   check();
 }
 
+// Recovery rebuilds every missing index, across several files.
+TEST_F(Pool, RecoverFiles) {
+  create(cdump::Pool::default_limit, true);
+  for (unsigned i = 0; i < 5; ++i) {
+    open(true);
+    add(i * 300 + 1, (i + 1) * 300 + 1);
+    close();
+  }
+
+  for (unsigned i = 0; i < 5; i += 2) {
+    std::ostringstream name;
+    name << "pool-data-" << std::setw(4) << std::setfill('0') << i;
+    bf::remove(path + "/" + name.str() + ".idx");
+    bf::remove(path + "/" + name.str() + ".jnl");
+  }
+
+  cdump::Pool::recover_index(path);
+  open();
+  check();
+  auto ch = make_random_chunk(32, 0);
+  ASSERT_FALSE(bool(pool->find(ch->oid())));
+}
+
+// Checkpoints made while writing let recovery skip the data that
+// they cover.  Simulate a crash by putting back the index and journal
+// from before the final flush, and then damage the start of the data
+// file, which a full scan would trip over.
+TEST_F(Pool, Checkpoint) {
+  bf::path idx = path;
+  idx /= "pool-data-0000.idx";
+  bf::path jnl = path;
+  jnl /= "pool-data-0000.jnl";
+  bf::path data = path;
+  data /= "pool-data-0000.data";
+
+  create();
+  open(true);
+  add(1, 100);
+  flush();
+  pool->set_checkpoint_interval(4096);
+  add(100, 500);
+  ASSERT_TRUE(bf::exists(jnl));
+  bf::copy_file(idx, path + "/saved.idx");
+  bf::copy_file(jnl, path + "/saved.jnl");
+  add(500, 520);
+  close();
+
+  bf::rename(path + "/saved.idx", idx);
+  bf::rename(path + "/saved.jnl", jnl);
+  {
+    std::fstream file(data.string(), std::ios::in | std::ios::out |
+		      std::ios::binary);
+    file.write("broken", 6);
+  }
+
+  open();
+  ASSERT_THROW(check(519), cdump::index_error);
+  close();
+
+  cdump::Pool::recover_index(path);
+  open();
+  for (unsigned i = 2; i < 520; ++i)
+    check(i);
+}
+
+// Pools written with older index versions can be brought up to date.
+TEST_F(Pool, UpgradeIndexes) {
+  bf::path idx = path;
+  idx /= "pool-data-0000.idx";
+  bf::path jnl = path;
+  jnl /= "pool-data-0000.jnl";
+  bf::path data = path;
+  data /= "pool-data-0000.data";
+
+  create();
+  open(true);
+  add(1, 100);
+  flush();
+  add(100, 200);
+  close();
+
+  {
+    const auto size = bf::file_size(data);
+    cdump::FileIndex old;
+    old.load(idx.string(), jnl.string(), size);
+    old.save(idx.string(), size, cdump::FileIndex::sorted_version);
+    bf::remove(jnl);
+  }
+
+  cdump::Pool::upgrade_indexes(path);
+  {
+    std::ifstream inp(idx.string(), std::ios::binary);
+    char head[12];
+    inp.read(head, sizeof(head));
+    uint32_t version;
+    memcpy(&version, head + 8, sizeof(version));
+    ASSERT_EQ(le32toh(version), unsigned(cdump::FileIndex::current_version));
+  }
+  ASSERT_FALSE(bf::exists(jnl));
+
+  open();
+  check();
+}
+
+// Finished files are merged into runs of the pool index, which are
+// used when the pool is opened again, and `upgrade_indexes` merges
+// everything into a single run.
+TEST_F(Pool, IndexRuns) {
+  bf::path metadata = path;
+  metadata /= "metadata";
+  auto runs = [&metadata]() {
+    std::vector<std::string> names;
+    for (auto elt = bf::directory_iterator(metadata);
+	 elt != bf::directory_iterator();
+	 ++elt) {
+      const auto name = elt->path().filename().string();
+      if (name.compare(0, 11, "pool-index-") == 0)
+	names.push_back(name);
+    }
+    return names;
+  };
+
+  create(cdump::Pool::default_limit, true);
+  const unsigned opens = cdump::PoolIndex::merge_files + 2;
+  for (unsigned i = 0; i < opens; ++i) {
+    open(true);
+    add(i * 100 + 1, (i + 1) * 100 + 1);
+    close();
+  }
+  ASSERT_EQ(runs(), std::vector<std::string> { "pool-index-0000-0007" });
+
+  open();
+  check();
+  auto ch = make_random_chunk(32, 0);
+  ASSERT_FALSE(bool(pool->find(ch->oid())));
+  close();
+
+  cdump::Pool::upgrade_indexes(path);
+  ASSERT_EQ(runs(), std::vector<std::string> { "pool-index-0000-0008" });
+  open();
+  check();
+}
+
+// Files can be limited to sizes well past 4 GiB.
+TEST_F(Pool, LargeLimit) {
+  create(uint64_t(64) << 30);
+  open(true);
+  add(1, 100);
+  close();
+  open();
+  check();
+}
+
+// Placement goes by the upper bound of a chunk's size, but a chunk
+// that only fits once compressed still goes in the current file.
+TEST_F(Pool, PlanFromBound) {
+  const unsigned size = 900000;
+  create(cdump::Pool::limit_lower_bound);
+  open(true);
+  for (unsigned i = 0; i < 2; ++i) {
+    const auto text = make_random_string(size, i);
+    cdump::PlainChunk chunk("blob", text.data(), text.size());
+    ASSERT_GT(chunk.write_size_bound(), size);
+    ASSERT_LT(chunk.write_size(), size / 2);
+    pool->insert(chunk);
+  }
+  close();
+  ASSERT_FALSE(bf::exists(bf::path(path) / "pool-data-0001.data"));
+  ASSERT_TRUE(bf::exists(bf::path(path) / "pool-data-0000.data"));
+}
+
+// Uncompressed chunks in files that are no longer written to are read
+// in place from a mapping.
+TEST_F(Pool, MappedReads) {
+  std::mt19937 gen(1);
+  std::vector<std::unique_ptr<cdump::PlainChunk>> chunks;
+  for (unsigned i = 0; i < 4; ++i) {
+    std::vector<char> data(100000);
+    for (auto& elt : data)
+      elt = char(gen());
+    chunks.emplace_back(new cdump::PlainChunk("blob", data.data(),
+					      data.size()));
+  }
+
+  auto is_mapped = [&](unsigned i) {
+    auto found = pool->find(chunks[i]->oid());
+    EXPECT_TRUE(bool(found));
+    EXPECT_EQ(found->size(), chunks[i]->size());
+    EXPECT_EQ(memcmp(found->data(), chunks[i]->data(), found->size()), 0);
+    return dynamic_cast<const cdump::MappedChunk*>(found.get()) != nullptr;
+  };
+
+  create(cdump::Pool::default_limit, true);
+  open(true);
+  pool->insert(*chunks[0]);
+  pool->insert(*chunks[1]);
+  close();
+
+  // The second file is still being written.
+  open(true);
+  pool->insert(*chunks[2]);
+  pool->insert(*chunks[3]);
+  ASSERT_TRUE(is_mapped(0));
+  ASSERT_FALSE(is_mapped(2));
+  close();
+
+  open();
+  ASSERT_TRUE(is_mapped(1));
+  ASSERT_TRUE(is_mapped(3));
+  pool->set_mapped_reads(false);
+  ASSERT_FALSE(is_mapped(0));
+}
+
+// Flushes after the first just append to the index journal, which
+// must be replayed when the pool is opened again.
+TEST_F(Pool, Journal) {
+  bf::path idx = path;
+  idx /= "pool-data-0000.idx";
+  bf::path jnl = path;
+  jnl /= "pool-data-0000.jnl";
+
+  create();
+  open(true);
+  add(1, 100);
+  flush();
+  ASSERT_TRUE(bf::exists(idx));
+  ASSERT_FALSE(bf::exists(jnl));
+  const auto idx_size = bf::file_size(idx);
+
+  for (unsigned i = 1; i < 5; ++i) {
+    add(i * 100, (i + 1) * 100);
+    flush();
+    check();
+  }
+  ASSERT_TRUE(bf::exists(jnl));
+  ASSERT_EQ(bf::file_size(idx), idx_size);
+  close();
+
+  open();
+  check();
+  close();
+
+  // Once the journal outgrows the index, it is merged back in.
+  open(true);
+  add(500, 10000);
+  flush();
+  ASSERT_FALSE(bf::exists(jnl));
+  check();
+  close();
+
+  open();
+  check();
+}
+
+// Batch lookups find keys from every file, and from the unflushed
+// part of the current file, and report the rest as missing.
+TEST_F(Pool, Batch) {
+  create(cdump::Pool::default_limit, true);
+  open(true);
+  add(1, 500);
+  close();
+  open(true);
+  add(500, 1000);
+
+  // Every third key is missing, and a few are repeated.
+  std::vector<cdump::OID> keys;
+  for (unsigned i = 1; i < 1500; ++i)
+    keys.push_back(make_random_chunk(32, i % 3 == 0 ? i + 10000 : i)->oid());
+  keys.push_back(keys[0]);
+  keys.push_back(keys[3]);
+
+  const auto where = pool->locate_many(keys.data(), keys.size());
+  const auto chunks = pool->find_many(keys.data(), keys.size());
+  ASSERT_EQ(where.size(), keys.size());
+  ASSERT_EQ(chunks.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const auto single = pool->find(keys[i]);
+    ASSERT_EQ(where[i].found, bool(single));
+    ASSERT_EQ(bool(chunks[i]), bool(single));
+    if (single) {
+      ASSERT_EQ(chunks[i]->oid(), keys[i]);
+      ASSERT_EQ(where[i].loc.file, i < 499 || i >= 1499 ? 0u : 1u);
+    }
+  }
+  close();
+}
+
+// With dedup on, chunks already in the pool, whether saved, or just
+// written, aren't written again.
+TEST_F(Pool, Dedup) {
+  bf::path data = path;
+  data /= "pool-data-0000.data";
+
+  create();
+  open(true);
+  add(1, 200);
+  flush();
+  add(200, 300);
+  pool->set_dedup(true);
+
+  for (unsigned i = 1; i < 300; ++i) {
+    auto ch = make_random_chunk(32, i);
+    ASSERT_TRUE(pool->contains(ch->oid()));
+    ASSERT_FALSE(pool->insert(*ch));
+  }
+  auto ch = make_random_chunk(32, 300);
+  ASSERT_FALSE(pool->contains(ch->oid()));
+  ASSERT_TRUE(pool->insert(*ch));
+  ASSERT_FALSE(pool->insert(*ch));
+  close();
+
+  const auto size = bf::file_size(data);
+  open(true);
+  pool->set_dedup(true);
+  for (unsigned i = 1; i <= 300; ++i)
+    ASSERT_FALSE(pool->insert(*make_random_chunk(32, i)));
+  close();
+  ASSERT_EQ(bf::file_size(data), size);
+}
+
+// Several threads can read from one pool at once.
+TEST_F(Pool, ConcurrentReads) {
+  create(cdump::Pool::default_limit, true);
+  for (unsigned i = 0; i < 4; ++i) {
+    open(true);
+    add(i * 500 + 1, (i + 1) * 500 + 1);
+    close();
+  }
+
+  open();
+  std::atomic<unsigned> bad { 0 };
+  std::vector<std::thread> readers;
+  for (unsigned t = 0; t < 4; ++t) {
+    readers.emplace_back([this, t, &bad]() {
+	for (unsigned i = 1; i <= 2000; ++i) {
+	  const unsigned index = (i * 7 + t * 500) % 2000 + 1;
+	  auto ch = make_random_chunk(32, index);
+	  auto ch2 = pool->find(ch->oid());
+	  if (!ch2 || ch2->size() != ch->size() ||
+	      memcmp(ch->data(), ch2->data(), ch->size()) != 0)
+	    ++bad;
+	}
+      });
+  }
+  for (auto& reader : readers)
+    reader.join();
+  ASSERT_EQ(bad, 0u);
+}
+
+// Reads go through the cache, when there is one.
+TEST_F(Pool, Cache) {
+  create();
+  open(true);
+  add(1, 100);
+  flush();
+  add(100, 200);
+
+  auto cache = std::make_shared<cdump::ChunkCache>(1 << 20);
+  pool->set_cache(cache);
+  check();
+  ASSERT_EQ(cache->stats().misses, 199u);
+  ASSERT_EQ(cache->stats().hits, 0u);
+  check();
+  ASSERT_EQ(cache->stats().hits, 199u);
+  close();
+}
+
+// Group commit flushes the index on its own, once enough has been
+// written.
+TEST_F(Pool, GroupCommit) {
+  bf::path idx = path;
+  idx /= "pool-data-0000.idx";
+
+  create();
+  open(true);
+  cdump::Pool::Durability durability;
+  durability.mode = cdump::Pool::Durability::Group;
+  durability.interval = std::chrono::hours(1);
+  durability.bytes = 4096;
+  pool->set_durability(durability);
+
+  add(1, 20);
+  ASSERT_FALSE(bf::exists(idx));
+  add(20, 100);
+  ASSERT_TRUE(bf::exists(idx));
+  check();
+  close();
+
+  open(true);
+  check();
+  durability.mode = cdump::Pool::Durability::Flush;
+  pool->set_durability(durability);
+  add(100, 200);
+  flush();
+  check();
+  close();
+
+  open();
+  check();
+}
+
 #if 0
 TEST(Pool, Basic) {
   bool res = boost::filesystem::create_directory("fazzle");
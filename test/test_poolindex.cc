@@ -0,0 +1,244 @@
+// Testing the pool-wide index.
+
+#include "poolindex.hh"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "tutil.hh"
+#include "oid.hh"
+
+namespace {
+// Fill an index for a pretend file containing [lower, upper).
+void fill(cdump::FileIndex& index, unsigned lower, unsigned upper) {
+  for (unsigned i = lower; i < upper; ++i)
+    index.insert(cdump::FileIndex::value_type(
+		   int_oid(i), cdump::FileIndex::Node(i, "blob")));
+}
+
+void check_range(const cdump::PoolIndex& index, unsigned file,
+		 unsigned lower, unsigned upper)
+{
+  for (unsigned i = lower; i < upper; ++i) {
+    cdump::PoolIndex::Location loc;
+    ASSERT_TRUE(index.find(int_oid(i), loc));
+    ASSERT_EQ(loc.file, file);
+    ASSERT_EQ(loc.offset, i);
+    ASSERT_EQ(loc.kind, cdump::Kind("blob"));
+  }
+}
+
+class PoolIndex : public Tmpdir {
+ protected:
+  // Pretend pool files, each with a saved index of 1000 keys, with
+  // each file's keys overlapping the next one's by half.
+  std::vector<std::unique_ptr<cdump::FileIndex>> files;
+  cdump::PoolIndex::FileSizes sizes;
+
+  void make_files(unsigned count) {
+    for (unsigned n = 0; n < count; ++n) {
+      const unsigned file = files.size();
+      files.emplace_back(new cdump::FileIndex);
+      fill(*files.back(), file * 500, file * 500 + 1000);
+      const auto name = path + "/" + std::to_string(file) + ".idx";
+      files.back()->save(name, file + 1);
+      files.back()->load(name, file + 1);
+      sizes.emplace_back(file, file + 1);
+    }
+  }
+
+  // Open the index, and add the files that aren't covered, finishing
+  // all but the last.
+  void open(cdump::PoolIndex& index) {
+    index.open(path, sizes, true);
+    for (unsigned file = 0; file < files.size(); ++file) {
+      if (index.covers(file))
+	continue;
+      index.add(file, files[file].get());
+      if (file + 1 < files.size())
+	index.finish(file, sizes[file].second);
+    }
+  }
+
+  // The newest file holding each key wins.
+  void check_files(const cdump::PoolIndex& index) {
+    for (unsigned file = 0; file + 1 < files.size(); ++file)
+      check_range(index, file, file * 500, file * 500 + 500);
+    const unsigned last = files.size() - 1;
+    check_range(index, last, last * 500, last * 500 + 1000);
+
+    cdump::PoolIndex::Location loc;
+    ASSERT_FALSE(index.find(int_oid(last * 500 + 1000), loc));
+  }
+
+  unsigned run_files() {
+    unsigned count = 0;
+    for (auto elt = boost::filesystem::directory_iterator(path);
+	 elt != boost::filesystem::directory_iterator();
+	 ++elt) {
+      if (elt->path().filename().string().compare(0, 11, "pool-index-") == 0)
+	++count;
+    }
+    return count;
+  }
+};
+} // namespace
+
+// Without runs, the file indexes are searched in place, along with
+// entries that haven't been saved, and entries added after the file
+// are seen.
+TEST_F(PoolIndex, Files) {
+  make_files(4);
+  cdump::PoolIndex index;
+  open(index);
+  ASSERT_EQ(index.run_count(), 0u);
+  ASSERT_EQ(index.file_count(), 4u);
+
+  cdump::FileIndex unsaved;
+  index.add(4, &unsaved);
+  fill(unsaved, 4000, 4100);
+
+  check_files(index);
+  check_range(index, 4, 4000, 4100);
+}
+
+// Finished files are merged into a run once there are enough of them,
+// and the runs are used again when reopened.
+TEST_F(PoolIndex, Merge) {
+  make_files(cdump::PoolIndex::merge_files);
+  cdump::PoolIndex index;
+  open(index);
+
+  // The last file isn't finished, so there aren't enough yet.
+  index.merge();
+  ASSERT_EQ(index.run_count(), 0u);
+
+  index.finish(files.size() - 1, sizes.back().second);
+  index.merge();
+  ASSERT_EQ(index.run_count(), 1u);
+  ASSERT_EQ(index.file_count(), 0u);
+  ASSERT_EQ(run_files(), 1u);
+  check_files(index);
+
+  make_files(1);
+  cdump::PoolIndex reopened;
+  open(reopened);
+  ASSERT_EQ(reopened.run_count(), 1u);
+  ASSERT_EQ(reopened.file_count(), 1u);
+  ASSERT_TRUE(reopened.covers(cdump::PoolIndex::merge_files - 1));
+  ASSERT_FALSE(reopened.covers(cdump::PoolIndex::merge_files));
+  check_files(reopened);
+}
+
+// Runs are merged with newer ones until they are more than
+// `merge_ratio` times larger, and a full merge leaves a single run.
+TEST_F(PoolIndex, Runs) {
+  const unsigned count = cdump::PoolIndex::merge_files;
+  cdump::PoolIndex index;
+  index.open(path, sizes, true);
+  for (unsigned round = 0; round < 5; ++round) {
+    make_files(count);
+    for (unsigned file = round * count; file < files.size(); ++file) {
+      index.add(file, files[file].get());
+      index.finish(file, sizes[file].second);
+    }
+    index.merge();
+  }
+  ASSERT_EQ(index.run_count(), 2u);
+  ASSERT_EQ(run_files(), 2u);
+
+  make_files(1);
+  index.add(files.size() - 1, files.back().get());
+  check_files(index);
+
+  index.merge(true);
+  ASSERT_EQ(index.run_count(), 1u);
+  ASSERT_EQ(index.file_count(), 1u);
+  ASSERT_EQ(run_files(), 1u);
+  check_files(index);
+}
+
+// A run that no longer agrees with the files, or is damaged, isn't
+// used, and is removed.
+TEST_F(PoolIndex, Stale) {
+  make_files(cdump::PoolIndex::merge_files + 1);
+  {
+    cdump::PoolIndex index;
+    open(index);
+    index.merge();
+    ASSERT_EQ(index.run_count(), 1u);
+  }
+
+  sizes[2].second += 1;
+  files[2]->save(path + "/2.idx", sizes[2].second);
+  files[2]->load(path + "/2.idx", sizes[2].second);
+  {
+    cdump::PoolIndex index;
+    open(index);
+    ASSERT_EQ(index.run_count(), 0u);
+    ASSERT_EQ(run_files(), 0u);
+    check_files(index);
+    index.merge();
+  }
+
+  sizes[2].second -= 1;
+  {
+    std::ofstream(path + "/pool-index-0000-0000") << "garbage";
+    std::ofstream(path + "/pool-index-0000-0001.tmp") << "garbage";
+  }
+  {
+    cdump::PoolIndex index;
+    index.open(path, sizes, false);
+    ASSERT_EQ(index.run_count(), 0u);
+    ASSERT_EQ(run_files(), 3u);
+  }
+  sizes[2].second += 1;
+  cdump::PoolIndex index;
+  open(index);
+  ASSERT_EQ(index.run_count(), 1u);
+  ASSERT_EQ(run_files(), 1u);
+  check_files(index);
+}
+
+// Batched lookups agree with single ones, across runs and files.
+TEST_F(PoolIndex, Many) {
+  make_files(cdump::PoolIndex::merge_files);
+  cdump::PoolIndex index;
+  open(index);
+  index.finish(files.size() - 1, sizes.back().second);
+  index.merge();
+
+  make_files(3);
+  for (unsigned file = files.size() - 3; file < files.size(); ++file) {
+    index.add(file, files[file].get());
+    if (file + 1 < files.size())
+      index.finish(file, sizes[file].second);
+  }
+  ASSERT_EQ(index.run_count(), 1u);
+  ASSERT_EQ(index.file_count(), 3u);
+
+  std::vector<cdump::OID> keys;
+  for (unsigned i = 0; i < 8000; i += 3)
+    keys.push_back(int_oid(i));
+  keys.push_back(int_oid(3));
+
+  std::vector<cdump::PoolIndex::Lookup> results;
+  index.find_many(keys.data(), keys.size(), results);
+  ASSERT_EQ(results.size(), keys.size());
+  unsigned found = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    cdump::PoolIndex::Location loc;
+    const bool present = index.find(keys[i], loc);
+    ASSERT_EQ(results[i].found, present);
+    if (present) {
+      ++found;
+      ASSERT_EQ(results[i].loc.file, loc.file);
+      ASSERT_EQ(results[i].loc.offset, loc.offset);
+    }
+  }
+  ASSERT_EQ(found, 2001u);
+}